@@ -0,0 +1,49 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+local tmpdir = check(mkdtemp())
+
+local function readfile(path)
+	local fh = check(io.open(path, "r"))
+	local data = fh:read"*a"
+	fh:close()
+	return data
+end
+
+local function nentries(path)
+	local n = 0
+	for name in check(unix.opendir(path)):files"name" do
+		if name ~= "." and name ~= ".." then
+			n = n + 1
+		end
+	end
+	return n
+end
+
+local path = tmpdir .. "/file"
+
+check(unix.atomic_write(path, "foo"))
+check(readfile(path) == "foo", "wrong contents after create")
+
+check(unix.atomic_write(path, { "bar", "baz" }, { dirsync = true, mode = tonumber("600", 8) }))
+check(readfile(path) == "barbaz", "wrong contents after replace")
+check(unix.stat(path).mode % 512 == tonumber("600", 8), "wrong mode after replace")
+
+local ok, _, error = unix.atomic_write(path, "quux", { noreplace = true })
+check(not ok and error == unix.EEXIST, "expected EEXIST with noreplace")
+check(readfile(path) == "barbaz", "noreplace modified existing file")
+
+check(unix.atomic_write("relative", "rel", { at = check(unix.opendir(tmpdir)) }))
+check(readfile(tmpdir .. "/relative") == "rel", "wrong contents writing relative to directory")
+
+-- failures must not leave temporary files behind
+check(nentries(tmpdir) == 2, "unexpected directory entries")
+
+check(unix.rmtree(tmpdir))
+
+say"OK"
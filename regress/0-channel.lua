@@ -0,0 +1,63 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+
+if unix.F_SETPIPE_SZ then
+	local r, w = check(unix.pipe("e", 256 * 1024))
+	check(unix.fcntl(w, unix.F_GETPIPE_SZ) >= 256 * 1024, "expected larger pipe")
+	check(unix.fcntl(w, unix.F_SETPIPE_SZ, 100000) >= 100000, "expected size rounded up")
+	unix.close(r)
+	unix.close(w)
+
+	local rf, wf = check(unix.fpipe("e", "full", 8192, 256 * 1024))
+	check(unix.fcntl(wf, unix.F_GETPIPE_SZ) >= 256 * 1024, "expected larger fpipe")
+	rf:close()
+	wf:close()
+end
+
+local ch = check(unix.channel{ size = unix.F_SETPIPE_SZ and 256 * 1024 or nil })
+local pid = check(unix.fork())
+
+if pid == 0 then
+	ch:close"r"
+	for i = 1, 1000 do
+		assert(ch:send(tostring(i)))
+	end
+	assert(ch:send(string.rep("x", 200000)))
+	assert(ch:send(""))
+	unix._exit(0)
+end
+
+ch:close"w"
+
+for i = 1, 1000 do
+	local msg = check(ch:recv())
+	check(msg == tostring(i), "expected message %d, got %s", i, msg)
+end
+check(#check(ch:recv()) == 200000, "expected large message")
+check(ch:recv() == "", "expected empty message")
+
+local msg, why = ch:recv()
+check(msg == nil and why == nil, "expected clean end of stream")
+
+local st = ch:stats()
+check(st.received == 1002, "expected 1002 messages received, got %d", st.received)
+check(st.reads < 1002, "expected buffered reads")
+
+check(unix.waitpid(pid))
+ch:close()
+
+-- atomic channels refuse frames larger than PIPE_BUF
+local ch = check(unix.channel{ atomic = true })
+local ok, _, error = ch:send(string.rep("x", 8192))
+check(not ok and error == unix.EMSGSIZE, "expected EMSGSIZE")
+check(ch:send"small")
+check(ch:recv() == "small", "expected small message")
+ch:close()
+
+say"OK"
@@ -0,0 +1,50 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+
+local function isopen(fd)
+	return unix.fcntl(fd, unix.F_GETFD) ~= nil
+end
+
+local fd = {}
+for i = 1, 4 do
+	fd[i] = check(unix.open("/dev/null"))
+end
+
+check(unix.close_range(fd[1], fd[1]))
+check(not isopen(fd[1]) and isopen(fd[2]), "expected only first descriptor closed")
+
+check(unix.close_range(fd[2], nil, unix.CLOSE_RANGE_CLOEXEC))
+check(isopen(fd[2]) and isopen(fd[4]), "expected descriptors to remain open")
+check(math.floor(unix.fcntl(fd[4], unix.F_GETFD) / unix.FD_CLOEXEC) % 2 == 1, "expected close-on-exec flag")
+
+local ok, _, error = unix.close_range(fd[3], fd[2])
+check(not ok and error == unix.EINVAL, "expected EINVAL for an inverted range")
+
+check(unix.closefrom(fd[2]))
+for i = 2, 4 do
+	check(not isopen(fd[i]), "expected descriptor %d closed", fd[i])
+end
+check(isopen(2), "expected stderr to remain open")
+
+-- exec marks descriptors close-on-exec
+local r, w = check(unix.fpipe"e")
+local extra = check(unix.open("/dev/null"))
+local pid = check(unix.fork())
+if pid == 0 then
+	r:close()
+	unix.dup2(unix.fileno(w), 1)
+	unix.execvp("sh", { "sh", "-c", "test -e /dev/fd/" .. extra .. " || echo closed" }, { closefrom = 3 })
+	unix._exit(1)
+end
+w:close()
+check(r:read"*l" == "closed", "expected descriptor closed across exec")
+check(unix.waitpid(pid))
+check(isopen(extra), "expected descriptor to remain open in parent")
+
+say"OK"
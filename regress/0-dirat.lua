@@ -0,0 +1,93 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+local tmpdir = check(mkdtemp())
+
+local function touch(path)
+	check(io.open(path, "w+")):close()
+end
+
+local function exists(fd, name)
+	return unix.fstatat(fd, name, 0) ~= nil
+end
+
+check(unix.mkpath(tmpdir .. "/A/sub"))
+check(unix.mkpath(tmpdir .. "/B/sub"))
+touch(tmpdir .. "/A/sub/a")
+touch(tmpdir .. "/B/sub/b")
+
+-- absolute parents are cached
+local fd, name = check(unix.dirat(tmpdir .. "/A/sub/a"))
+check(name == "a", "wrong final component (%s)", name)
+check(exists(fd, name), "expected A/sub/a")
+local _, hits = unix.dircache()
+check(unix.dirat(tmpdir .. "/A/sub/x") == fd, "expected the cached object")
+check(select(2, unix.dircache()) == hits + 1, "expected cache hit")
+
+-- a path without a directory component is relative to the cwd
+local cwdfd
+cwdfd, name = check(unix.dirat("x"))
+check(cwdfd:fileno() == unix.AT_FDCWD and name == "x", "expected AT_FDCWD")
+check(exists(cwdfd, "."), "AT_FDCWD object not accepted by fstatat")
+check(cwdfd:close())
+
+-- a cached descriptor closed behind the cache's back, with its number
+-- reused by another directory, isn't served
+local num = fd:fileno()
+fd = nil
+check(unix.close(num))
+local other = check(unix.open(tmpdir .. "/B/sub", unix.O_RDONLY))
+check(other == num, "expected descriptor number %d reused, got %d", num, other)
+fd = check(unix.dirat(tmpdir .. "/A/sub/a"))
+check(exists(fd, "a") and not exists(fd, "b"), "served reused descriptor")
+check(unix.close(other))
+
+-- relative parents follow the working directory
+local cwd = check(unix.getcwd())
+check(unix.chdir(tmpdir .. "/A"))
+fd = check(unix.dirat("sub/x"))
+check(exists(fd, "a"), "expected A/sub")
+check(unix.chdir(tmpdir .. "/B"))
+fd = check(unix.dirat("sub/x"))
+check(exists(fd, "b") and not exists(fd, "a"), "relative dirat resolved against old cwd")
+check(unix.chdir(cwd))
+
+-- returned descriptors survive eviction
+check(unix.dircache(1))
+local fd1 = check(unix.dirat(tmpdir .. "/A/sub/a"))
+local fd2 = check(unix.dirat(tmpdir .. "/B/sub/b"))
+check(exists(fd1, "a"), "descriptor invalidated by eviction")
+check(exists(fd2, "b"), "expected B/sub/b")
+fd1:close()
+fd2:close()
+
+-- in strict mode a directory replaced at the same path is not served
+check(unix.dircache(16, true))
+fd = check(unix.dirat(tmpdir .. "/A/sub/a"))
+fd:close()
+check(unix.rename(tmpdir .. "/A", tmpdir .. "/C"))
+check(unix.mkpath(tmpdir .. "/A/sub"))
+touch(tmpdir .. "/A/sub/new")
+fd = check(unix.dirat(tmpdir .. "/A/sub/new"))
+check(exists(fd, "new") and not exists(fd, "a"), "served replaced directory")
+fd:close()
+
+-- a disabled cache still resolves parents
+check(unix.dircache(0))
+fd = check(unix.dirat(tmpdir .. "/B/sub/b"))
+check(exists(fd, "b"), "expected uncached dirat to work")
+check(unix.dircache() == 0, "expected empty cache")
+fd:close()
+
+local ok, _, error = unix.dirat(tmpdir .. "/B/sub/b/x")
+check(not ok and error == unix.ENOTDIR, "expected ENOTDIR")
+
+check(unix.dircache(16, false))
+check(unix.rmtree(tmpdir))
+
+say"OK"
@@ -0,0 +1,59 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+local tmpdir = check(mkdtemp())
+
+local function mkfile(path, size)
+	local fh = check(io.open(path, "w+"))
+	check(fh:write(string.rep("x", size)))
+	fh:close()
+end
+
+local function lsize(path)
+	return check(unix.lstat(path)).size
+end
+
+-- target outside the tree which du must not follow into
+local outside = check(mkdtemp())
+mkfile(outside .. "/big", 65536)
+
+local root = tmpdir .. "/root"
+check(unix.mkpath(root .. "/d"))
+mkfile(root .. "/f", 1000)
+mkfile(root .. "/d/g", 2000)
+check(unix.link(root .. "/f", root .. "/d/h"))
+check(unix.symlink(outside, root .. "/link"))
+
+local expect = lsize(root) + lsize(root .. "/d") + 1000 + 2000 + lsize(root .. "/link")
+
+-- hard links are counted once by default
+local t, nerr = check(unix.du(root))
+check(nerr == 0, "unexpected errors (%d)", nerr)
+check(#t.path == 1 and t.path[1] == root, "expected a single row for root")
+check(t.size[1] == expect, "expected %d bytes, got %d", expect, t.size[1])
+
+-- ... unless links is set
+t = check(unix.du(root, { links = true }))
+check(t.size[1] == expect + 1000, "expected %d bytes with links, got %d", expect + 1000, t.size[1])
+
+-- subdirectory rows come before their parents
+t = check(unix.du(root, { depth = 1 }))
+check(#t.path == 2, "expected 2 rows, got %d", #t.path)
+check(t.path[2] == root, "expected root last")
+check(t.path[1]:match"/d$", "expected d first, got %s", t.path[1])
+-- the shared inode is charged to whichever link the walk reaches first
+local dsize = lsize(root .. "/d") + 2000
+check(t.size[1] == dsize or t.size[1] == dsize + 1000, "wrong size for d (%d)", t.size[1])
+
+local ok, _, error = unix.du(tmpdir .. "/missing")
+check(not ok and error == unix.ENOENT, "expected ENOENT for missing path")
+
+check(unix.rmtree(tmpdir))
+check(unix.rmtree(outside))
+
+say"OK"
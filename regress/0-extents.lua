@@ -0,0 +1,80 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+
+if not unix.extents then
+	say"SKIP (extents not supported)"
+	return
+end
+
+local tmpdir = check(mkdtemp())
+local path = tmpdir .. "/sparse"
+local RUN, GAP = 65536, 4 * 1024 * 1024
+local fh = check(io.open(path, "w+"))
+
+-- data, a hole, then data
+check(fh:write(string.rep("x", RUN)))
+check(fh:seek("set", RUN + GAP))
+check(fh:write(string.rep("y", RUN)))
+check(fh:flush())
+
+local function extents(file)
+	local runs, pos = {}, 0
+	for offset, length, isdata in unix.extents(file) do
+		check(offset == pos, "extent at %d, expected %d", offset, pos)
+		runs[#runs + 1] = { offset = offset, length = length, isdata = isdata }
+		pos = offset + length
+	end
+	check(pos == 2 * RUN + GAP, "extents end at %d, expected %d", pos, 2 * RUN + GAP)
+	return runs
+end
+
+local runs = extents(fh)
+
+if #runs == 1 then
+	check(runs[1].isdata, "expected whole file as data")
+	say"SKIP (holes not supported by file system)"
+else
+	check(#runs == 3, "expected 3 extents, got %d", #runs)
+	check(runs[1].isdata and runs[1].length == RUN, "expected leading data run")
+	check(not runs[2].isdata and runs[2].length == GAP, "expected hole of %d bytes", GAP)
+	check(runs[3].isdata and runs[3].length == RUN, "expected trailing data run")
+
+	-- offset and length limit the walk
+	local n = 0
+	for offset, length, isdata in unix.extents(fh, RUN, GAP / 2) do
+		n = n + 1
+		check(offset == RUN and length == GAP / 2 and not isdata, "wrong limited extent")
+	end
+	check(n == 1, "expected 1 limited extent, got %d", n)
+
+	if unix.fallocate and unix.FALLOC_FL_PUNCH_HOLE then
+		local mode = unix.FALLOC_FL_PUNCH_HOLE + unix.FALLOC_FL_KEEP_SIZE
+		local ok, why, error = unix.fallocate(fh, mode, 0, RUN)
+
+		if not ok and error == unix.EOPNOTSUPP then
+			say"SKIP (hole punching not supported by file system)"
+		else
+			check(ok, "fallocate: %s", tostring(why))
+			check(fh:seek("end") == 2 * RUN + GAP, "size changed by punching hole")
+
+			runs = extents(fh)
+			check(#runs == 2, "expected 2 extents after punching hole, got %d", #runs)
+			check(not runs[1].isdata and runs[1].length == RUN + GAP, "expected leading hole")
+			check(runs[2].isdata, "expected trailing data run")
+
+			check(fh:seek("set", 0))
+			check(fh:read(RUN) == string.rep("\0", RUN), "punched hole does not read as zeros")
+		end
+	end
+end
+
+fh:close()
+check(unix.rmtree(tmpdir))
+
+say"OK"
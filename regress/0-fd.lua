@@ -0,0 +1,74 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+
+local function isset(flags, flag)
+	return math.floor(flags / flag) % 2 == 1
+end
+
+local fd = unix.fd(check(unix.open("/dev/null", "r")))
+local n = fd:fileno()
+
+check(unix.S_ISCHR(fd:type()), "expected character device")
+check(fd:nonblock() == false and fd:cloexec() == false, "unexpected initial flags")
+
+-- changes through the object and fcntl keep the cache current
+check(fd:nonblock(true) == true)
+check(isset(unix.fcntl(n, unix.F_GETFL), unix.O_NONBLOCK), "expected O_NONBLOCK set")
+check(isset(unix.fcntl(fd, unix.F_GETFL), unix.O_NONBLOCK), "expected O_NONBLOCK through object")
+check(unix.fcntl(fd, unix.F_SETFD, unix.FD_CLOEXEC))
+check(fd:cloexec() == true, "expected cached close-on-exec flag")
+
+-- changes behind its back are seen by fcntl, and by methods after a refresh
+check(unix.fcntl(n, unix.F_SETFL, 0))
+check(not isset(unix.fcntl(fd, unix.F_GETFL), unix.O_NONBLOCK), "fcntl answered from cache")
+check(isset(fd:flags(true), unix.O_NONBLOCK) == false, "expected refreshed flags")
+
+-- setting a flag the stale cache thinks is set still sets it
+check(fd:nonblock(true) == true)
+check(unix.fcntl(n, unix.F_SETFL, 0))
+check(fd:nonblock(true) == true)
+check(isset(unix.fcntl(n, unix.F_GETFL), unix.O_NONBLOCK), "set skipped on stale cache")
+
+-- dup2 onto the object's descriptor drops the cache
+local rd, wr = check(unix.fpipe())
+check(unix.S_ISCHR(fd:type()), "expected character device")
+check(unix.dup2(rd, fd))
+check(unix.S_ISFIFO(fd:type()), "expected pipe after dup2")
+rd:close()
+wr:close()
+
+-- accepted wherever descriptors are
+check(unix.fstat(fd), "expected fstat on fd object")
+check(unix.read(fd, 1) == "", "expected end of file")
+
+check(fd:close())
+check(unix.fcntl(n, unix.F_GETFD) == nil, "expected descriptor closed")
+check(not pcall(unix.fstat, fd), "expected closed object to throw")
+check(fd:close(), "expected repeated close to succeed")
+
+-- handles are duplicated rather than taken over
+local dup = unix.fd(io.stderr)
+check(dup:fileno() ~= 2 and dup:cloexec(), "expected close-on-exec duplicate")
+dup:close()
+check(unix.fcntl(2, unix.F_GETFD), "expected stderr to remain open")
+
+-- release gives up ownership
+local raw = unix.fd(check(unix.open("/dev/null"))):release()
+collectgarbage()
+collectgarbage()
+check(unix.fcntl(raw, unix.F_GETFD), "expected released descriptor to remain open")
+unix.close(raw)
+
+-- collected objects close their descriptor
+local n = unix.fd(check(unix.open("/dev/null"))):fileno()
+collectgarbage()
+collectgarbage()
+check(unix.fcntl(n, unix.F_GETFD) == nil, "expected descriptor closed on collection")
+
+say"OK"
@@ -43,6 +43,25 @@ local function files_fold(t, iter)
 	return t
 end
 
+-- compiled patterns must agree with fnmatch(3)
+local names = {}
+for name in assert(unix.opendir("/etc")):files"name" do
+	names[#names + 1] = name
+end
+
+for _, patt in ipairs{ "*s*", "*.conf", "p*d", "*a*s*", "[a-m]*", "?o*", ".*", "host\\s" } do
+	for _, flags in ipairs{ 0, unix.FNM_PERIOD } do
+		local matched = unix.fnmatchcomp(patt, flags):test(names)
+
+		for i, name in ipairs(names) do
+			local _, expected = assert(unix.fnmatch(patt, name, flags))
+			if matched[i] ~= expected then
+				panic("discrepency between fnmatch(3) and fnmatchcomp (%s, %s)", patt, name)
+			end
+		end
+	end
+end
+
 local list_fnmatch = files_fold({}, files_fnmatch("/etc", "*s*"))
 local list_shfind = files_fold({}, files_shfind("/etc", "*s*"))
 
@@ -25,5 +25,46 @@ check(dt == ln, "could not read back line (%s ~= %s)", dt, tostring(ln))
 check(unix.fileno(fh) ~= unix.fileno(fh2), "descriptor numbers not different")
 check(unix.O_CLOEXEC == unix.bitand(unix.fcntl(fh2, unix.F_GETFL), unix.O_CLOEXEC), "O_CLOEXEC flag not set")
 
+-- handles are minted without opening a file, so they can be created
+-- with no descriptors to spare, well past a pooled batch
+local fds = {}
+for i = 1, 100 do
+	fds[i] = check(unix.dup(fh))
+end
+
+local cur, max = check(unix.getrlimit"nofile")
+local top = 0
+for _, fd in ipairs(fds) do
+	top = math.max(top, fd)
+end
+check(unix.setrlimit("nofile", top + 1, max))
+
+local files = {}
+for i, fd in ipairs(fds) do
+	local ok, fh3 = pcall(unix.fdopen, fd, "r")
+	files[i] = fh3
+	if not ok then
+		break
+	end
+end
+
+check(unix.setrlimit("nofile", cur, max))
+
+for i, fd in ipairs(fds) do
+	check(io.type(files[i]) == "file", "handle %d not created (%s)", i, tostring(files[i]))
+	check(unix.fileno(files[i]) == fd, "wrong descriptor for handle %d", i)
+end
+
+check(files[100]:seek"set" and files[100]:read() == dt, "could not read back line from minted handle")
+files[100]:close()
+check(io.type(files[100]) == "closed file", "expected closed file")
+
+-- collection closes the stream
+local fd = fds[99]
+files = nil
+collectgarbage()
+collectgarbage()
+check(not unix.fcntl(fd, unix.F_GETFD), "descriptor not closed by collection")
+
 
 say"OK"
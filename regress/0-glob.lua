@@ -0,0 +1,46 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+local tmpdir = check(mkdtemp())
+
+local root = tmpdir .. "/spool"
+
+for _, path in ipairs{ "a/incoming", "b/incoming", "c/outgoing" } do
+	check(unix.mkpath(root .. "/" .. path))
+end
+
+for _, path in ipairs{ "a/incoming/1.msg", "a/incoming/.2.msg", "b/incoming/3.msg", "b/incoming/4.txt", "c/outgoing/5.msg" } do
+	check(io.open(root .. "/" .. path, "w+")):close()
+end
+
+local function expect(pattern, flags, ...)
+	local got = check(unix.glob(root .. "/" .. pattern, flags))
+	local exp = { ... }
+
+	check(#got == #exp, "%s: expected %d matches, got %d", pattern, #exp, #got)
+
+	for i=1,#exp do
+		exp[i] = root .. "/" .. exp[i]
+		check(got[i] == exp[i], "%s: expected %s, got %s", pattern, exp[i], tostring(got[i]))
+	end
+
+	info("%s: %d matches", pattern, #got)
+end
+
+expect("*/incoming/*.msg", 0, "a/incoming/1.msg", "b/incoming/3.msg")
+expect("*/incoming/*.msg", unix.GLOB_PERIOD, "a/incoming/.2.msg", "a/incoming/1.msg", "b/incoming/3.msg")
+expect("{a,c}/*/*.msg", unix.GLOB_BRACE, "a/incoming/1.msg", "c/outgoing/5.msg")
+expect("*", unix.GLOB_MARK, "a/", "b/", "c/")
+expect("*/", 0, "a/", "b/", "c/")
+expect("b/incoming/*", unix.GLOB_ONLYDIR)
+expect("nothing/*", 0)
+expect("nothing/*", unix.GLOB_NOCHECK, "nothing/*")
+
+check(unix.rmtree(root))
+
+say"OK"
@@ -0,0 +1,130 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+
+local fh = check(io.tmpfile())
+local a = check(unix.lockmgr(fh))
+
+check(a:lock(0, 10))
+check(a:lock(20, 10, "r", 0))
+check(a:unlock(20, 10))
+
+if a:stats().ofd then
+	-- each manager has its own open file description, so managers made
+	-- from the same handle exclude each other
+	local b = check(unix.lockmgr(fh))
+
+	-- a single attempt by default, suggesting a growing retry delay
+	local ok, _, error, retry = b:trylock(5, 10)
+	check(ok == false and error == unix.EAGAIN, "expected EAGAIN")
+	check(retry == 0.001, "expected 1ms retry delay, got %s", tostring(retry))
+	ok, _, error, retry = b:lock(5, 10)
+	check(ok == false and error == unix.EAGAIN, "expected lock to make a single attempt")
+	check(retry == 0.002, "expected 2ms retry delay, got %s", tostring(retry))
+
+	local _, _, error, retry = b:lock(5, 10, "w", 0.05)
+	check(error == unix.ETIMEDOUT and retry == nil, "expected ETIMEDOUT")
+
+	local l = check(b:test(0, 1))
+	check(l.type == unix.F_WRLCK and l.start == 0 and l.len == 10, "wrong conflicting lock")
+	check(b:test(10, 10) == false, "expected no conflict")
+
+	local st = b:stats()
+	check(st.contended == 3 and st.timeouts == 1 and st.retries > 0, "wrong stats")
+	check(st.waited >= 0.05 and st.maxwait >= 0.05, "wrong wait time")
+
+	check(a:unlock(0, 10))
+	check(b:trylock(5, 10))
+
+	-- a granted lock resets the backoff
+	_, _, _, retry = a:trylock(0, 10)
+	check(retry == 0.001, "expected 1ms retry delay")
+	check(a:trylock(20, 10))
+	_, _, _, retry = a:trylock(0, 10)
+	check(retry == 0.001, "backoff not reset by granted lock")
+	check(a:unlock(20, 10))
+	check(b:close())
+
+	check(unix.fcntl(fh, unix.F_OFD_SETLK, { start = 0, len = 1 }))
+	check(unix.fcntl(fh, unix.F_OFD_GETLK, { start = 0, len = 1 }).type == unix.F_UNLCK)
+	check(unix.fcntl(fh, unix.F_OFD_SETLK, { type = unix.F_UNLCK, start = 0, len = 1 }))
+else
+	check(a:unlock(0, 10))
+end
+
+-- a child holding the lock releases it while we wait with a deadline
+local r, w = check(unix.pipe())
+local pid = check(unix.fork())
+
+if pid == 0 then
+	local c = assert(unix.lockmgr(fh))
+	assert(c:lock(0, 0))
+	unix.close(r)
+	unix.close(w)
+	unix.sleep(1)
+	unix._exit(0)
+end
+
+unix.close(w)
+unix.read(r, 1)
+unix.close(r)
+
+check(a:lock(0, 0, "w", 10))
+local st = a:stats()
+check(st.contended >= 1 and st.retries >= 1 and st.maxwait > 0, "expected contention")
+
+local _, how, status = check(unix.waitpid(pid))
+check(how == "exited" and status == 0, "child failed")
+check(a:unlock(0, 0))
+
+-- a negative timeout blocks in F_SETLKW
+r, w = check(unix.pipe())
+pid = check(unix.fork())
+
+if pid == 0 then
+	local c = assert(unix.lockmgr(fh))
+	assert(c:lock(0, 0))
+	unix.close(r)
+	unix.close(w)
+	unix.sleep(1)
+	unix._exit(0)
+end
+
+unix.close(w)
+unix.read(r, 1)
+unix.close(r)
+
+check(a:lock(0, 0, "w", -1))
+check(a:stats().retries == st.retries, "expected to block rather than retry")
+
+_, how, status = check(unix.waitpid(pid))
+check(how == "exited" and status == 0, "child failed")
+
+check(a:close())
+
+-- closing a manager drops its locks even while the source handle is open
+a = check(unix.lockmgr(fh))
+check(a:lock(0, 0))
+check(a:close())
+pid = check(unix.fork())
+if pid == 0 then
+	local c = assert(unix.lockmgr(fh))
+	unix._exit(c:trylock(0, 0) and 0 or 1)
+end
+_, how, status = check(unix.waitpid(pid))
+check(how == "exited" and status == 0, "close did not release locks")
+
+-- paths are opened read-write and created
+local tmpdir = check(mkdtemp())
+a = check(unix.lockmgr(tmpdir .. "/lock"))
+check(a:lock(0, 1, "w", 0))
+check(unix.stat(tmpdir .. "/lock"), "expected lock file")
+check(a:close())
+check(unix.rmtree(tmpdir))
+
+say"OK"
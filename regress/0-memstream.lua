@@ -0,0 +1,62 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+
+if not unix.open_memstream then
+	say"SKIP (open_memstream not supported)"
+	return
+end
+
+local fh = check(unix.open_memstream())
+check(fh:write("hello ", 42, "\n"))
+check(check(unix.getmemstream(fh)) == "hello 42\n", "unexpected contents")
+
+-- seeking past the end leaves a hole of zeros
+check(fh:seek("set", 16))
+check(fh:write"!")
+check(check(unix.getmemstream(fh)) == "hello 42\n" .. string.rep("\0", 7) .. "!", "expected zero fill")
+
+-- contents outlive the stream
+check(fh:seek("set", 0))
+check(fh:write"J")
+fh:close()
+check(check(unix.getmemstream(fh)):sub(1, 5) == "Jello", "expected contents after close")
+
+check(not pcall(unix.getmemstream, io.stdout), "expected non-memstream handle to throw")
+
+local big = check(unix.open_memstream())
+local n = 0
+for i = 1, 10000 do
+	local s = tostring(i) .. "\n"
+	big:write(s)
+	n = n + #s
+end
+check(#check(unix.getmemstream(big)) == n, "unexpected size")
+big:close()
+
+local rd = check(unix.fmemopen("one\ntwo\nthree"))
+local lines = {}
+for ln in rd:lines() do lines[#lines + 1] = ln end
+check(table.concat(lines, ",") == "one,two,three", "unexpected lines")
+check(rd:seek("set", 4) == 4)
+check(rd:read"*l" == "two")
+rd:close()
+
+local empty = check(unix.fmemopen(""))
+check(empty:read"*a" == "", "expected empty read")
+empty:close()
+
+-- streams dropped without closing shouldn't leak or crash
+for i = 1, 1000 do
+	unix.open_memstream():write"x"
+	unix.fmemopen(string.rep("y", i))
+end
+collectgarbage()
+collectgarbage()
+
+say"OK"
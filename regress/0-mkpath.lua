@@ -0,0 +1,53 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+local tmpdir = check(mkdtemp())
+
+local function isdir(path)
+	local st = unix.stat(path)
+	return st and unix.S_ISDIR(st.mode)
+end
+
+-- fully missing path below an existing prefix
+check(unix.mkpath(tmpdir .. "/a/b/c"))
+check(isdir(tmpdir .. "/a/b/c"), "mkpath did not create leaf")
+
+-- existing path is a no-op
+check(unix.mkpath(tmpdir .. "/a/b/c"))
+check(unix.mkpath(tmpdir .. "/a/b/c/"))
+
+-- partial prefix, with intermediate and leaf modes
+unix.umask(tonumber("022", 8))
+check(unix.mkpath(tmpdir .. "/a/b/d/e/f", tonumber("0700", 8), tonumber("0750", 8)))
+check(isdir(tmpdir .. "/a/b/d/e/f"), "mkpath did not create partial prefix")
+st = check(unix.stat(tmpdir .. "/a/b/d/e/f"))
+check(st.mode % 512 == tonumber("0700", 8), "wrong leaf mode %o", st.mode % 512)
+st = check(unix.stat(tmpdir .. "/a/b/d"))
+check(st.mode % 512 == tonumber("0750", 8), "wrong intermediate mode %o", st.mode % 512)
+
+-- non-directory component
+check(io.open(tmpdir .. "/file", "w+")):close()
+local ok, _, error = unix.mkpath(tmpdir .. "/file/x/y")
+check(not ok and error == unix.ENOTDIR, "expected ENOTDIR, got %s", tostring(error))
+ok, _, error = unix.mkpath(tmpdir .. "/file")
+check(not ok and error == unix.ENOTDIR, "expected ENOTDIR for leaf, got %s", tostring(error))
+
+-- batches sharing prefixes, and the index of a failing path
+check(unix.mkpaths{ tmpdir .. "/m/1", tmpdir .. "/m/2/x", tmpdir .. "/m/2/y", tmpdir .. "/a" })
+for _, path in ipairs{ "/m/1", "/m/2/x", "/m/2/y" } do
+	check(isdir(tmpdir .. path), "mkpaths did not create %s", path)
+end
+
+local why, index
+ok, why, error, index = unix.mkpaths{ tmpdir .. "/n/1", tmpdir .. "/file/z", tmpdir .. "/n/2" }
+check(not ok and error == unix.ENOTDIR and index == 2, "expected ENOTDIR at index 2, got %s at %s", tostring(error), tostring(index))
+check(isdir(tmpdir .. "/n/1") and not unix.stat(tmpdir .. "/n/2"), "mkpaths continued past failure")
+
+check(unix.rmtree(tmpdir))
+
+say"OK"
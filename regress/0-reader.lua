@@ -0,0 +1,78 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+local tmpdir = check(mkdtemp())
+
+local path = tmpdir .. "/data"
+local data = {}
+for i = 1, 10000 do
+	data[#data + 1] = string.format("%08d\n", i)
+end
+data = table.concat(data)
+
+local fh = check(io.open(path, "w+"))
+check(fh:write(data))
+fh:close()
+
+local function slurp(rd)
+	local t = {}
+	for s in rd.read, rd do
+		t[#t + 1] = s
+	end
+	return table.concat(t), #t
+end
+
+-- owned descriptor from a path
+local rd = check(unix.reader(path, { chunk = 4096, window = 16384 }))
+local s, n = slurp(rd)
+check(s == data, "wrong contents from path")
+check(n == math.ceil(#data / 4096), "expected %d chunks, got %d", math.ceil(#data / 4096), n)
+check(rd:tell() == #data, "wrong offset at end of file")
+
+local st = rd:stats()
+check(st.bytes == #data and st.reads >= n, "wrong stats")
+check(st.elapsed >= 0 and st.wait >= 0, "wrong times")
+
+check(rd:seek(#data - 9))
+check(rd:read() == "00010000\n", "wrong chunk after seek")
+check(rd:read() == nil, "expected end of file")
+check(rd:close())
+
+-- a FILE handle is kept open while the reader lives, even if unreferenced
+rd = check(unix.reader(check(io.open(path, "r")), { chunk = 1000 }))
+collectgarbage"collect"
+collectgarbage"collect"
+for _ = 1, 16 do
+	check(io.open(path, "r")):close() -- reuse any freed descriptor number
+end
+s = slurp(rd)
+check(s == data, "wrong contents from collected FILE handle")
+check(rd:close())
+
+-- the handle outlives the reader and stays usable
+fh = check(io.open(path, "r"))
+rd = check(unix.reader(fh))
+check(slurp(rd) == data, "wrong contents from FILE handle")
+check(rd:close())
+check(fh:read(8) == "00000001", "reader closed borrowed handle")
+fh:close()
+
+-- integer descriptors are borrowed
+local fd = check(unix.open(path, unix.O_RDONLY))
+rd = check(unix.reader(fd))
+check(slurp(rd) == data, "wrong contents from descriptor")
+check(rd:close())
+check(unix.fstat(fd), "reader closed borrowed descriptor")
+unix.close(fd)
+
+local ok, _, error = unix.reader(tmpdir .. "/missing")
+check(not ok and error == unix.ENOENT, "expected ENOENT")
+
+check(unix.rmtree(tmpdir))
+
+say"OK"
@@ -0,0 +1,72 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+local tmpdir = check(mkdtemp())
+local root = check(unix.realpath(tmpdir))
+
+check(unix.mkdir(root .. "/a"))
+check(unix.mkdir(root .. "/b"))
+check(unix.symlink("a", root .. "/link"))
+
+local function stats()
+	local count, hits, misses, gen = unix.realpathcache()
+	return count, hits, misses, gen
+end
+
+-- disabled by default
+local _, hits0, misses0 = stats()
+check(unix.realpath(root .. "/link") == root .. "/a", "wrong realpath")
+local count, hits, misses = stats()
+check(count == 0 and hits == hits0 and misses == misses0, "cache used while disabled")
+
+-- a miss fills the cache, a repeat lookup hits it
+unix.realpathcache(16, false)
+check(unix.realpath(root .. "/link") == root .. "/a", "wrong realpath")
+count, hits, misses = stats()
+check(count == 1 and hits == hits0 and misses == misses0 + 1, "expected 1 entry after miss (count:%d hits:%d misses:%d)", count, hits, misses)
+check(unix.realpath(root .. "/link") == root .. "/a", "wrong cached realpath")
+count, hits, misses = stats()
+check(count == 1 and hits == hits0 + 1 and misses == misses0 + 1, "expected hit (count:%d hits:%d misses:%d)", count, hits, misses)
+
+-- relative paths depend on the working directory and aren't cached
+local n = count
+check(unix.realpath("."))
+check((stats()) == n, "relative path cached")
+
+-- without strict a replaced symbolic link is served stale
+check(unix.unlink(root .. "/link"))
+check(unix.symlink("b", root .. "/link"))
+check(unix.realpath(root .. "/link") == root .. "/a", "expected stale result without strict")
+
+-- bumping the generation invalidates every entry
+local _, _, _, gen = stats()
+local _, hits1, misses1, gen1 = unix.realpathcache(nil, nil, true)
+check(gen1 == gen + 1, "generation not incremented")
+check(unix.realpath(root .. "/link") == root .. "/b", "stale result after flush")
+_, hits, misses = stats()
+check(hits == hits1 and misses == misses1 + 1, "expected miss after flush")
+
+-- strict notices a replaced symbolic link
+unix.realpathcache(nil, true)
+check(unix.realpath(root .. "/link") == root .. "/b", "wrong cached realpath")
+_, hits1, misses1 = stats()
+check(hits1 == hits + 1, "expected strict hit")
+check(unix.unlink(root .. "/link"))
+check(unix.symlink("a", root .. "/link"))
+check(unix.realpath(root .. "/link") == root .. "/a", "strict served replaced symbolic link")
+_, hits, misses = stats()
+check(hits == hits1 and misses == misses1 + 1, "expected strict miss")
+
+-- resizing discards all entries
+count = unix.realpathcache(8)
+check(count == 0, "entries kept after resize")
+
+unix.realpathcache(0, false)
+check(unix.rmtree(tmpdir))
+
+say"OK"
@@ -0,0 +1,100 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+
+local function slurp(fh)
+	local fd = check(unix.open(fh, "r"))
+	local rd = check(unix.fdopen(fd, "r"))
+	local s = rd:read"*a"
+	rd:close()
+	return s
+end
+
+local fh = check(io.tmpfile())
+check(fh:write"hello")
+check(fh:flush())
+
+local fd, why, error = unix.open(fh, "r")
+if not fd and (error == unix.ENOTSUP or error == unix.EOPNOTSUPP) then
+	say"SKIP (reopen unsupported)"
+	say"OK"
+	os.exit(0)
+end
+check(fd, "%s", tostring(why))
+unix.close(fd)
+
+for i=1,3 do
+	check(slurp(fh) == "hello", "reopen %d returned wrong contents", i)
+end
+
+local pid = check(unix.fork())
+if pid == 0 then
+	local ok, s = pcall(slurp, fh)
+	unix._exit((ok and s == "hello") and 0 or 1)
+end
+
+local _, how, status = check(unix.waitpid(pid))
+check(how == "exited" and status == 0, "reopen failed in forked child")
+
+check(slurp(fh) == "hello", "reopen failed in parent after fork")
+
+-- running out of descriptors must not disable the /proc/self/fd fast path
+if unix.uname"sysname" == "Linux" and unix.stat"/proc/self/fd" then
+	local function dirfds()
+		local dir = check(unix.opendir"/proc/self/fd")
+		local self = check(unix.fileno(dir))
+		local fds = {}
+		for name in dir:files"name" do
+			local fd = tonumber(name)
+			local path = fd and fd ~= self and unix.readlink("/proc/self/fd/" .. name)
+			if path and path:match"^/proc/%d+/fd$" then
+				fds[#fds + 1] = fd
+			end
+		end
+		dir:close()
+		return fds
+	end
+
+	local dirfd = dirfds()[1]
+	check(dirfd, "expected a cached /proc/self/fd descriptor")
+
+	pid = check(unix.fork())
+	if pid == 0 then
+		-- the child must reopen dirfd, and closing the inherited one
+		-- won't free a slot below the limit
+		assert(unix.setrlimit("nofile", dirfd, dirfd))
+		local fds = {}
+		while true do
+			local fd = unix.dup(fh)
+			if not fd then break end
+			fds[#fds + 1] = fd
+		end
+
+		local ok, _, error = unix.open(fh, "r")
+		if ok or error ~= unix.EMFILE then
+			unix._exit(2)
+		end
+
+		-- make room, including the standard streams as the dups may
+		-- not have been needed to reach the limit
+		for _, fd in ipairs(fds) do
+			unix.close(fd)
+		end
+		for fd = 0, 2 do
+			unix.close(fd)
+		end
+
+		local ok, s = pcall(slurp, fh)
+		unix._exit((ok and s == "hello" and #dirfds() == 1) and 0 or 1)
+	end
+
+	_, how, status = check(unix.waitpid(pid))
+	check(how == "exited" and status == 0, "fast path disabled by EMFILE (%d)", status)
+end
+
+say"OK"
@@ -0,0 +1,60 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+local tmpdir = check(mkdtemp())
+
+-- target outside the tree which rmtree must not descend into
+local outside = check(mkdtemp())
+check(io.open(outside .. "/keep", "w+")):close()
+
+local root = tmpdir .. "/root"
+check(unix.mkpath(root .. "/a/b/c"))
+check(unix.mkpath(root .. "/d"))
+
+local nfile = 64
+
+for i=1,nfile do
+	check(io.open(string.format("%s/a/b/%02x", root, i), "w+")):close()
+end
+
+check(unix.symlink(outside, root .. "/a/link"))
+check(unix.symlink(outside, root .. "/link"))
+
+-- files + a + a/b + a/b/c + d + two symlinks
+local n = check(unix.rmtree(root, { keep = true }))
+check(n == nfile + 6, "expected %d entries removed, got %d", nfile + 6, n)
+check(unix.stat(root), "rmtree removed directory despite keep option")
+check(unix.stat(outside .. "/keep"), "rmtree followed symbolic link")
+info("removed %d entries", n)
+
+check(unix.mkpath(root .. "/e/f"))
+check(unix.rmtree(check(unix.opendir(root))) == 2, "rmtree of DIR handle failed")
+check(unix.rmtree(root) == 1, "rmtree of empty directory failed")
+
+local ok, _, error = unix.rmtree(root)
+check(not ok and error == unix.ENOENT, "expected ENOENT removing missing tree")
+
+-- depth isn't limited by the descriptor limit
+local deep = root .. string.rep("/d", 200)
+check(unix.mkpath(deep))
+check(io.open(deep .. "/file", "w+")):close()
+check(unix.symlink(outside, deep .. "/link"))
+local pid = check(unix.fork())
+if pid == 0 then
+	assert(unix.setrlimit("nofile", 32, 32))
+	local n = unix.rmtree(root)
+	unix._exit(n == 203 and 0 or 1)
+end
+local _, how, status = check(unix.waitpid(pid))
+check(how == "exited" and status == 0, "rmtree of deep tree failed")
+check(not unix.stat(root), "deep tree not removed")
+check(unix.stat(outside .. "/keep"), "rmtree followed symbolic link")
+
+check(unix.unlink(outside .. "/keep"))
+
+say"OK"
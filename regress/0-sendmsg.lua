@@ -0,0 +1,83 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+
+local a, b = check(unix.socketpair(unix.AF_UNIX, unix.SOCK_STREAM))
+
+-- pass a FILE handle and an integer descriptor
+local fh = check(io.tmpfile())
+check(fh:write"passed")
+check(fh:flush())
+local null = check(unix.open("/dev/null"))
+
+check(unix.sendmsg(a, "x", 0, { fds = { fh, null } }) == 1, "expected 1 byte sent")
+
+local data, fds, _, flags = check(unix.recvmsg(b, 16))
+check(data == "x", "unexpected data")
+check(#fds == 2, "expected 2 descriptors, got %d", #fds)
+check(flags == 0, "unexpected message flags %d", flags)
+
+for i = 1, #fds do
+	check(fds[i] ~= null and fds[i] ~= unix.fileno(fh), "expected new descriptors")
+	check(math.floor(unix.fcntl(fds[i], unix.F_GETFD) / unix.FD_CLOEXEC) % 2 == 1, "expected close-on-exec flag")
+end
+
+local copy = check(unix.fdopen(fds[1], "r"))
+check(copy:seek("set", 0))
+check(copy:read"*a" == "passed", "expected contents of passed file")
+copy:close()
+unix.close(fds[2])
+
+-- too little room for all descriptors
+local many = {}
+for i = 1, 32 do
+	many[i] = null
+end
+check(unix.sendmsg(a, "y", 0, { fds = many }))
+local data, fds, _, flags = check(unix.recvmsg(b, 16, 0, { maxfds = 1 }))
+check(data == "y", "unexpected data")
+check(#fds == 1, "expected 1 descriptor, got %d", #fds)
+check(unix.MSG_CTRUNC == nil or math.floor(flags / unix.MSG_CTRUNC) % 2 == 1, "expected MSG_CTRUNC")
+for i = 1, #fds do
+	unix.close(fds[i])
+end
+
+-- control message padding doesn't admit more than maxfds
+check(unix.sendmsg(a, "y", 0, { fds = many }))
+data, fds, _, flags = check(unix.recvmsg(b, 16, 0, { maxfds = 3 }))
+check(#fds == 3, "expected 3 descriptors, got %d", #fds)
+check(unix.MSG_CTRUNC == nil or math.floor(flags / unix.MSG_CTRUNC) % 2 == 1, "expected MSG_CTRUNC")
+for i = 1, #fds do
+	unix.close(fds[i])
+end
+
+check(not pcall(unix.sendmsg, a, "z", 0, { fds = { "bogus" } }), "expected invalid descriptor to throw")
+
+-- credentials
+if unix.uname"sysname" == "Linux" then
+	check(unix.sendmsg(a, "c", 0, { cred = true }))
+	local data, fds, cred = check(unix.recvmsg(b, 16, 0, { cred = true }))
+	check(data == "c" and #fds == 0, "unexpected message")
+	check(cred and cred.pid == unix.getpid(), "expected sender pid")
+	check(cred.uid == unix.geteuid() and cred.gid == unix.getegid(), "expected sender ids")
+
+	-- SO_PASSCRED stays set, and room for credentials doesn't count against maxfds
+	check(unix.sendmsg(a, "d", 0, { fds = many }))
+	data, fds, cred, flags = check(unix.recvmsg(b, 16, 0, { maxfds = 2 }))
+	check(data == "d" and #fds == 2, "expected 2 descriptors, got %d", #fds)
+	check(cred and cred.pid == unix.getpid(), "expected sender pid")
+	check(unix.MSG_CTRUNC == nil or math.floor(flags / unix.MSG_CTRUNC) % 2 == 1, "expected MSG_CTRUNC")
+	for i = 1, #fds do
+		unix.close(fds[i])
+	end
+end
+
+unix.close(a)
+unix.close(b)
+
+say"OK"
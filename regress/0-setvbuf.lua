@@ -0,0 +1,43 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+
+-- fully buffered pipe should hold a write larger than BUFSIZ until flushed
+local r, w = check(unix.fpipe("e", 65536))
+check(unix.fcntl(unix.fileno(r), unix.F_SETFL, unix.O_NONBLOCK))
+check(w:write(string.rep("x", 16384)))
+local ok, _, errno = unix.read(unix.fileno(r), 1)
+check(not ok and errno == unix.EAGAIN, "expected write to remain buffered")
+check(w:flush())
+check(#check(unix.read(unix.fileno(r), 65536)) == 16384, "expected flushed data")
+w:close()
+r:close()
+
+-- unbuffered stream should write through immediately
+local r, w = check(unix.fpipe("e", "none"))
+check(w:write"x")
+check(check(unix.read(unix.fileno(r), 1)) == "x", "expected unbuffered write")
+w:close()
+r:close()
+
+-- any Lua file handle
+local fh = check(io.open("/dev/null", "w"))
+check(unix.setvbuf(fh, "line"))
+check(unix.setvbuf(fh, "full", 4096))
+check(unix.setvbuf(fh, 8192))
+check(not pcall(unix.setvbuf, fh, "bogus"), "expected bad mode to throw")
+fh:close()
+
+local fh = check(unix.fdopen(check(unix.open("/dev/null", "w")), "w", "line"))
+local dup = check(unix.fdup(fh, "w", 1024))
+local at = check(unix.fopenat(unix.AT_FDCWD, "/dev/null", "w", nil, "full", 1024))
+dup:close()
+at:close()
+fh:close()
+
+say"OK"
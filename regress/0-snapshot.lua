@@ -0,0 +1,64 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+local tmpdir = check(mkdtemp())
+
+local function writefile(path, data)
+	local fh = check(io.open(tmpdir .. "/" .. path, "w"))
+	check(fh:write(data))
+	fh:close()
+end
+
+check(unix.mkpath(tmpdir .. "/a/b"))
+writefile("a/f", "foo")
+writefile("g", "bar")
+
+local old, nerr = check(unix.snapshot(tmpdir))
+check(#old == 4, "expected 4 entries, got %d", #old)
+check(nerr == 0, "unexpected errors (%d)", nerr)
+check(select(3, old:find("a/f")) == 3, "wrong size recorded for a/f")
+
+local st = check(unix.lstat(tmpdir .. "/a/f"))
+local _, _, _, sec, nsec = old:find("a/f")
+check(math.type == nil or (math.type(sec) == "integer" and math.type(nsec) == "integer"), "expected integer mtime")
+check(sec == math.floor(st.mtime) and nsec >= 0 and nsec < 1000000000, "wrong mtime recorded for a/f (%s.%s)", tostring(sec), tostring(nsec))
+check(old:find("nonexistent") == nil, "found nonexistent entry")
+
+writefile("g", "barbaz")
+check(unix.unlink(tmpdir .. "/a/f"))
+writefile("a/b/new", "")
+
+local new = check(unix.snapshot(tmpdir))
+local added, removed, changed = old:diff(new)
+check(#added == 1 and added[1] == "a/b/new", "wrong added list")
+check(#removed == 1 and removed[1] == "a/f", "wrong removed list")
+local found = false
+for _, path in ipairs(changed) do
+	found = found or path == "g"
+end
+check(found, "g not reported as changed")
+
+local copy = check(unix.loadsnapshot(new:dump()))
+added, removed, changed = copy:diff(new)
+check(#copy == #new and #added == 0 and #removed == 0 and #changed == 0, "snapshot changed by dump/loadsnapshot")
+
+local ok, _, error = unix.loadsnapshot(new:dump():sub(1, -2))
+check(not ok and error == unix.EINVAL, "expected EINVAL loading truncated snapshot")
+
+-- an unreadable directory is counted and skipped, not fatal
+if unix.geteuid() ~= 0 then
+	check(unix.chmod(tmpdir .. "/a", "0000"))
+	local snap, nerr = check(unix.snapshot(tmpdir))
+	check(nerr == 1, "expected 1 error, got %d", nerr)
+	check(snap:find("a") and not snap:find("a/b"), "wrong entries for unreadable directory")
+	check(unix.chmod(tmpdir .. "/a", "0755"))
+end
+
+check(unix.rmtree(tmpdir))
+
+say"OK"
@@ -0,0 +1,86 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+local tmpdir = check(mkdtemp())
+
+local function openfile(name)
+	local fh = check(io.open(tmpdir .. "/" .. name, "w"))
+	check(fh:write(name))
+	check(fh:flush())
+	return fh
+end
+
+-- an empty queue is never due and commits nothing
+local sg = check(unix.syncgroup{ window = 3600, bytes = 100 })
+check(not sg:due(), "empty group due")
+check(sg:commit() == 0, "expected empty commit")
+check(sg:stats().batches == 0, "empty commit counted as batch")
+
+-- the same file is queued once, by handle or descriptor
+local a, b = openfile"a", openfile"b"
+check(not sg:add(a, 10), "due after first add")
+check(not sg:add(unix.fileno(a), 10), "due after second add")
+check(not sg:add(b), "due after third add")
+check(sg:stats().pending == 2, "expected 2 pending, got %d", sg:stats().pending)
+
+-- the byte limit makes the batch due
+check(sg:add(b, 80), "expected due after byte limit")
+check(sg:due(), "expected due")
+
+-- queued files may be closed before the commit
+a:close()
+b:close()
+check(sg:commit() == 2, "expected 2 descriptors committed")
+check(not sg:due(), "due after commit")
+
+local st = sg:stats()
+check(st.batches == 1 and st.fds == 2 and st.pending == 0, "wrong stats after commit")
+check(st.last >= 0 and st.max >= st.last and st.avg == st.last, "wrong latency stats")
+
+-- the window makes the batch due
+sg = check(unix.syncgroup{ window = 0, data = false })
+local c = openfile"c"
+check(sg:add(c), "expected due with empty window")
+check(sg:commit() == 1, "expected 1 descriptor committed")
+check(sg:add(c), "expected due with empty window")
+check(sg:commit() == 1, "expected 1 descriptor committed")
+st = sg:stats()
+check(st.batches == 2 and st.fds == 2, "wrong stats after 2 batches")
+check(st.max >= st.last and st.avg >= 0 and st.avg <= st.max, "wrong latency stats")
+
+-- a reused descriptor number is a different file, not already queued
+sg = check(unix.syncgroup{ window = 3600 })
+local e = openfile"e"
+local fd = unix.fileno(e)
+sg:add(fd)
+e:close()
+e = openfile"f"
+check(unix.fileno(e) == fd, "descriptor number not reused")
+sg:add(e)
+check(sg:stats().pending == 2, "reused descriptor treated as queued")
+e:close()
+check(sg:commit() == 2, "expected 2 descriptors committed")
+
+-- files on one file system share a single syncfs
+sg = check(unix.syncgroup{ syncfs = 2 })
+local d = openfile"d"
+sg:add(c)
+sg:add(d)
+check(sg:commit() == 2, "expected 2 descriptors committed")
+st = sg:stats()
+check(st.fds == 2, "expected 2 descriptors synced, got %d", st.fds)
+info("syncfs calls: %d", st.syncfs)
+
+c:close()
+d:close()
+sg = nil
+collectgarbage()
+
+check(unix.rmtree(tmpdir))
+
+say"OK"
@@ -0,0 +1,60 @@
+#!/bin/sh
+_=[[
+	. "${0%/*}/regress.sh"
+	exec runlua -r5.2 "$0" "$@"
+]]
+
+require"regress".export".*"
+local unix = require"unix"
+local tmpdir = check(mkdtemp())
+
+-- Linux 4.7+ reports the mask in /proc/self/status
+local function procumask()
+	local fh = io.open("/proc/self/status", "r")
+	if not fh then
+		return
+	end
+	local data = fh:read"*a"
+	fh:close()
+	local mask = data:match"\nUmask:%s*(%d+)\n"
+	return mask and tonumber(mask, 8)
+end
+
+local omask = unix.umask()
+check(type(omask) == "number", "expected number from umask")
+check(unix.umask() == omask, "umask changed by query")
+
+local pmask = procumask()
+if pmask then
+	check(omask == pmask, "expected umask %.3o, got %.3o", pmask, omask)
+end
+
+-- setting returns the previous mask and updates the cached one
+check(unix.umask("027") == omask, "expected previous umask returned")
+check(unix.umask() == tonumber("027", 8), "cached umask not updated")
+if procumask() then
+	check(procumask() == tonumber("027", 8), "process umask not updated")
+end
+
+-- symbolic modes without a who apply the cached umask
+local path = tmpdir .. "/file"
+local fh = check(io.open(path, "w"))
+fh:close()
+
+check(unix.chmod(path, "0000"))
+check(unix.chmod(path, "+rwx"))
+local mode = check(unix.stat(path, "mode")) % 512
+check(mode == tonumber("750", 8), "expected mode 750 with umask 027, got %.3o", mode)
+
+check(unix.umask("077") == tonumber("027", 8), "expected previous umask returned")
+check(unix.chmod(path, "0000"))
+check(unix.chmod(path, "+rwx"))
+mode = check(unix.stat(path, "mode")) % 512
+check(mode == tonumber("700", 8), "expected mode 700 with umask 077, got %.3o", mode)
+
+check(unix.umask(string.format("%.3o", omask)) == tonumber("077", 8), "expected previous umask returned")
+check(unix.umask() == omask, "umask not restored")
+
+check(unix.rmtree(tmpdir))
+
+say"OK"
@@ -35,4 +35,25 @@ for i=1,#path_st do
 	check(path_st[i] ~= nil, "required field is nil")
 end
 
+local fields = unix.statfields("dev", "ino", "mode", "nlink", "uid", "gid", "size")
+local set_st = { check(unix.stat(path, fields)) }
+
+check(#set_st == #path_st, "stat field set calling broken")
+
+for i=1,#path_st do
+	check(path_st[i] == set_st[i], "mismatched values (%s, %s)", tostring(path_st[i]), tostring(set_st[i]))
+end
+
+local t = {}
+check(unix.stat(path, t) == t, "stat table fill didn't return caller's table")
+check(t.ino == path_st[2], "stat table fill broken")
+
+local cols, errs = unix.statmany({ path, "/nonexistent/" }, fields)
+check(cols.ino[1] == path_st[2] and errs[1] == 0, "statmany broken")
+check(cols.ino[2] == false and errs[2] == unix.ENOENT, "statmany error reporting broken")
+
+local vfs = check(unix.statvfs(path))
+check(vfs.blocks >= vfs.bfree and vfs.bfree >= vfs.bavail, "statvfs block counts inconsistent")
+check(unix.fstatvfs(dir).fsid == vfs.fsid, "fstatvfs of directory handle broken")
+
 say"OK"
@@ -59,7 +59,9 @@
 #include <sys/resource.h> /* RLIMIT_* RUSAGE_SELF struct rlimit struct rusage getrlimit(2) getrusage(2) setrlimit(2) */
 #include <sys/socket.h>   /* AF_* SOCK_* struct sockaddr socket(2) */
 #include <sys/stat.h>     /* S_ISDIR() */
+#include <sys/statvfs.h>  /* ST_* struct statvfs fstatvfs(2) statvfs(2) */
 #include <sys/time.h>     /* struct timeval gettimeofday(2) */
+#include <sys/uio.h>      /* struct iovec writev(2) */
 #include <sys/un.h>       /* struct sockaddr_un */
 #include <sys/utsname.h>  /* uname(2) */
 #include <sys/wait.h>     /* WNOHANG waitpid(2) */
@@ -68,7 +70,7 @@
 #include <termios.h>      /* tcgetsid(3) */
 #include <net/if.h>       /* IF_NAMESIZE struct ifconf struct ifreq */
 #include <unistd.h>       /* _PC_NAME_MAX access(2) alarm(3) chdir(2) chroot(2) close(2) chdir(2) chown(2) chroot(2) dup2(2) execve(2) execl(2) execlp(2) execvp(2) faccessat(2) fork(2) fpathconf(3) getcwd(3) getegid(2) geteuid(2) getgid(2) getgroups(2) gethostname(3) getpgid(2) getpgrp(2) getpid(2) getppid(2) getuid(2) isatty(3) issetugid(2) lchown(2) lockf(3) link(2) pathconf(3) pread(2) pwrite(2) realpath(3) rename(2) rmdir(2) setegid(2) seteuid(2) setgid(2) setgroups(2) setpgid(2) setuid(2) setsid(2) symlink(2) sysconf(3) tcgetpgrp(3) tcsetpgrp(3) truncate(2) umask(2) unlink(2) unlinkat(2) */
-#include <fcntl.h>        /* AT_* F_* O_* fcntl(2) open(2) openat(2) */
+#include <fcntl.h>        /* AT_* F_* O_* SPLICE_F_* fcntl(2) open(2) openat(2) vmsplice(2) */
 #include <fnmatch.h>      /* FNM_* fnmatch(3) */
 #include <pwd.h>          /* struct passwd getpwnam_r(3) */
 #include <grp.h>          /* struct group getgrnam_r(3) */
@@ -403,10 +405,23 @@
 #define HAVE_PIPE2 (GLIBC_PREREQ(2,9) || FREEBSD_PREREQ(10,0) || NETBSD_PREREQ(6,0) || UCLIBC_PREREQ(0,9,32))
 #endif
 
+#ifndef HAVE_CLOSE_RANGE
+#define HAVE_CLOSE_RANGE (GLIBC_PREREQ(2,34) || FREEBSD_PREREQ(13,0))
+#endif
+
+/* glibc's closefrom aborts the process if it can't close a descriptor */
+#ifndef HAVE_CLOSEFROM
+#define HAVE_CLOSEFROM (FREEBSD_PREREQ(8,0) || NETBSD_PREREQ(3,0) || __OpenBSD__ || __sun)
+#endif
+
 #ifndef HAVE_DUP3
 #define HAVE_DUP3 (GLIBC_PREREQ(2,9) || FREEBSD_PREREQ(10,0) || NETBSD_PREREQ(6,0) || UCLIBC_PREREQ(0,9,34))
 #endif
 
+#ifndef HAVE_FCHMODAT
+#define HAVE_FCHMODAT HAVE_OPENAT
+#endif
+
 #ifndef HAVE_FDATASYNC
 #define HAVE_FDATASYNC (!__APPLE__ && !__FreeBSD__)
 #endif
@@ -419,10 +434,18 @@
 #define HAVE_FMEMOPEN (!_AIX && !__sun && (!__NetBSD__ || NETBSD_PREREQ(6,0)))
 #endif
 
+#ifndef HAVE_FOPENCOOKIE
+#define HAVE_FOPENCOOKIE (GLIBC_PREREQ(2,2) || MUSL_MAYBE)
+#endif
+
 #ifndef HAVE_FSTATAT
 #define HAVE_FSTATAT HAVE_OPENAT
 #endif
 
+#ifndef HAVE_FUNOPEN
+#define HAVE_FUNOPEN (__APPLE__ || __FreeBSD__ || __NetBSD__ || __OpenBSD__ || __DragonFly__)
+#endif
+
 #ifndef HAVE_ISSETUGID
 #define HAVE_ISSETUGID (!__linux && !_AIX)
 #endif
@@ -459,6 +482,10 @@
 #define HAVE_NETINET6_IN6_VAR_H (HAVE_DECL___KAME__ && !HAVE_IFADDRS_H)
 #endif
 
+#ifndef HAVE_FALLOCATE
+#define HAVE_FALLOCATE (GLIBC_PREREQ(2,10) || MUSL_MAYBE)
+#endif
+
 #ifndef HAVE_GETENV_R
 #define HAVE_GETENV_R NETBSD_PREREQ(5,0)
 #endif
@@ -511,6 +538,10 @@
 #define HAVE_RENAMEAT HAVE_OPENAT
 #endif
 
+#ifndef HAVE_RENAMEAT2
+#define HAVE_RENAMEAT2 GLIBC_PREREQ(2,28)
+#endif
+
 #ifndef HAVE_SIGTIMEDWAIT
 #define HAVE_SIGTIMEDWAIT (!__APPLE__ && !__OpenBSD__)
 #endif
@@ -536,6 +567,14 @@
 #define HAVE_SYMLINKAT HAVE_OPENAT
 #endif
 
+#ifndef HAVE_SYNC_FILE_RANGE
+#define HAVE_SYNC_FILE_RANGE (GLIBC_PREREQ(2,6) || MUSL_MAYBE)
+#endif
+
+#ifndef HAVE_SYNCFS
+#define HAVE_SYNCFS (GLIBC_PREREQ(2,14) || MUSL_MAYBE)
+#endif
+
 #ifndef HAVE_SYS_SIGLIST
 #define HAVE_SYS_SIGLIST (!MUSL_MAYBE && !__sun && !_AIX && !__UCLIBC__ && !GLIBC_PREREQ(2,32))
 #endif
@@ -544,6 +583,10 @@
 #define HAVE_UNLINKAT HAVE_OPENAT
 #endif
 
+#ifndef HAVE_VMSPLICE
+#define HAVE_VMSPLICE (GLIBC_PREREQ(2,5) || MUSL_MAYBE)
+#endif
+
 #ifndef HAVE_DECL_SYS_SIGLIST
 #define HAVE_DECL_SYS_SIGLIST HAVE_SYS_SIGLIST
 #endif
@@ -612,6 +655,14 @@
  *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#ifndef HAVE_DECL_SYS_CLOSE_RANGE
+#if defined SYS_close_range
+#define HAVE_DECL_SYS_CLOSE_RANGE 1
+#else
+#define HAVE_DECL_SYS_CLOSE_RANGE 0
+#endif
+#endif
+
 #ifndef HAVE_DECL_SYS_GETRANDOM
 #if defined SYS_getrandom
 #define HAVE_DECL_SYS_GETRANDOM 1
@@ -1581,6 +1632,20 @@ static u_error_t u_strerror_r(int error, char *dst, size_t lim) {
 #define U_FDFLAGS  (U_CLOEXEC)  /* file descriptor flags */
 #define U_FLFLAGS  (~U_FDFLAGS) /* file status flags */
 
+/*
+ * Flags for opening a directory only to anchor *at() calls. O_SEARCH and
+ * O_PATH don't require read permission on the directory.
+ */
+#if defined O_SEARCH
+#define U_ATFLAGS (O_SEARCH|U_CLOEXEC)
+#elif defined O_PATH
+#define U_ATFLAGS (O_PATH|O_DIRECTORY|U_CLOEXEC)
+#elif defined O_DIRECTORY
+#define U_ATFLAGS (O_RDONLY|O_DIRECTORY|U_CLOEXEC)
+#else
+#define U_ATFLAGS (O_RDONLY|U_CLOEXEC)
+#endif
+
 #define U_FLAGS_MIN LLONG_MIN
 #define U_FLAGS_MAX LLONG_MAX
 #define u_flags_t long long
@@ -1687,6 +1752,122 @@ static u_error_t u_getflags(int fd, u_flags_t *flags) {
 } /* u_getflags() */
 
 
+/*
+ * Emulated regardless of system support, so the flag is always defined.
+ * Linux and FreeBSD agree on the value.
+ */
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+static void u_close_range_one(int fd, int flags) {
+	if (flags & CLOSE_RANGE_CLOEXEC)
+		(void)u_setflag(fd, U_CLOEXEC, 1);
+	else
+		(void)u_close_nocancel(fd);
+} /* u_close_range_one() */
+
+/*
+ * Close, or mark close-on-exec, only the descriptors actually open, as
+ * listed by the process' descriptor directory.
+ */
+static u_error_t u_close_range_scan(unsigned first, unsigned last, int flags) {
+#if __linux || __sun
+	DIR *dp;
+	struct dirent *ent;
+	unsigned long fd;
+	char *end;
+	int dfd, error;
+
+	if (!(dp = opendir("/proc/self/fd")))
+		return errno;
+
+	dfd = dirfd(dp);
+
+	for (;;) {
+		errno = 0;
+
+		if (!(ent = readdir(dp))) {
+			error = errno;
+			break;
+		}
+
+		if (*ent->d_name < '0' || *ent->d_name > '9')
+			continue;
+
+		fd = strtoul(ent->d_name, &end, 10);
+
+		if (*end || fd < first || fd > last || (int)fd == dfd)
+			continue;
+
+		u_close_range_one(fd, flags);
+	}
+
+	closedir(dp);
+
+	return error;
+#else
+	(void)first;
+	(void)last;
+	(void)flags;
+
+	return ENOTSUP;
+#endif
+} /* u_close_range_scan() */
+
+/*
+ * Close every descriptor from first through last inclusive, or with
+ * CLOSE_RANGE_CLOEXEC only mark them close-on-exec, like close_range(2).
+ * Falls back to closefrom(3), then to scanning the open descriptors, and
+ * finally to a loop up to the descriptor limit.
+ */
+static u_error_t u_close_range(unsigned first, unsigned last, int flags) {
+	long max;
+	unsigned fd;
+
+	if (first > last)
+		return EINVAL;
+
+#if HAVE_CLOSE_RANGE
+	if (0 == close_range(first, last, flags))
+		return 0;
+	/* Linux 5.9 and 5.10 lack CLOSE_RANGE_CLOEXEC */
+	if (errno != ENOSYS && !(errno == EINVAL && (flags & CLOSE_RANGE_CLOEXEC)))
+		return errno;
+#elif HAVE_SYSCALL && HAVE_DECL_SYS_CLOSE_RANGE
+	if (0 == syscall(SYS_close_range, first, last, flags))
+		return 0;
+	if (errno != ENOSYS && !(errno == EINVAL && (flags & CLOSE_RANGE_CLOEXEC)))
+		return errno;
+#endif
+
+	/* anything else, like CLOSE_RANGE_UNSHARE, needs the kernel */
+	if (flags & ~CLOSE_RANGE_CLOEXEC)
+		return EINVAL;
+
+	if (first > INT_MAX)
+		return 0;
+
+#if HAVE_CLOSEFROM
+	if (!flags && last >= INT_MAX) {
+		closefrom(first);
+		return 0;
+	}
+#endif
+
+	if (!u_close_range_scan(first, last, flags))
+		return 0;
+
+	if (-1 == (max = sysconf(_SC_OPEN_MAX)) || max > INT_MAX)
+		max = INT_MAX;
+
+	for (fd = first; fd < (unsigned long)max && fd <= last; fd++)
+		u_close_range_one(fd, flags);
+
+	return 0;
+} /* u_close_range() */
+
+
 static u_error_t u_getaccmode(int fd, u_flags_t *oflags, u_flags_t flags) {
 	u_flags_t _flags;
 
@@ -1766,6 +1947,29 @@ error:
 } /* u_open() */
 
 
+#if HAVE_OPENAT
+static u_error_t u_openat(int *fd, int at, const char *path, u_flags_t flags, mode_t mode) {
+	int error;
+
+	if (-1 == (*fd = openat(at, path, (U_SYSFLAGS & flags), mode)))
+		goto syerr;
+
+	flags &= ~(O_NONBLOCK|U_SYSFLAGS); /* see u_open */
+
+	if ((error = u_fixflags(*fd, flags)))
+		goto error;
+
+	return 0;
+syerr:
+	error = errno;
+error:
+	u_close(fd);
+
+	return error;
+} /* u_openat() */
+#endif
+
+
 static u_error_t u_pipe(int *fd, u_flags_t flags) {
 	int ok, i, error;
 
@@ -1796,6 +2000,29 @@ static u_error_t u_pipe(int *fd, u_flags_t flags) {
 } /* u_pipe() */
 
 
+/*
+ * Resize the pipe buffer shared by both ends of a pipe. Linux rounds the
+ * size up to a power of two pages, and limits unprivileged processes to
+ * /proc/sys/fs/pipe-max-size.
+ */
+static u_error_t u_setpipesz(int fd, size_t size) {
+#if defined F_SETPIPE_SZ
+	if (size > INT_MAX)
+		return EINVAL;
+
+	if (-1 == fcntl(fd, F_SETPIPE_SZ, (int)size))
+		return errno;
+
+	return 0;
+#else
+	(void)fd;
+	(void)size;
+
+	return ENOTSUP;
+#endif
+} /* u_setpipesz() */
+
+
 static u_error_t u_dup2(int fd, int fd2, u_flags_t flags) {
 	int error;
 
@@ -3112,11 +3339,37 @@ static int unixL_newmetatable(lua_State *L, const char *name, const luaL_Reg *me
 } /* unixL_newmetatable() */
 
 
+struct fdobj;
+
+struct dircache_ent {
+	char *path;
+	struct fdobj *fo; /* referenced from the registry table */
+	dev_t dev;
+	ino_t ino;
+	unsigned long used; /* LRU clock value at last hit */
+}; /* struct dircache_ent */
+
+struct rpcache_ent {
+	char *path; /* NULL if slot is empty; also holds real */
+	const char *real;
+	size_t hash;
+	unsigned long gen;
+	dev_t dev;
+	ino_t ino;
+	_Bool ref; /* CLOCK reference bit */
+}; /* struct rpcache_ent */
+
 typedef struct unixL_State {
 	struct {
 		_Bool jit;
 		int openf; /* LuaJIT io.open reference */
 		int opene; /* PUC Lua 5.1 file handle environment */
+		int pool;  /* LuaJIT array of closed file handles for reuse */
+		int npool;
+		int local; /* index of first path io.open succeeded on */
+		int anchor; /* weak keyed table of memory kept alive by handles */
+		int shell; /* LuaJIT closed file handle copied when minting */
+		int udtype; /* offset back to its GCudata udtype; -1 if unusable */
 	} lua;
 
 	int error; /* errno value from last failed syscall */
@@ -3172,6 +3425,10 @@ typedef struct unixL_State {
 	struct {
 		char path[64];
 		int error;
+		_Bool stat;   /* path format needs st_dev and st_ino */
+		int dirfd;    /* /proc/self/fd, for Linux fast path */
+		pid_t pid;    /* process which opened dirfd */
+		_Bool noself; /* /proc/self/fd unavailable */
 	} fd;
 
 	struct {
@@ -3191,10 +3448,30 @@ typedef struct unixL_State {
 	struct {
 		int ident; /* registry reference to ident string */
 	} log;
+
+	struct {
+		struct dircache_ent *ent;
+		size_t count, max;
+		int ref; /* registry table of descriptor objects keyed by path */
+		_Bool strict; /* compare against a fresh stat of the path */
+		unsigned long clock, hits, misses;
+	} dircache;
+
+	struct {
+		_Bool cached;
+		mode_t mask;
+	} umask;
+
+	struct {
+		struct rpcache_ent *ent;
+		size_t size, count, max, hand;
+		_Bool strict; /* also compare against fresh stats of both paths */
+		unsigned long gen, hits, misses;
+	} rpcache;
 } unixL_State;
 
 static const unixL_State unixL_initializer = {
-	.lua = { 0, LUA_NOREF, LUA_NOREF },
+	.lua = { 0, LUA_NOREF, LUA_NOREF, LUA_NOREF, 0, 0, LUA_NOREF, LUA_NOREF, 0 },
 	.ts = { { -1, -1 } },
 #if !HAVE_ARC4RANDOM
 	.random = UNIXL_RANDOM_INITIALIZER,
@@ -3203,7 +3480,9 @@ static const unixL_State unixL_initializer = {
 	.tm = { MACH_PORT_NULL, MACH_PORT_NULL },
 #endif
 	.net = { -1, NULL },
+	.fd = { .dirfd = -1 },
 	.log = { .ident = LUA_NOREF },
+	.dircache = { .max = 16, .ref = LUA_NOREF },
 };
 
 #define UNIXL_MAGIC_INITIALIZER { 0, { 0 } }
@@ -3261,8 +3540,18 @@ static int unixL_init(lua_State *L, unixL_State *U) {
 		}
 
 		lua_pop(L, 1);
+
+		lua_newtable(L);
+		U->lua.pool = luaL_ref(L, LUA_REGISTRYINDEX);
 	}
 
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushstring(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	U->lua.anchor = luaL_ref(L, LUA_REGISTRYINDEX);
+
 #if LUA_VERSION_NUM == 501
 	if (!U->lua.jit) {
 		lua_createtable(L, 0, 1);
@@ -3301,11 +3590,198 @@ static int unixL_init(lua_State *L, unixL_State *U) {
 } /* unixL_init() */
 
 
+/*
+ * Free the cache bookkeeping. The descriptor objects are closed when the
+ * registry table holding them is collected.
+ */
+static void dircache_clear(unixL_State *U) {
+	size_t i;
+
+	for (i = 0; i < U->dircache.count; i++)
+		free(U->dircache.ent[i].path);
+
+	free(U->dircache.ent);
+	U->dircache.ent = NULL;
+	U->dircache.count = 0;
+} /* dircache_clear() */
+
+/*
+ * realpath cache, an open addressed (linear probing) table keyed by the
+ * unresolved path. Disabled until a maximum is set. Entries are
+ * invalidated wholesale by bumping the generation, and optionally
+ * revalidated on each hit by comparing the device and inode of both the
+ * unresolved and resolved paths. Eviction uses the CLOCK algorithm.
+ */
+static size_t rpcache_hash(const char *path) {
+	size_t h = 2166136261U;
+
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619U;
+	}
+
+	return h;
+} /* rpcache_hash() */
+
+static size_t rpcache_find(unixL_State *U, const char *path, size_t hash) {
+	size_t mask = U->rpcache.size - 1, i;
+
+	for (i = hash & mask; U->rpcache.ent[i].path; i = (i + 1) & mask) {
+		if (U->rpcache.ent[i].hash == hash && !strcmp(U->rpcache.ent[i].path, path))
+			return i;
+	}
+
+	return -1;
+} /* rpcache_find() */
+
+/* delete slot i, shifting back any entries displaced past it */
+static void rpcache_delete(unixL_State *U, size_t i) {
+	struct rpcache_ent *ent = U->rpcache.ent;
+	size_t mask = U->rpcache.size - 1, j, k;
+
+	free(ent[i].path);
+	ent[i].path = NULL;
+	U->rpcache.count--;
+
+	for (j = (i + 1) & mask; ent[j].path; j = (j + 1) & mask) {
+		k = ent[j].hash & mask;
+
+		/* can j move to i without passing its home slot k? */
+		if ((j > i)? (k <= i || k > j) : (k <= i && k > j)) {
+			ent[i] = ent[j];
+			ent[j].path = NULL;
+			i = j;
+		}
+	}
+} /* rpcache_delete() */
+
+static void rpcache_evict(unixL_State *U) {
+	struct rpcache_ent *ent = U->rpcache.ent;
+	size_t mask = U->rpcache.size - 1;
+
+	for (;; U->rpcache.hand = (U->rpcache.hand + 1) & mask) {
+		if (!ent[U->rpcache.hand].path)
+			continue;
+
+		if (ent[U->rpcache.hand].gen == U->rpcache.gen && ent[U->rpcache.hand].ref) {
+			ent[U->rpcache.hand].ref = 0;
+			continue;
+		}
+
+		rpcache_delete(U, U->rpcache.hand);
+
+		return;
+	}
+} /* rpcache_evict() */
+
+static _Bool rpcache_isvalid(unixL_State *U, const struct rpcache_ent *ent) {
+	struct stat st;
+
+	if (ent->gen != U->rpcache.gen)
+		return 0;
+
+	if (U->rpcache.strict) {
+		if (0 != stat(ent->real, &st) || st.st_dev != ent->dev || st.st_ino != ent->ino)
+			return 0;
+		if (0 != stat(ent->path, &st) || st.st_dev != ent->dev || st.st_ino != ent->ino)
+			return 0;
+	}
+
+	return 1;
+} /* rpcache_isvalid() */
+
+static const char *rpcache_lookup(unixL_State *U, const char *path, size_t hash) {
+	size_t i;
+
+	if ((size_t)-1 == (i = rpcache_find(U, path, hash)))
+		goto miss;
+
+	if (!rpcache_isvalid(U, &U->rpcache.ent[i])) {
+		rpcache_delete(U, i);
+		goto miss;
+	}
+
+	U->rpcache.ent[i].ref = 1;
+	U->rpcache.hits++;
+
+	return U->rpcache.ent[i].real;
+miss:
+	U->rpcache.misses++;
+
+	return NULL;
+} /* rpcache_lookup() */
+
+/* failure to cache is not an error, as the caller already has its answer */
+static void rpcache_insert(unixL_State *U, const char *path, size_t hash, const char *real) {
+	size_t plen = strlen(path), rlen = strlen(real);
+	size_t mask = U->rpcache.size - 1, i;
+	struct stat st;
+	char *copy;
+
+	if (0 != stat(real, &st))
+		return;
+
+	if (!(copy = malloc(plen + rlen + 2)))
+		return;
+
+	memcpy(copy, path, plen + 1);
+	memcpy(copy + plen + 1, real, rlen + 1);
+
+	if (U->rpcache.count >= U->rpcache.max)
+		rpcache_evict(U);
+
+	for (i = hash & mask; U->rpcache.ent[i].path; i = (i + 1) & mask)
+		;;
+
+	U->rpcache.ent[i].path = copy;
+	U->rpcache.ent[i].real = copy + plen + 1;
+	U->rpcache.ent[i].hash = hash;
+	U->rpcache.ent[i].gen = U->rpcache.gen;
+	U->rpcache.ent[i].dev = st.st_dev;
+	U->rpcache.ent[i].ino = st.st_ino;
+	U->rpcache.ent[i].ref = 0;
+	U->rpcache.count++;
+} /* rpcache_insert() */
+
+/* resize the cache, discarding all entries */
+static u_error_t rpcache_setmax(unixL_State *U, size_t max) {
+	struct rpcache_ent *ent = NULL;
+	size_t size = 0, i;
+
+	if (max > 0) {
+		/* keep the load factor at or below one half */
+		for (size = 2; size < max * 2; size *= 2)
+			;;
+
+		if (!(ent = calloc(size, sizeof *ent)))
+			return errno;
+	}
+
+	for (i = 0; i < U->rpcache.size; i++)
+		free(U->rpcache.ent[i].path);
+
+	free(U->rpcache.ent);
+
+	U->rpcache.ent = ent;
+	U->rpcache.size = size;
+	U->rpcache.count = 0;
+	U->rpcache.max = max;
+	U->rpcache.hand = 0;
+
+	return 0;
+} /* rpcache_setmax() */
+
+
 static void unixL_destroy(unixL_State *U) {
+	dircache_clear(U);
+	rpcache_setmax(U, 0);
+
 	free(U->net.fds.buf);
 	U->net.fds.buf = NULL;
 	U->net.fds.bufsiz = 0;
 	u_close(&U->net.fd);
+
+	u_close(&U->fd.dirfd);
 	u_freeaddrinfo(&U->net.res);
 
 #if USE_CLOCK_GET_TIME
@@ -3779,6 +4255,13 @@ static size_t unixL_checksize(lua_State *L, int index) {
 	return unixL_checkunsigned(L, index, 0, MIN(UNIXL_UNSIGNED_MAX, SIZE_MAX));
 } /* unixL_checksize() */
 
+static size_t unixL_optsize(lua_State *L, int index, size_t def) {
+	if (lua_isnoneornil(L, index))
+		return def;
+
+	return unixL_checksize(L, index);
+} /* unixL_optsize() */
+
 static void unixL_pushsize(lua_State *L, size_t size) {
 	if (size > UNIXL_UNSIGNED_MAX)
 		luaL_error(L, "size_t value not representable as unsigned");
@@ -3960,17 +4443,26 @@ static int unixL_pusherror(lua_State *L, int error, const char *fun NOTUSED, con
 #define FD_PRIino "4$lld"
 #define FD_PRInul "5$c"
 
-static u_error_t fd_reopen(int *fd, int ofd, const char *fspath, u_flags_t flags) {
-	char path[sizeof ((unixL_State *)0)->fd.path];
+/*
+ * Whether the path format uses the device or inode number before the
+ * terminating NUL, requiring an fstat for each reopen.
+ */
+static _Bool fd_needstat(const char *fspath) {
 	const char *dev, *ino, *nul;
-	struct stat st = { 0 };
-	int error;
 
 	dev = strstr(fspath, "%"FD_PRIdev);
 	ino = strstr(fspath, "%"FD_PRIino);
 	nul = strstr(fspath, "%"FD_PRInul);
 
-	if ((dev && (!nul || dev < nul)) || (ino && (!nul || ino < nul))) {
+	return (dev && (!nul || dev < nul)) || (ino && (!nul || ino < nul));
+} /* fd_needstat() */
+
+static u_error_t fd_reopen(int *fd, int ofd, const char *fspath, _Bool needstat, u_flags_t flags) {
+	char path[sizeof ((unixL_State *)0)->fd.path];
+	struct stat st = { 0 };
+	int error;
+
+	if (needstat) {
 		if (0 != fstat(ofd, &st))
 			return errno;
 	}
@@ -4114,7 +4606,7 @@ static u_error_t fd_init(lua_State *L, unixL_State *U) {
 		goto error;
 
 	for (path = paths; path < endof(paths); u_close(&fd), path++) {
-		if ((error = fd_reopen(&fd, pipefd[0], *path, O_RDONLY|U_CLOEXEC)))
+		if ((error = fd_reopen(&fd, pipefd[0], *path, fd_needstat(*path), O_RDONLY|U_CLOEXEC)))
 			continue;
 		if ((error = fd_isdiff(&diff, fd, pipefd[0], O_NONBLOCK)))
 			goto error;
@@ -4124,6 +4616,7 @@ static u_error_t fd_init(lua_State *L, unixL_State *U) {
 		if ((error = u_strcpy(U->fd.path, *path, sizeof U->fd.path)))
 			goto error;
 
+		U->fd.stat = fd_needstat(*path);
 		error = 0;
 		goto error;
 	}
@@ -4137,7 +4630,7 @@ static u_error_t fd_init(lua_State *L, unixL_State *U) {
 		goto error;
 
 	for (path = paths; path < endof(paths); u_close(&fd), path++) {
-		if ((error = fd_reopen(&fd, tmpfd, *path, O_WRONLY|U_CLOEXEC)))
+		if ((error = fd_reopen(&fd, tmpfd, *path, fd_needstat(*path), O_WRONLY|U_CLOEXEC)))
 			continue;
 		if ((error = fd_isdiff(&diff, fd, tmpfd, O_APPEND)))
 			goto error;
@@ -4147,6 +4640,7 @@ static u_error_t fd_init(lua_State *L, unixL_State *U) {
 		if ((error = u_strcpy(U->fd.path, *path, sizeof U->fd.path)))
 			goto error;
 
+		U->fd.stat = fd_needstat(*path);
 		error = 0;
 		goto error;
 	}
@@ -4162,35 +4656,107 @@ error:
 	return U->fd.error = error;
 } /* fd_init() */
 
-static u_error_t unixL_reopen(lua_State *L, int *fd, int ofd, u_flags_t flags) {
-	unixL_State *U = unixL_getstate(L);
+/*
+ * Linux always gives /proc/self/fd/FD the proper semantics, so skip the
+ * probe and open relative to a cached descriptor for /proc/self/fd,
+ * sparing the path formatting and the walk through /proc/PID. /proc/self
+ * is resolved when opened, so a forked child must open its own. Returns
+ * ENOTSUP if the fast path is unavailable.
+ */
+static u_error_t fd_reopenself(unixL_State *U, int *fd, int ofd, u_flags_t flags) {
+#if __linux && HAVE_OPENAT
+	char name[16], *p = &name[sizeof name];
+	unsigned n = ofd;
+	pid_t pid;
 	int error;
 
-	*fd = -1;
+	if (U->fd.noself)
+		return ENOTSUP;
 
-	if ((error = fd_init(L, U)))
-		goto error;
+	if (U->fd.dirfd == -1 || U->fd.pid != (pid = getpid())) {
+		u_close(&U->fd.dirfd);
+
+		if ((error = u_open(&U->fd.dirfd, "/proc/self/fd", U_ATFLAGS, 0))) {
+			/* only give up for good if /proc is missing or hidden */
+			switch (error) {
+			case ENOENT:
+			case ENOTDIR:
+			case EACCES:
+			case EPERM:
+				U->fd.noself = 1;
+				return ENOTSUP;
+			default:
+				return error;
+			}
+		}
 
-	if ((error = fd_reopen(fd, ofd, U->fd.path, flags)))
-		goto error;
+		U->fd.pid = getpid();
+	}
 
-	return 0;
-error:
-	if (0 == fd_reopendir(fd, ofd, flags))
-		return 0;
+	*--p = '\0';
+	do {
+		*--p = '0' + (n % 10);
+	} while (n /= 10);
 
-	return error;
-} /* unixL_reopen() */
+	if ((error = u_getaccmode(ofd, &flags, flags)))
+		return error;
 
+	if (-1 == (*fd = openat(U->fd.dirfd, p, U_SYSFLAGS & flags)))
+		return errno;
 
-static u_error_t unixL_readdir(lua_State *L, DIR *dp, struct dirent **ent) {
-	unixL_State *U = unixL_getstate(L);
+	flags &= ~(U_CLOEXEC & U_SYSFLAGS);
 
-	if (U->dir.dp != dp) {
-		long namemax = fpathconf(dirfd(dp), _PC_NAME_MAX);
-		size_t bufsiz;
+	if ((error = u_fixflags(*fd, flags))) {
+		u_close(fd);
+		return error;
+	}
 
-		if (namemax == -1)
+	return 0;
+#else
+	(void)U;
+	(void)fd;
+	(void)ofd;
+	(void)flags;
+
+	return ENOTSUP;
+#endif
+} /* fd_reopenself() */
+
+static u_error_t unixL_reopen(lua_State *L, int *fd, int ofd, u_flags_t flags) {
+	unixL_State *U = unixL_getstate(L);
+	int error;
+
+	*fd = -1;
+
+	if ((error = fd_reopenself(U, fd, ofd, flags)) != ENOTSUP) {
+		if (error)
+			goto error;
+		return 0;
+	}
+
+	if ((error = fd_init(L, U)))
+		goto error;
+
+	if ((error = fd_reopen(fd, ofd, U->fd.path, U->fd.stat, flags)))
+		goto error;
+
+	return 0;
+error:
+	if (0 == fd_reopendir(fd, ofd, flags))
+		return 0;
+
+	return error;
+} /* unixL_reopen() */
+
+
+static u_error_t unixL_readdir(lua_State *L, DIR *dp, struct dirent **ent) {
+	unixL_State *U = unixL_getstate(L);
+
+	if (U->dir.dp != dp) {
+		long namemax = fpathconf(dirfd(dp), _PC_NAME_MAX);
+		size_t bufsiz;
+
+		if (namemax == -1)
 			return errno;
 
 		bufsiz = sizeof (struct dirent) + namemax + 1;
@@ -4405,6 +4971,70 @@ error:
 } /* pr_psinfo() */
 #endif
 
+#if __linux
+/*
+ * Look up a numeric field of /proc/self/status. The Name field escapes
+ * newlines, so a field name at the start of a line can't be spoofed. Only
+ * complete lines are parsed, so a value cut short by a read boundary (e.g.
+ * "Threads:\t12" read as "Threads:\t1") is never returned.
+ */
+static u_error_t pr_status(const char *name, int base, unsigned long *value) {
+	char buf[4096], *p, *nl, *end;
+	size_t namelen = strlen(name), len = 0;
+	_Bool skip = 0;
+	ssize_t n;
+	int fd = -1, error;
+
+	if ((error = u_open(&fd, "/proc/self/status", O_RDONLY|U_CLOEXEC, 0)))
+		return error;
+
+	for (;;) {
+		if (-1 == (n = read(fd, &buf[len], sizeof buf - len))) {
+			if (errno == EINTR)
+				continue;
+
+			error = errno;
+			goto error;
+		} else if (n == 0) {
+			break;
+		}
+
+		len += n;
+
+		for (p = buf; (nl = memchr(p, '\n', len - (p - buf))); p = nl + 1) {
+			/* tail of a line longer than the buffer */
+			if (skip) {
+				skip = 0;
+				continue;
+			}
+
+			if ((size_t)(nl - p) > namelen && !memcmp(p, name, namelen) && p[namelen] == ':') {
+				*nl = '\0';
+				*value = strtoul(&p[namelen + 1], &end, base);
+				error = (end == &p[namelen + 1] || *end != '\0')? EINVAL : 0;
+
+				goto error;
+			}
+		}
+
+		if (p == buf && len == sizeof buf) {
+			/* e.g. Groups with many supplementary groups */
+			skip = 1;
+			len = 0;
+		} else {
+			len -= p - buf;
+			memmove(buf, p, len);
+		}
+	}
+
+	error = ENOENT;
+error:
+	u_close(&fd);
+
+	return error;
+} /* pr_status() */
+#endif
+
 static int ts_nthreads_psinfo(void) {
 #if HAVE_STRUCT_PSINFO_PR_NLWP
 	struct psinfo pr;
@@ -4450,11 +5080,12 @@ oops:
 
 	return -1;
 #elif defined __linux
-	/*
-	 * TODO: Add support for Linux /proc/self/status or /proc/self/stat
-	 * (Only one of them properly supports newlines in path name.)
-	 */
-	return -1;
+	unsigned long n;
+
+	if (0 != pr_status("Threads", 10, &n) || n > INT_MAX)
+		return -1;
+
+	return n;
 #else
 	return -1;
 #endif
@@ -4493,21 +5124,39 @@ static int ts_reset(unixL_State *U) {
 	return 0;
 } /* ts_reset() */
 
+/*
+ * The umask can only be read by setting it, which would race other
+ * threads. In order of preference read the Linux 4.7+ Umask field of
+ * /proc/self/status, set and restore it when we're the only thread, or
+ * set it in a forked child. The result is cached until unix.umask changes
+ * it, so code which calls umask(2) directly must not rely on lunix.
+ */
 static mode_t unixL_getumask(lua_State *L) {
 	unixL_State *U = unixL_getstate(L);
 	pid_t pid;
 	mode_t mask;
 	int error, status;
 	ssize_t n;
+#if __linux
+	unsigned long pmask;
+#endif
+
+	if (U->umask.cached)
+		return U->umask.mask;
+
+#if __linux
+	if (0 == pr_status("Umask", 8, &pmask)) {
+		mask = pmask & 0777;
+		goto cache;
+	}
+#endif
 
-#if 0
 	if (ts_nthreads() == 1) {
 		mask = umask(0);
 		umask(mask);
 
-		return mask;
+		goto cache;
 	}
-#endif
 
 	if ((error = ts_reset(U)))
 		return luaL_error(L, "getumask: %s", unixL_strerror(L, error));
@@ -4537,10 +5186,15 @@ static mode_t unixL_getumask(lua_State *L) {
 		if (sizeof mask != (n = read(U->ts.fd[0], &mask, sizeof mask)))
 			return luaL_error(L, "getumask: %s", (n == -1)? unixL_strerror(L, errno) : "short read");
 
-		return mask;
+		goto cache;
 	}
 
 	return 0;
+cache:
+	U->umask.mask = mask;
+	U->umask.cached = 1;
+
+	return mask;
 } /* unixL_getumask() */
 
 
@@ -4713,9 +5367,95 @@ static FILE *unixL_checkfile(lua_State *L, int index) {
 } /* unixL_checkfile() */
 
 
+/*
+ * Owned descriptor object. Status flags and file type are fetched the
+ * first time they're needed and kept current by changes made through the
+ * object, so repeated queries cost no syscalls. Changes made behind its
+ * back, including through a dup sharing the open file description, are
+ * only seen after a refresh. Only the object's own methods answer from
+ * the cache; fcntl and the setters always make the system call.
+ */
+struct fdobj {
+	int fd;
+	_Bool haveflags, havetype;
+	u_flags_t flags; /* F_GETFL flags plus U_CLOEXEC */
+	mode_t type;     /* S_IFMT bits */
+}; /* struct fdobj */
+
+static u_error_t fdobj_getflags(struct fdobj *fo, u_flags_t *flags) {
+	int error;
+
+	if (!fo->haveflags) {
+		if ((error = u_getflags(fo->fd, &fo->flags)))
+			return error;
+		fo->haveflags = 1;
+	}
+
+	*flags = fo->flags;
+
+	return 0;
+} /* fdobj_getflags() */
+
+static u_error_t fdobj_setflag(struct fdobj *fo, u_flags_t flag, int enable) {
+	int error;
+
+	/* a stale cache could wrongly skip the change, so always make it */
+	if ((error = u_setflag(fo->fd, flag, enable))) {
+		fo->haveflags = 0;
+		return error;
+	}
+
+	if (!fo->haveflags)
+		return 0;
+
+	if (enable)
+		fo->flags |= flag;
+	else
+		fo->flags &= ~flag;
+
+	return 0;
+} /* fdobj_setflag() */
+
+static u_error_t fdobj_gettype(struct fdobj *fo, mode_t *type) {
+	struct stat st;
+
+	if (!fo->havetype) {
+		if (0 != fstat(fo->fd, &st))
+			return errno;
+		fo->type = st.st_mode & S_IFMT;
+		fo->havetype = 1;
+	}
+
+	*type = fo->type;
+
+	return 0;
+} /* fdobj_gettype() */
+
+/* forget what is cached about the descriptor object at index, if any */
+static void fdobj_invalidate(lua_State *L, int index) {
+	struct fdobj *fo = luaL_testudata(L, index, "struct fd");
+
+	if (fo) {
+		fo->haveflags = 0;
+		fo->havetype = 0;
+	}
+} /* fdobj_invalidate() */
+
+/* push a new descriptor object, which owns nothing until fd is set */
+static struct fdobj *fdobj_push(lua_State *L) {
+	struct fdobj *fo = lua_newuserdata(L, sizeof *fo);
+
+	memset(fo, 0, sizeof *fo);
+	fo->fd = -1;
+	luaL_setmetatable(L, "struct fd");
+
+	return fo;
+} /* fdobj_push() */
+
 static int unixL_xoptfileno(lua_State *L, int index, int def, _Bool atok) {
 	luaL_Stream *fh;
 	DIR **dp;
+	struct fdobj *fo;
 	int fd;
 
 	if ((fh = luaL_testudata(L, index, LUA_FILEHANDLE))) {
@@ -4738,6 +5478,12 @@ static int unixL_xoptfileno(lua_State *L, int index, int def, _Bool atok) {
 		return fd;
 	}
 
+	if ((fo = luaL_testudata(L, index, "struct fd"))) {
+		luaL_argcheck(L, fo->fd != -1, index, "attempt to use a closed descriptor");
+
+		return fo->fd;
+	}
+
 	/* bindings like chdir accept string paths, so don't coerce */
 	if (lua_type(L, index) == LUA_TNUMBER) {
 		fd = lua_tointeger(L, index);
@@ -4794,44 +5540,175 @@ static int unixL_closef(lua_State *L) {
 	return 0;
 } /* unixL_closef() */
 
-static struct luaL_Stream *unixL_prepfile(lua_State *L) {
-	unixL_State *U = unixL_getstate(L);
+/*
+ * LuaJIT file handles can only be created by its io library, which offers
+ * no way to do so without opening a file. Shells are therefore opened and
+ * closed in batches, so the io.open calls and the search for an openable
+ * path are amortized, and kept in a pool until needed.
+ */
+#define UNIXL_POOLSIZE 32
+
+/* push a closed LuaJIT file handle, or nil and an error message */
+static _Bool unixL_openshell(lua_State *L, unixL_State *U) {
+	static const char *const local[] = { ".", "/dev/null" };
 	luaL_Stream *fh;
+	int top = lua_gettop(L), i;
 
-	if (U->lua.jit) {
-		static const char *const local[] = { ".", "/dev/null" };
-		const char *const *path, *const *ppath = NULL;
+	if (U->lua.openf == LUA_NOREF || U->lua.openf == LUA_REFNIL)
+		luaL_error(L, "unable to create new file handle: LuaJIT io.open function not available");
+
+	for (i = U->lua.local; i < (int)countof(local); i++) {
+		lua_settop(L, top);
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, U->lua.openf);
+		lua_pushstring(L, local[i]);
+		lua_pushstring(L, "r");
+		lua_call(L, 2, 2);
+
+		if (!lua_isnil(L, -2))
+			break;
+	}
+
+	if (lua_isnil(L, -2)) {
+		lua_pushfstring(L, "%s: %s", local[countof(local) - 1], luaL_checkstring(L, -1));
+		lua_replace(L, -2);
+
+		return 0;
+	}
+
+	U->lua.local = i;
+
+	lua_pop(L, 1);
+
+	fh = luaL_checkudata(L, -1, LUA_FILEHANDLE);
 
-		if (U->lua.openf == LUA_NOREF || U->lua.openf == LUA_REFNIL)
-			luaL_error(L, "unable to create new file handle: LuaJIT io.open function not available");
+	if (fh->f) {
+		fclose(fh->f);
+		fh->f = NULL;
+	}
 
-		lua_settop(L, lua_gettop(L) + 2);
+	return 1;
+} /* unixL_openshell() */
 
-		for (path = &local[0]; path < endof(local); path++) {
-			ppath = path;
+static void unixL_fillpool(lua_State *L, unixL_State *U) {
+	int top = lua_gettop(L);
 
-			lua_pop(L, 2);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, U->lua.pool);
 
-			lua_rawgeti(L, LUA_REGISTRYINDEX, U->lua.openf);
-			lua_pushstring(L, *path);
-			lua_pushstring(L, "r");
-			lua_call(L, 2, 2);
+	while (U->lua.npool < UNIXL_POOLSIZE) {
+		lua_settop(L, top + 1);
 
-			if (!lua_isnil(L, -2))
+		if (!unixL_openshell(L, U)) {
+			/* make do with a partial batch */
+			if (U->lua.npool > 0)
 				break;
+
+			luaL_error(L, "unable to create a new file handle: %s", lua_tostring(L, -1));
 		}
 
-		if (lua_isnil(L, -2))
-			luaL_error(L, "unable to create a new file handle: %s: %s", *ppath, luaL_checkstring(L, -1));
+		lua_rawseti(L, top + 1, ++U->lua.npool);
+	}
 
-		lua_pop(L, 1);
+	lua_settop(L, top);
+} /* unixL_fillpool() */
 
-		fh = luaL_checkudata(L, -1, LUA_FILEHANDLE);
+#if LUA_VERSION_NUM == 501
+/*
+ * Better yet, mint shells without any I/O. A LuaJIT io file is a plain
+ * userdata with the io metatable and environment and UDTYPE_IO_FILE (1)
+ * in the udtype byte of its GCudata header, which sits 18 bytes before
+ * the payload with 32-bit GC references and 38 bytes before it with
+ * LJ_GC64. The layout is recognized by comparing a real shell against a
+ * fresh userdata, and a minted handle must pass io.type before minting is
+ * used; otherwise we fall back to the pool.
+ */
+static void unixL_newshell(lua_State *L, unixL_State *U) {
+	size_t size;
+	unsigned char *ud;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, U->lua.shell);
+	size = lua_objlen(L, -1);
+	ud = lua_newuserdata(L, size);
+	memset(ud, 0, size);
+	ud[-U->lua.udtype] = 1;
+	lua_getmetatable(L, -2);
+	lua_setmetatable(L, -2);
+	lua_getfenv(L, -2);
+	lua_setfenv(L, -2);
+	lua_remove(L, -2);
+} /* unixL_newshell() */
+
+static _Bool unixL_canmint(lua_State *L, unixL_State *U) {
+	static const int offset[] = { 18, 38 };
+	int n = (sizeof (void *) < 8)? 1 : 2; /* LJ_GC64 is 64-bit only */
+	const unsigned char *shell, *ud;
+	_Bool ok;
+	int top, i;
+
+	if (U->lua.udtype)
+		return U->lua.udtype > 0;
+
+	U->lua.udtype = -1;
+	top = lua_gettop(L);
+
+	if (!unixL_openshell(L, U))
+		goto done;
+
+	shell = lua_touserdata(L, -1);
+	ud = lua_newuserdata(L, lua_objlen(L, -1));
+
+	for (i = 0; i < n; i++) {
+		if (shell[-offset[i]] == 1 && ud[-offset[i]] == 0)
+			break;
+	}
+
+	if (i == n)
+		goto done;
+
+	lua_pop(L, 1);
+	U->lua.shell = luaL_ref(L, LUA_REGISTRYINDEX);
+	U->lua.udtype = offset[i];
+
+	lua_getglobal(L, "io");
+	lua_getfield(L, -1, "type");
+	unixL_newshell(L, U);
+	lua_call(L, 1, 1);
+	ok = lua_isstring(L, -1) && !strcmp(lua_tostring(L, -1), "closed file");
+
+	if (!ok) {
+		luaL_unref(L, LUA_REGISTRYINDEX, U->lua.shell);
+		U->lua.shell = LUA_NOREF;
+		U->lua.udtype = -1;
+	}
+done:
+	lua_settop(L, top);
+
+	return U->lua.udtype > 0;
+} /* unixL_canmint() */
+#endif
+
+static struct luaL_Stream *unixL_prepfile(lua_State *L) {
+	unixL_State *U = unixL_getstate(L);
+	luaL_Stream *fh;
+
+	if (U->lua.jit) {
+#if LUA_VERSION_NUM == 501
+		if (unixL_canmint(L, U)) {
+			unixL_newshell(L, U);
 
-		if (fh->f) {
-			fclose(fh->f);
-			fh->f = NULL;
+			return luaL_checkudata(L, -1, LUA_FILEHANDLE);
 		}
+#endif
+		if (U->lua.npool == 0)
+			unixL_fillpool(L, U);
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, U->lua.pool);
+		lua_rawgeti(L, -1, U->lua.npool);
+		lua_pushnil(L);
+		lua_rawseti(L, -3, U->lua.npool--);
+		lua_remove(L, -2);
+
+		fh = luaL_checkudata(L, -1, LUA_FILEHANDLE);
 	} else {
 		fh = lua_newuserdata(L, sizeof *fh);
 		memset(fh, 0, sizeof *fh);
@@ -4850,63 +5727,168 @@ static struct luaL_Stream *unixL_prepfile(lua_State *L) {
 } /* unixL_prepfile() */
 
 
-static void unixL_checkflags(lua_State *L, int index, const char **mode, u_flags_t *flags, mode_t *perm) {
+/*
+ * Anchor the value at the top of the stack to the handle at index under
+ * name, so memory a stream refers to lives at least as long as the handle,
+ * including while it is being finalized. Pops the value.
+ */
+static void unixL_anchor(lua_State *L, int index, const char *name) {
+	unixL_State *U = unixL_getstate(L);
+
 	index = lua_absindex(L, index);
 
-	if (lua_isnoneornil(L, index) || lua_isnumber(L, index)) {
-		*flags = unixL_optinteger(L, index, 0, 0, U_TMAX(u_flags_t));
-		*mode = NULL;
-	} else {
-		*mode = luaL_checkstring(L, index);
-		*flags = u_toflags(*mode);
-	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, U->lua.anchor);
+	lua_pushvalue(L, index);
+	lua_rawget(L, -2);
 
-	if (perm) {
-		*perm = (*flags & O_CREAT)? unixL_optmode(L, index + 1, 0666, 0666) : 0;
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, index);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
 	}
-} /* unixL_checkflags() */
 
+	lua_pushvalue(L, -3);
+	lua_setfield(L, -2, name);
+	lua_pop(L, 3);
+} /* unixL_anchor() */
 
-static struct tm *unixL_checktm(lua_State *L, int index, struct tm *tm) {
-	luaL_checktype(L, 1, LUA_TTABLE);
+/*
+ * Push the value anchored to the handle at index under name, or nil.
+ */
+static int unixL_getanchor(lua_State *L, int index, const char *name) {
+	unixL_State *U = unixL_getstate(L);
 
-	tm->tm_year = unixL_optfint(L, index, "year", tm->tm_year + 1900) - 1900;
-	tm->tm_mon = unixL_optfint(L, index, "month", tm->tm_mon + 1) - 1;
-	tm->tm_mday = unixL_optfint(L, index, "day", tm->tm_mday);
-	tm->tm_hour = unixL_optfint(L, index, "hour", tm->tm_hour);
-	tm->tm_min = unixL_optfint(L, index, "min", tm->tm_min);
-	tm->tm_sec = unixL_optfint(L, index, "sec", tm->tm_sec);
-	tm->tm_wday = unixL_optfint(L, index, "wday", tm->tm_wday + 1) - 1;
-	tm->tm_yday = unixL_optfint(L, index, "yday", tm->tm_yday + 1) - 1;
+	index = lua_absindex(L, index);
 
-	lua_getfield(L, 1, "isdst");
-	if (!lua_isnil(L, -1)) {
-		tm->tm_isdst = lua_toboolean(L, -1);
-	}
-	lua_pop(L, 1);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, U->lua.anchor);
+	lua_pushvalue(L, index);
+	lua_rawget(L, -2);
+	lua_remove(L, -2);
 
-	return tm;
-} /* unixL_checktm() */
+	if (lua_isnil(L, -1))
+		return LUA_TNIL;
 
+	lua_getfield(L, -1, name);
+	lua_remove(L, -2);
 
-static struct tm *unixL_opttm(lua_State *L, int index, const struct tm *def, struct tm *tm) {
-	if (lua_isnoneornil(L, index)) {
-		if (def) {
-			*tm = *def;
-		} else {
-			time_t now = time(NULL);
+	return lua_type(L, -1);
+} /* unixL_getanchor() */
 
-			gmtime_r(&now, tm);
-		}
 
-		return tm;
-	} else {
-		return unixL_checktm(L, index, tm);
-	}
-} /* unixL_opttm() */
+static const char *const vbuf_mode[] = { "full", "line", "none", NULL };
 
+/*
+ * Parse a buffering argument, either a buffer size for full buffering or
+ * one of the modes "full", "line", or "none" followed by an optional size.
+ * Returns false if the argument is absent.
+ */
+static _Bool unixL_optvbuf(lua_State *L, int index, int *mode, size_t *size) {
+	static const int modes[] = { _IOFBF, _IOLBF, _IONBF };
 
-#if __APPLE__
+	if (lua_isnoneornil(L, index))
+		return 0;
+
+	if (lua_type(L, index) == LUA_TNUMBER) {
+		*mode = _IOFBF;
+		*size = unixL_checksize(L, index);
+	} else {
+		*mode = modes[luaL_checkoption(L, index, NULL, vbuf_mode)];
+		*size = (lua_isnoneornil(L, index + 1))? 0 : unixL_checksize(L, index + 1);
+	}
+
+	return 1;
+} /* unixL_optvbuf() */
+
+/*
+ * Set the buffering of the stream of the handle at index. Some stdio
+ * implementations ignore the size unless given a buffer, so buffers are
+ * allocated as userdata anchored to the handle.
+ * Must be called before any I/O on the stream.
+ */
+static u_error_t unixL_setvbuf(lua_State *L, int index, int mode, size_t size) {
+	luaL_Stream *fh;
+	char *buf = NULL;
+
+	index = lua_absindex(L, index);
+	fh = luaL_checkudata(L, index, LUA_FILEHANDLE);
+
+	if (mode != _IONBF && size > 0)
+		buf = lua_newuserdata(L, size);
+	else
+		lua_pushnil(L);
+
+	/* the old buffer stays anchored until the stream lets go of it */
+	if (0 != setvbuf(fh->f, buf, mode, (mode == _IONBF)? 0 : size)) {
+		lua_pop(L, 1);
+
+		return (errno)? errno : EINVAL;
+	}
+
+	unixL_anchor(L, index, "vbuf");
+
+	return 0;
+} /* unixL_setvbuf() */
+
+
+static void unixL_checkflags(lua_State *L, int index, const char **mode, u_flags_t *flags, mode_t *perm) {
+	index = lua_absindex(L, index);
+
+	if (lua_isnoneornil(L, index) || lua_isnumber(L, index)) {
+		*flags = unixL_optinteger(L, index, 0, 0, U_TMAX(u_flags_t));
+		*mode = NULL;
+	} else {
+		*mode = luaL_checkstring(L, index);
+		*flags = u_toflags(*mode);
+	}
+
+	if (perm) {
+		*perm = (*flags & O_CREAT)? unixL_optmode(L, index + 1, 0666, 0666) : 0;
+	}
+} /* unixL_checkflags() */
+
+
+static struct tm *unixL_checktm(lua_State *L, int index, struct tm *tm) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	tm->tm_year = unixL_optfint(L, index, "year", tm->tm_year + 1900) - 1900;
+	tm->tm_mon = unixL_optfint(L, index, "month", tm->tm_mon + 1) - 1;
+	tm->tm_mday = unixL_optfint(L, index, "day", tm->tm_mday);
+	tm->tm_hour = unixL_optfint(L, index, "hour", tm->tm_hour);
+	tm->tm_min = unixL_optfint(L, index, "min", tm->tm_min);
+	tm->tm_sec = unixL_optfint(L, index, "sec", tm->tm_sec);
+	tm->tm_wday = unixL_optfint(L, index, "wday", tm->tm_wday + 1) - 1;
+	tm->tm_yday = unixL_optfint(L, index, "yday", tm->tm_yday + 1) - 1;
+
+	lua_getfield(L, 1, "isdst");
+	if (!lua_isnil(L, -1)) {
+		tm->tm_isdst = lua_toboolean(L, -1);
+	}
+	lua_pop(L, 1);
+
+	return tm;
+} /* unixL_checktm() */
+
+
+static struct tm *unixL_opttm(lua_State *L, int index, const struct tm *def, struct tm *tm) {
+	if (lua_isnoneornil(L, index)) {
+		if (def) {
+			*tm = *def;
+		} else {
+			time_t now = time(NULL);
+
+			gmtime_r(&now, tm);
+		}
+
+		return tm;
+	} else {
+		return unixL_checktm(L, index, tm);
+	}
+} /* unixL_opttm() */
+
+
+#if __APPLE__
 #define U_CLOCK_REALTIME  1
 #define U_CLOCK_MONOTONIC 2
 #else
@@ -5429,166 +6411,464 @@ static int unix_arc4random_uniform(lua_State *L) {
 } /* unix_arc4random_uniform() */
 
 
-static int unix_bind(lua_State *L) {
-	int fd = unixL_checkfileno(L, 1);
-	size_t addrlen;
-	struct sockaddr *addr = unixL_checksockaddr(L, 2, &addrlen);
+#if HAVE_OPENAT && HAVE_RENAMEAT
+/*
+ * Atomic file replacement. Data is written to an anonymous O_TMPFILE
+ * where available, otherwise to a uniquely named temporary in the same
+ * directory, synced, and only then given its final name, so readers see
+ * either the old or new contents in full.
+ */
+#define AW_NOREPLACE 0x01
+#define AW_EXCHANGE  0x02
 
-	if (0 != bind(fd, addr, addrlen))
-		return unixL_pusherror(L, errno, "bind", "0$#");
+static u_error_t aw_write(lua_State *L, int fd, int index) {
+	const char *p;
+	size_t len, i, n;
+	ssize_t count;
+	int error;
 
-	lua_pushboolean(L, 1);
+	n = (lua_type(L, index) == LUA_TTABLE)? lua_rawlen(L, index) : 1;
 
-	return 1;
-} /* unix_bind() */
+	for (i = 1; i <= n; i++) {
+		/* checked by unix_atomic_write, so this can't throw */
+		if (lua_type(L, index) == LUA_TTABLE)
+			lua_rawgeti(L, index, i);
+		else
+			lua_pushvalue(L, index);
 
+		p = lua_tolstring(L, -1, &len);
 
-static int unix_bitand(lua_State *L) {
-	unixL_pushinteger(L, unixL_checkinteger(L, 1) & unixL_checkinteger(L, 2));
+		while (len > 0) {
+			if (-1 == (count = write(fd, p, len))) {
+				if (errno == EINTR)
+					continue;
 
-	return 1;
-} /* unix_bitand() */
+				error = errno;
+				lua_pop(L, 1);
 
+				return error;
+			}
 
-static int unix_bitor(lua_State *L) {
-	unixL_pushinteger(L, unixL_checkinteger(L, 1) | unixL_checkinteger(L, 2));
+			p += count;
+			len -= count;
+		}
 
-	return 1;
-} /* unix_bitor() */
+		lua_pop(L, 1);
+	}
 
+	return 0;
+} /* aw_write() */
 
-static int unsafe_calloc(lua_State *L) {
-	size_t count = unixL_checksize(L, 1);
-	size_t size = unixL_checksize(L, 2);
-	void *addr;
+static u_error_t aw_rename(int dfd, const char *from, const char *to, int flags) {
+	if (flags & AW_EXCHANGE) {
+#if HAVE_RENAMEAT2 && defined RENAME_EXCHANGE
+		if (0 != renameat2(dfd, from, dfd, to, RENAME_EXCHANGE))
+			return errno;
 
-	if (!(addr = calloc(count, size)) && count > 0 && size > 0)
-		return unixL_pusherror(L, errno, "calloc", "~$#");
+		/* the old contents now live under the temporary name */
+		(void)unlinkat(dfd, from, 0);
 
-	lua_pushlightuserdata(L, addr);
-	return 1;
-} /* unsafe_calloc() */
+		return 0;
+#else
+		return ENOTSUP;
+#endif
+	}
 
+	if (flags & AW_NOREPLACE) {
+#if HAVE_RENAMEAT2 && defined RENAME_NOREPLACE
+		if (0 == renameat2(dfd, from, dfd, to, RENAME_NOREPLACE))
+			return 0;
 
-static int unix_chdir(lua_State *L) {
-	int fd;
+		if (errno != EINVAL && errno != ENOSYS)
+			return errno;
+#endif
+		/* link(2) fails with EEXIST rather than replacing */
+		if (0 != linkat(dfd, from, dfd, to, 0))
+			return errno;
 
-	if (-1 != (fd = unixL_optfileno(L, 1, -1))) {
-		if (0 != fchdir(fd))
-			return unixL_pusherror(L, errno, "chdir", "0$#");
-	} else {
-		const char *path = luaL_checkstring(L, 1);
+		(void)unlinkat(dfd, from, 0);
 
-		if (0 != chdir(path))
-			return unixL_pusherror(L, errno, "chdir", "0$#");
+		return 0;
 	}
 
-	lua_pushboolean(L, 1);
-
-	return 1;
-} /* unix_chdir() */
-
+	if (0 != renameat(dfd, from, dfd, to))
+		return errno;
 
-static int unix_chmod(lua_State *L) {
-	mode_t omode = 0777, mode;
-	_Bool octal;
-	struct stat st;
-	int fd;
+	return 0;
+} /* aw_rename() */
 
-	luaL_checkany(L, 2);
-	lua_pushvalue(L, 2);
-	octal = lua_isnumber(L, -1); /* octal notation or literal number */
-	lua_pop(L, 1);
+#if defined O_TMPFILE && __linux
+/*
+ * Returns ENOTSUP for any failure that the named temporary file method
+ * might not share.
+ */
+static u_error_t aw_tmpfile(lua_State *L, int dfd, const char *base, int index, mode_t mode, int flags, _Bool sync) {
+	char proc[64], tmpnam[NAME_MAX + 1];
+	int fd = -1, error;
 
-	if (-1 != (fd = unixL_optfileno(L, 1, -1))) {
-		if (!octal) {
-			if (0 != fstat(fd, &st))
-				return unixL_pusherror(L, errno, "chmod", "0$#");
+	if (flags & AW_EXCHANGE)
+		return ENOTSUP;
 
-			omode = st.st_mode;
-		}
+	if (u_openat(&fd, dfd, ".", O_TMPFILE|O_WRONLY|U_CLOEXEC, mode))
+		return ENOTSUP;
 
-		mode = unixL_checkmode(L, 2, omode);
+	if ((error = aw_write(L, fd, index)))
+		goto error;
 
-		if (0 != fchmod(fd, mode))
-			return unixL_pusherror(L, errno, "chmod", "0$#");
-	} else {
-		const char *path = luaL_checkstring(L, 1);
+	if (sync && 0 != fsync(fd))
+		goto syerr;
 
-		if (!octal) {
-			if (0 != stat(path, &st))
-				return unixL_pusherror(L, errno, "chmod", "0$#");
+	if ((error = u_snprintf(proc, sizeof proc, "/proc/self/fd/%d", fd)))
+		goto error;
 
-			omode = st.st_mode;
+	/* with noreplace, linking straight to the final name is atomic */
+	if (flags & AW_NOREPLACE) {
+		if (0 != linkat(AT_FDCWD, proc, dfd, base, AT_SYMLINK_FOLLOW)) {
+			error = (errno == EEXIST)? EEXIST : ENOTSUP;
+			goto error;
 		}
 
-		mode = unixL_checkmode(L, 2, omode);
+		u_close(&fd);
 
-		if (0 != chmod(path, mode))
-			return unixL_pusherror(L, errno, "chmod", "0$#");
+		return 0;
 	}
 
-	lua_pushboolean(L, 1);
-
-	return 1;
-} /* unix_chmod() */
+	for (;;) {
+		static const unsigned char base32[32] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+		char tmpext[9];
 
+		unixL_random_buf(L, tmpext, sizeof tmpext - 1, base32, sizeof base32);
+		tmpext[sizeof tmpext - 1] = '\0';
 
-static int unix_chown(lua_State *L) {
-	uid_t uid = unixL_optuid(L, 2, -1);
-	gid_t gid = unixL_optgid(L, 3, -1);
-	int fd;
+		if ((error = u_snprintf(tmpnam, sizeof tmpnam, ".%.200s.%s", base, tmpext)))
+			goto error;
 
-	if (-1 != (fd = unixL_optfileno(L, 1, -1))) {
-		if (0 != fchown(fd, uid, gid))
-			return unixL_pusherror(L, errno, "chown", "0$#");
-	} else {
-		const char *path = luaL_checkstring(L, 1);
+		if (0 == linkat(AT_FDCWD, proc, dfd, tmpnam, AT_SYMLINK_FOLLOW))
+			break;
 
-		if (0 != chown(path, uid, gid))
-			return unixL_pusherror(L, errno, "chown", "0$#");
+		if (errno != EEXIST) {
+			error = ENOTSUP;
+			goto error;
+		}
 	}
 
-	lua_pushboolean(L, 1);
+	u_close(&fd);
 
-	return 1;
-} /* unix_chown() */
+	if ((error = aw_rename(dfd, tmpnam, base, flags))) {
+		(void)unlinkat(dfd, tmpnam, 0);
+		return error;
+	}
 
+	return 0;
+syerr:
+	error = errno;
+error:
+	u_close(&fd);
 
-static int unix_chroot(lua_State *L) {
-	const char *path = luaL_checkstring(L, 1);
+	return error;
+} /* aw_tmpfile() */
+#endif
 
-	if (0 != chroot(path))
-		return unixL_pusherror(L, errno, "chroot", "0$#");
+static u_error_t aw_tmpname(lua_State *L, int dfd, const char *base, int index, mode_t mode, int flags, _Bool sync) {
+	static const unsigned char base32[32] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+	char tmpnam[NAME_MAX + 1], tmpext[9];
+	int fd = -1, error;
 
-	lua_pushboolean(L, 1);
+	do {
+		unixL_random_buf(L, tmpext, sizeof tmpext - 1, base32, sizeof base32);
+		tmpext[sizeof tmpext - 1] = '\0';
 
-	return 1;
-} /* unix_chroot() */
+		if ((error = u_snprintf(tmpnam, sizeof tmpnam, ".%.200s.%s", base, tmpext)))
+			return error;
+	} while ((error = u_openat(&fd, dfd, tmpnam, O_WRONLY|O_CREAT|O_EXCL|U_CLOEXEC, mode)) == EEXIST);
 
+	if (error)
+		return error;
 
-static int unix_clearerr(lua_State *L) {
-	clearerr(unixL_checkfile(L, 1));
+	if ((error = aw_write(L, fd, index)))
+		goto error;
 
-	lua_pushvalue(L, 1);
+	if (sync && 0 != fsync(fd))
+		goto syerr;
 
-	return 1;
-} /* unix_clearerr() */
+	/* on NFS, close can report write errors that fsync did not */
+	error = u_close_nocancel(fd);
+	fd = -1;
 
+	if (error)
+		goto error;
 
-static int unix_clock_gettime(lua_State *L) {
-#if __APPLE__
-	unixL_State *U = unixL_getstate(L);
-	int id = unixL_optclockid(L, 1, U_CLOCK_REALTIME);
-	struct timeval tv;
-	struct timespec ts;
-#if USE_CLOCK_GET_TIME
-	mach_timespec_t abt;
-#else
-	uint64_t abt;
-#endif
+	if ((error = aw_rename(dfd, tmpnam, base, flags)))
+		goto error;
 
-	switch (id) {
+	return 0;
+syerr:
+	error = errno;
+error:
+	u_close(&fd);
+	(void)unlinkat(dfd, tmpnam, 0);
+
+	return error;
+} /* aw_tmpname() */
+
+static int unix_atomic_write(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	const char *base;
+	char *dir = NULL;
+	mode_t mode = 0666;
+	int at = AT_FDCWD, dfd = -1, flags = 0, error;
+	_Bool sync = 1, dirsync = 0;
+
+	size_t i;
+
+	if (lua_type(L, 2) == LUA_TTABLE) {
+		for (i = 1; i <= lua_rawlen(L, 2); i++) {
+			lua_rawgeti(L, 2, i);
+			luaL_argcheck(L, lua_isstring(L, -1), 2, "array of strings expected");
+			lua_pop(L, 1);
+		}
+	} else {
+		luaL_checkstring(L, 2);
+	}
+
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+
+		lua_getfield(L, 3, "at");
+		at = unixL_optatfileno(L, -1, AT_FDCWD);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "mode");
+		mode = unixL_optmode(L, -1, mode, mode);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "sync");
+		if (!lua_isnil(L, -1))
+			sync = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "dirsync");
+		dirsync = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "noreplace");
+		if (lua_toboolean(L, -1))
+			flags |= AW_NOREPLACE;
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "exchange");
+		if (lua_toboolean(L, -1))
+			flags |= AW_EXCHANGE;
+		lua_pop(L, 1);
+
+		luaL_argcheck(L, flags != (AW_NOREPLACE|AW_EXCHANGE), 3, "noreplace and exchange are mutually exclusive");
+	}
+
+	base = (strrchr(path, '/'))? strrchr(path, '/') + 1 : path;
+
+	luaL_argcheck(L, *base && strcmp(base, ".") && strcmp(base, ".."), 1, "path does not name a file");
+
+	if (base != path) {
+		if (!(dir = strdup(path)))
+			goto syerr;
+
+		dir[(base - 1 == path)? 1 : base - 1 - path] = '\0';
+	}
+
+	/* the directory must be readable (not O_SEARCH) so it can be synced */
+	if ((error = u_openat(&dfd, at, (dir)? dir : ".", O_RDONLY|O_DIRECTORY|U_CLOEXEC, 0)))
+		goto error;
+
+	error = ENOTSUP;
+#if defined O_TMPFILE && __linux
+	error = aw_tmpfile(L, dfd, base, 2, mode, flags, sync);
+#endif
+	if (error == ENOTSUP)
+		error = aw_tmpname(L, dfd, base, 2, mode, flags, sync);
+
+	if (error)
+		goto error;
+
+	if (dirsync && 0 != fsync(dfd))
+		goto syerr;
+
+	u_close(&dfd);
+	free(dir);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+syerr:
+	error = errno;
+error:
+	u_close(&dfd);
+	free(dir);
+
+	return unixL_pusherror(L, error, "atomic_write", "0$#");
+} /* unix_atomic_write() */
+#endif
+
+
+static int unix_bind(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+	size_t addrlen;
+	struct sockaddr *addr = unixL_checksockaddr(L, 2, &addrlen);
+
+	if (0 != bind(fd, addr, addrlen))
+		return unixL_pusherror(L, errno, "bind", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_bind() */
+
+
+static int unix_bitand(lua_State *L) {
+	unixL_pushinteger(L, unixL_checkinteger(L, 1) & unixL_checkinteger(L, 2));
+
+	return 1;
+} /* unix_bitand() */
+
+
+static int unix_bitor(lua_State *L) {
+	unixL_pushinteger(L, unixL_checkinteger(L, 1) | unixL_checkinteger(L, 2));
+
+	return 1;
+} /* unix_bitor() */
+
+
+static int unsafe_calloc(lua_State *L) {
+	size_t count = unixL_checksize(L, 1);
+	size_t size = unixL_checksize(L, 2);
+	void *addr;
+
+	if (!(addr = calloc(count, size)) && count > 0 && size > 0)
+		return unixL_pusherror(L, errno, "calloc", "~$#");
+
+	lua_pushlightuserdata(L, addr);
+	return 1;
+} /* unsafe_calloc() */
+
+
+static int unix_chdir(lua_State *L) {
+	int fd;
+
+	if (-1 != (fd = unixL_optfileno(L, 1, -1))) {
+		if (0 != fchdir(fd))
+			return unixL_pusherror(L, errno, "chdir", "0$#");
+	} else {
+		const char *path = luaL_checkstring(L, 1);
+
+		if (0 != chdir(path))
+			return unixL_pusherror(L, errno, "chdir", "0$#");
+	}
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_chdir() */
+
+
+static int unix_chmod(lua_State *L) {
+	mode_t omode = 0777, mode;
+	_Bool octal;
+	struct stat st;
+	int fd;
+
+	luaL_checkany(L, 2);
+	lua_pushvalue(L, 2);
+	octal = lua_isnumber(L, -1); /* octal notation or literal number */
+	lua_pop(L, 1);
+
+	if (-1 != (fd = unixL_optfileno(L, 1, -1))) {
+		if (!octal) {
+			if (0 != fstat(fd, &st))
+				return unixL_pusherror(L, errno, "chmod", "0$#");
+
+			omode = st.st_mode;
+		}
+
+		mode = unixL_checkmode(L, 2, omode);
+
+		if (0 != fchmod(fd, mode))
+			return unixL_pusherror(L, errno, "chmod", "0$#");
+	} else {
+		const char *path = luaL_checkstring(L, 1);
+
+		if (!octal) {
+			if (0 != stat(path, &st))
+				return unixL_pusherror(L, errno, "chmod", "0$#");
+
+			omode = st.st_mode;
+		}
+
+		mode = unixL_checkmode(L, 2, omode);
+
+		if (0 != chmod(path, mode))
+			return unixL_pusherror(L, errno, "chmod", "0$#");
+	}
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_chmod() */
+
+
+static int unix_chown(lua_State *L) {
+	uid_t uid = unixL_optuid(L, 2, -1);
+	gid_t gid = unixL_optgid(L, 3, -1);
+	int fd;
+
+	if (-1 != (fd = unixL_optfileno(L, 1, -1))) {
+		if (0 != fchown(fd, uid, gid))
+			return unixL_pusherror(L, errno, "chown", "0$#");
+	} else {
+		const char *path = luaL_checkstring(L, 1);
+
+		if (0 != chown(path, uid, gid))
+			return unixL_pusherror(L, errno, "chown", "0$#");
+	}
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_chown() */
+
+
+static int unix_chroot(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+
+	if (0 != chroot(path))
+		return unixL_pusherror(L, errno, "chroot", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_chroot() */
+
+
+static int unix_clearerr(lua_State *L) {
+	clearerr(unixL_checkfile(L, 1));
+
+	lua_pushvalue(L, 1);
+
+	return 1;
+} /* unix_clearerr() */
+
+
+static int unix_clock_gettime(lua_State *L) {
+#if __APPLE__
+	unixL_State *U = unixL_getstate(L);
+	int id = unixL_optclockid(L, 1, U_CLOCK_REALTIME);
+	struct timeval tv;
+	struct timespec ts;
+#if USE_CLOCK_GET_TIME
+	mach_timespec_t abt;
+#else
+	uint64_t abt;
+#endif
+
+	switch (id) {
 	case U_CLOCK_REALTIME:
 		if (0 != gettimeofday(&tv, NULL))
 			return unixL_pusherror(L, errno, "clock_gettime", "~$#");
@@ -5726,6 +7006,21 @@ static int unix_close(lua_State *L) {
 } /* unix_close() */
 
 
+static int unix_close_range(lua_State *L) {
+	unsigned first = unixL_checkinteger(L, 1, 0, UINT_MAX);
+	unsigned last = (lua_isnoneornil(L, 2))? UINT_MAX : unixL_checkinteger(L, 2, 0, UINT_MAX);
+	int flags = luaL_optinteger(L, 3, 0);
+	int error;
+
+	if ((error = u_close_range(first, last, flags)))
+		return unixL_pusherror(L, error, "close_range", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_close_range() */
+
+
 static int dir_close(lua_State *);
 
 static int unix_closedir(lua_State *L) {
@@ -5733,6 +7028,19 @@ static int unix_closedir(lua_State *L) {
 } /* unix_closedir() */
 
 
+static int unix_closefrom(lua_State *L) {
+	unsigned first = unixL_checkinteger(L, 1, 0, UINT_MAX);
+	int error;
+
+	if ((error = u_close_range(first, UINT_MAX, 0)))
+		return unixL_pusherror(L, error, "closefrom", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_closefrom() */
+
+
 static int unix_closelog(lua_State *L) {
 	(void)L;
 	closelog();
@@ -5740,622 +7048,2082 @@ static int unix_closelog(lua_State *L) {
 } /* unix_closelog() */
 
 
-static int unix_dup(lua_State *L) {
-	int ofd = unixL_checkfileno(L, 1);
-	u_flags_t flags = luaL_optinteger(L, 2, 0);
-	int nfd, error;
+static void dircache_pushtable(lua_State *L, unixL_State *U) {
+	if (U->dircache.ref == LUA_NOREF) {
+		lua_newtable(L);
+		U->dircache.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
 
-	if ((error = u_dup(&nfd, ofd, flags)))
-		return unixL_pusherror(L, error, "dup", "~$#");
+	lua_rawgeti(L, LUA_REGISTRYINDEX, U->dircache.ref);
+} /* dircache_pushtable() */
 
-	lua_pushinteger(L, nfd);
+/* the object is closed when collected, unless a caller still holds it */
+static void dircache_evict(lua_State *L, unixL_State *U, size_t i) {
+	struct dircache_ent *ent = &U->dircache.ent[i];
 
-	return 1;
-} /* unix_dup() */
+	dircache_pushtable(L, U);
+	lua_pushnil(L);
+	lua_setfield(L, -2, ent->path);
+	lua_pop(L, 1);
 
+	free(ent->path);
+	*ent = U->dircache.ent[--U->dircache.count];
+} /* dircache_evict() */
 
-static int unix_dup2(lua_State *L) {
-	int ofd = unixL_checkfileno(L, 1);
-	int nfd = unixL_checkfileno(L, 2);
-	u_flags_t flags = luaL_optinteger(L, 3, 0);
-	int error;
+static void dircache_evictlru(lua_State *L, unixL_State *U) {
+	size_t i, lru = 0;
 
-	if ((error = u_dup2(ofd, nfd, flags)))
-		return unixL_pusherror(L, error, "dup2", "~$#");
+	for (i = 1; i < U->dircache.count; i++) {
+		if (U->dircache.ent[i].used < U->dircache.ent[lru].used)
+			lru = i;
+	}
 
-	lua_pushinteger(L, nfd);
+	dircache_evict(L, U, lru);
+} /* dircache_evictlru() */
 
-	return 1;
-} /* unix_dup2() */
+static _Bool dircache_isvalid(unixL_State *U, const struct dircache_ent *ent) {
+	struct stat st;
+
+	/*
+	 * Closed or released through the object, or the descriptor number
+	 * closed behind our back and reused, or the directory removed.
+	 */
+	if (ent->fo->fd < 0 || 0 != fstat(ent->fo->fd, &st))
+		return 0;
+	if (st.st_dev != ent->dev || st.st_ino != ent->ino || st.st_nlink == 0)
+		return 0;
 
+	if (U->dircache.strict) {
+		if (0 != stat(ent->path, &st) || st.st_dev != ent->dev || st.st_ino != ent->ino)
+			return 0;
+	}
 
-#if HAVE_DUP3
-static int unix_dup3(lua_State *L) {
-	int ofd = unixL_checkfileno(L, 1);
-	int nfd = unixL_checkfileno(L, 2);
-	u_flags_t flags = unixL_checkinteger(L, 3, U_FLAGS_MIN, U_FLAGS_MAX);
+	return 1;
+} /* dircache_isvalid() */
+
+/*
+ * Push the cached descriptor object for the directory at path, opening
+ * and caching it on a miss. Pushes nothing on error.
+ */
+static u_error_t dircache_open(lua_State *L, unixL_State *U, const char *path) {
+	struct dircache_ent *ent;
+	struct fdobj *fo;
+	struct stat st;
+	char *copy = NULL;
 	int error;
+	size_t i;
 
-	if ((error = u_dup2(ofd, nfd, flags)))
-		return unixL_pusherror(L, error, "dup2", "~$#");
+	for (i = 0; i < U->dircache.count; i++) {
+		ent = &U->dircache.ent[i];
 
-	lua_pushinteger(L, nfd);
+		if (strcmp(ent->path, path))
+			continue;
 
-	return 1;
-} /* unix_dup3() */
-#endif
+		if (dircache_isvalid(U, ent)) {
+			ent->used = ++U->dircache.clock;
+			U->dircache.hits++;
 
+			dircache_pushtable(L, U);
+			lua_getfield(L, -1, path);
+			lua_remove(L, -2);
 
-static u_error_t exec_addarg(unixL_State *U, size_t *arrp, const char *s) {
-	int error;
+			return 0;
+		}
 
-	if ((error = u_reallocarray_char_pp(&U->exec.arr, &U->exec.arrsiz, (*arrp)+1)))
-		return error;
+		dircache_evict(L, U, i);
 
-	U->exec.arr[(*arrp)++] = (char *)(s);
+		break;
+	}
 
-	return 0;
-} /* exec_addarg() */
+	U->dircache.misses++;
 
+	fo = fdobj_push(L);
 
-static u_error_t exec_addtable(lua_State *L, unixL_State *U, size_t *arrp, int index, int anchorindex) {
-	size_t i = 0;
-	int error = 0;
+	if ((error = u_open(&fo->fd, path, U_ATFLAGS, 0)))
+		goto error;
 
-	IPAIRS_BEGIN(L, index);
+	if (0 != fstat(fo->fd, &st))
+		goto syerr;
 
-	if (i++ >= INT_MAX)
-		IPAIRS_STOP(L);
+	if (!S_ISDIR(st.st_mode)) {
+		error = ENOTDIR;
+		goto error;
+	}
 
-	if ((error = exec_addarg(U, arrp, luaL_checkstring(L, -1))))
-		IPAIRS_STOP(L);
+	if (!(copy = strdup(path)))
+		goto syerr;
 
-	lua_pushvalue(L, -1);
-	lua_rawseti(L, anchorindex, *arrp); /* anchor value */
+	if (!U->dircache.ent) {
+		if (!(U->dircache.ent = calloc(U->dircache.max, sizeof *U->dircache.ent)))
+			goto syerr;
+	}
 
-	IPAIRS_END(L);
+	if (U->dircache.count >= U->dircache.max)
+		dircache_evictlru(L, U);
 
-	return error;
-} /* exec_addtable() */
+	dircache_pushtable(L, U);
+	lua_pushvalue(L, -2);
+	lua_setfield(L, -2, path);
+	lua_pop(L, 1);
 
+	ent = &U->dircache.ent[U->dircache.count++];
+	ent->path = copy;
+	ent->fo = fo;
+	ent->dev = st.st_dev;
+	ent->ino = st.st_ino;
+	ent->used = ++U->dircache.clock;
 
-static int unix_execve(lua_State *L) {
-	unixL_State *U = unixL_getstate(L);
-	const char *path = luaL_checkstring(L, 1);
-	size_t arrp = 0, argc = 0;
-	int error;
+	return 0;
+syerr:
+	error = errno;
+error:
+	free(copy);
+	lua_pop(L, 1);
 
-	lua_settop(L, 3); /* path, argv, env */
-	lua_newtable(L); /* string anchor */
+	return error;
+} /* dircache_open() */
 
-	if (!lua_isnil(L, 2)) {
-		if ((error = exec_addtable(L, U, &arrp, 2, 4)))
-			goto error;
-	}
+/* resize the cache, evicting least recently used entries as needed */
+static u_error_t dircache_setmax(lua_State *L, unixL_State *U, size_t max) {
+	while (U->dircache.count > max)
+		dircache_evictlru(L, U);
 
-	argc = arrp;
+	if (max == 0) {
+		free(U->dircache.ent);
+		U->dircache.ent = NULL;
+	} else if (U->dircache.ent && max != U->dircache.max) {
+		struct dircache_ent *ent;
 
-	if ((error = exec_addarg(U, &arrp, NULL)))
-		goto error;
+		if (!(ent = realloc(U->dircache.ent, max * sizeof *ent)))
+			return errno;
 
-	if (!lua_isnil(L, 3)) {
-		if ((error = exec_addtable(L, U, &arrp, 3, 4)))
-			goto error;
+		U->dircache.ent = ent;
 	}
 
-	if ((error = exec_addarg(U, &arrp, NULL)))
-		goto error;
-
-	execve(path, U->exec.arr, &U->exec.arr[argc + 1]);
-	error = errno;
-error:
-	return unixL_pusherror(L, error, "execve", "0$#");
-} /* unix_execve() */
+	U->dircache.max = max;
 
+	return 0;
+} /* dircache_setmax() */
 
-static int unix_execl(lua_State *L) {
+/*
+ * dirat(path)
+ *
+ * Split path into a descriptor object for its parent directory and the
+ * final component, suitable as the first two arguments to the *at
+ * routines. Parents of absolute paths come from the cache, which hands
+ * out the same object on every hit; eviction only drops the cache's
+ * reference. Relative parents depend on the working directory, so
+ * they're opened uncached, as is everything when the cache is disabled.
+ * A path without a directory wraps AT_FDCWD.
+ */
+static int unix_dirat(lua_State *L) {
 	unixL_State *U = unixL_getstate(L);
-	const char *path = luaL_checkstring(L, 1);
-	size_t arrp = 0;
-	int top, i, error;
+	size_t len, end;
+	const char *path = luaL_checklstring(L, 1, &len);
+	struct fdobj *fo;
+	int error;
 
-	top = lua_gettop(L);
+	lua_settop(L, 1);
 
-	for (i = 2; i <= top; i++) {
-		if ((error = exec_addarg(U, &arrp, luaL_checkstring(L, i))))
-			goto error;
-	}
+	end = len;
+	while (end > 1 && path[end - 1] == '/')
+		end--;
+	while (end > 0 && path[end - 1] != '/')
+		end--;
 
-	if ((error = exec_addarg(U, &arrp, NULL)))
-		goto error;
+	if (end == 0) {
+#if defined AT_FDCWD
+		fo = fdobj_push(L);
+		fo->fd = AT_FDCWD;
+		lua_pushvalue(L, 1);
 
-	execv(path, U->exec.arr);
-	error = errno;
-error:
-	return unixL_pusherror(L, error, "execl", "0$#");
-} /* unix_execl() */
+		return 2;
+#else
+		error = ENOTSUP;
+		goto error;
+#endif
+	}
 
+	if (U->bufsiz < end + 1 && (error = u_realloc(&U->buf, &U->bufsiz, end + 1)))
+		goto error;
 
-static int unix_execlp(lua_State *L) {
-	unixL_State *U = unixL_getstate(L);
-	const char *file = luaL_checkstring(L, 1);
-	size_t arrp = 0;
-	int top, i, error;
+	memcpy(U->buf, path, end);
+	U->buf[end] = '\0';
 
-	top = lua_gettop(L);
+	if (*path != '/' || U->dircache.max == 0) {
+		fo = fdobj_push(L);
 
-	for (i = 2; i <= top; i++) {
-		if ((error = exec_addarg(U, &arrp, luaL_checkstring(L, i))))
+		if ((error = u_open(&fo->fd, U->buf, U_ATFLAGS, 0)))
+			goto error;
+	} else {
+		if ((error = dircache_open(L, U, U->buf)))
 			goto error;
 	}
 
-	if ((error = exec_addarg(U, &arrp, NULL)))
-		goto error;
+	lua_pushlstring(L, &path[end], len - end);
 
-	execvp(file, U->exec.arr);
-	error = errno;
+	return 2;
 error:
-	return unixL_pusherror(L, error, "execlp", "0$#");
-} /* unix_execlp() */
+	return unixL_pusherror(L, error, "dirat", "~$#");
+} /* unix_dirat() */
 
 
-static int unix_execvp(lua_State *L) {
+/*
+ * dircache([max][, strict])
+ *
+ * Configure the directory descriptor cache used by dirat. Returns the
+ * number of cached descriptors and the hit and miss counts.
+ */
+static int unix_dircache(lua_State *L) {
 	unixL_State *U = unixL_getstate(L);
-	const char *file = luaL_checkstring(L, 1);
-	size_t arrp = 0;
 	int error;
 
-	lua_settop(L, 2); /* file, argv */
-	lua_newtable(L); /* string anchor */
-
-	if (!lua_isnil(L, 2)) {
-		if ((error = exec_addtable(L, U, &arrp, 2, 3)))
-			goto error;
+	if (!lua_isnoneornil(L, 1)) {
+		if ((error = dircache_setmax(L, U, unixL_checkinteger(L, 1, 0, 4096))))
+			return luaL_error(L, "dircache: %s", unixL_strerror(L, error));
 	}
 
-	if ((error = exec_addarg(U, &arrp, NULL)))
-		goto error;
+	if (!lua_isnone(L, 2))
+		U->dircache.strict = lua_toboolean(L, 2);
 
-	execvp(file, U->exec.arr);
-	error = errno;
-error:
-	return unixL_pusherror(L, error, "execvp", "0$#");
-} /* unix_execvp() */
+	unixL_pushsize(L, U->dircache.count);
+	unixL_pushunsigned(L, U->dircache.hits);
+	unixL_pushunsigned(L, U->dircache.misses);
 
+	return 3;
+} /* unix_dircache() */
 
-static int unix__exit(lua_State *L) {
-	int status;
 
-	if (lua_isboolean(L, 1))
-		status = (lua_toboolean(L, 1))? EXIT_SUCCESS : EXIT_FAILURE;
-	else
-		status = luaL_optint(L, 1, EXIT_SUCCESS);
+#if HAVE_FSTATAT && HAVE_FDOPENDIR
+/*
+ * Disk usage aggregation. Totals are accumulated bottom up while walking
+ * with fstatat relative to each directory descriptor, and recorded for
+ * every directory no deeper than the requested depth.
+ */
+#define DU_OFLAGS (O_RDONLY|O_DIRECTORY|O_NOFOLLOW|U_CLOEXEC)
 
-	if (L) /* quiet statement not reached warning */
-		_exit(status);
+struct du_sum {
+	unixL_Unsigned blocks, size, count;
+}; /* struct du_sum */
 
-	return 0;
-} /* unix__exit() */
+struct du_ent {
+	char *path;
+	struct du_sum sum;
+}; /* struct du_ent */
 
+struct du_ino {
+	dev_t dev;
+	ino_t ino;
+	_Bool used;
+}; /* struct du_ino */
 
-static int unix_exit(lua_State *L) {
-	int status;
-	if (lua_isboolean(L, 1))
-		status = (lua_toboolean(L, 1))? EXIT_SUCCESS : EXIT_FAILURE;
-	else
-		status = luaL_optint(L, 1, EXIT_SUCCESS);
+struct du {
+	int maxdepth;
+	_Bool xdev, links;
+	dev_t dev;
 
-	if (L) /* quiet statement not reached warning */
-		exit(status);
+	struct du_ino *seen; /* open addressed set of multiply-linked files */
+	size_t nseen, seensiz;
 
-	return 0;
-} /* unix_exit() */
+	struct du_ent *ent;
+	size_t nent, entsiz;
 
+	char *buf;
+	size_t bufsiz;
 
-static int unix_faccessat(lua_State *L) {
-	int fd = unixL_checkatfileno(L, 1);
-	const char *path = luaL_checkstring(L, 2);
-	int mode = luaL_checkint(L, 3);
-	int flags = luaL_checkint(L, 4);
+	unixL_Unsigned nerror;
+}; /* struct du */
 
-	if (0 != faccessat(fd, path, mode, flags))
-		return unixL_pusherror(L, errno, "faccessat", "~$#");
+U_REALLOCARRAY_GENERATE(struct du_ent *, u_reallocarray_du_ent)
 
-	lua_pushboolean(L, 1);
+static size_t du_hash(dev_t dev, ino_t ino, size_t mask) {
+	unsigned long long h = ((unsigned long long)dev * 0x9e3779b97f4a7c15ULL) ^ (unsigned long long)ino;
 
-	return 1;
-} /* unix_faccessat() */
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 32;
 
+	return (size_t)h & mask;
+} /* du_hash() */
 
-static int fcntl_flock(lua_State *L, int fd, int cmd, int index) {
-	struct flock l = { 0 };
+/* add dev/ino to the seen set; *isnew is 0 if already present */
+static u_error_t du_insert(struct du *du, dev_t dev, ino_t ino, _Bool *isnew) {
+	struct du_ino *slot;
+	size_t i;
 
-	l.l_type = F_WRLCK;
-	l.l_whence = SEEK_SET;
+	if (du->nseen + 1 > du->seensiz / 2) {
+		size_t seensiz = MAX(64, du->seensiz * 2), j;
+		struct du_ino *seen;
 
-	if (!lua_isnoneornil(L, index)) {
-		luaL_checktype(L, index, LUA_TTABLE);
+		if (!(seen = calloc(seensiz, sizeof *seen)))
+			return errno;
 
-		lua_getfield(L, index, "type");
-		l.l_type = luaL_optint(L, -1, l.l_type);
-		lua_pop(L, 1);
+		for (j = 0; j < du->seensiz; j++) {
+			if (!du->seen[j].used)
+				continue;
 
-		lua_getfield(L, index, "whence");
-		l.l_whence = luaL_optint(L, -1, l.l_whence);
-		lua_pop(L, 1);
+			for (i = du_hash(du->seen[j].dev, du->seen[j].ino, seensiz - 1); seen[i].used; i = (i + 1) & (seensiz - 1))
+				;;
 
-		lua_getfield(L, index, "start");
-		l.l_start = luaL_optint(L, -1, l.l_start);
-		lua_pop(L, 1);
+			seen[i] = du->seen[j];
+		}
 
-		lua_getfield(L, index, "len");
-		l.l_len = luaL_optint(L, -1, l.l_len);
-		lua_pop(L, 1);
+		free(du->seen);
+		du->seen = seen;
+		du->seensiz = seensiz;
 	}
 
-	if (-1 == fcntl(fd, cmd, &l))
-		return unixL_pusherror(L, errno, "fcntl", "~$#");
+	for (i = du_hash(dev, ino, du->seensiz - 1); (slot = &du->seen[i])->used; i = (i + 1) & (du->seensiz - 1)) {
+		if (slot->dev == dev && slot->ino == ino) {
+			*isnew = 0;
 
-	if (cmd == F_GETLK) {
-		lua_createtable(L, 0, 5);
+			return 0;
+		}
+	}
 
-		lua_pushinteger(L, l.l_type);
-		lua_setfield(L, -2, "type");
+	slot->dev = dev;
+	slot->ino = ino;
+	slot->used = 1;
+	du->nseen++;
+	*isnew = 1;
 
-		lua_pushinteger(L, l.l_whence);
-		lua_setfield(L, -2, "whence");
+	return 0;
+} /* du_insert() */
 
-		lua_pushinteger(L, l.l_start);
-		lua_setfield(L, -2, "start");
+static void du_add(struct du_sum *sum, const struct stat *st) {
+#if HAVE_STRUCT_STAT_ST_BLOCKS
+	sum->blocks += st->st_blocks;
+#endif
+	sum->size += st->st_size;
+	sum->count++;
+} /* du_add() */
 
-		lua_pushinteger(L, l.l_len);
-		lua_setfield(L, -2, "len");
+static u_error_t du_record(struct du *du, size_t len, const struct du_sum *sum) {
+	struct du_ent *ent;
+	int error;
 
-		lua_pushinteger(L, l.l_pid);
-		lua_setfield(L, -2, "pid");
+	if ((error = u_reallocarray_du_ent(&du->ent, &du->entsiz, du->nent + 1)))
+		return error;
 
-		return 1;
-	} else {
-		lua_pushboolean(L, 1);
+	ent = &du->ent[du->nent];
 
-		return 1;
-	}
-} /* fcntl_flock() */
+	if (!(ent->path = malloc(len + 1)))
+		return errno;
 
+	memcpy(ent->path, du->buf, len);
+	ent->path[len] = '\0';
+	ent->sum = *sum;
+	du->nent++;
 
-static int unix_fcntl(lua_State *L) {
-	int fd = unixL_checkfileno(L, 1);
-	int cmd = luaL_checkint(L, 2);
-	u_flags_t flags;
-	int dupfd, pid, error;
+	return 0;
+} /* du_record() */
 
-	switch (cmd) {
-#if defined F_DUPFD_CLOEXEC
-	case F_DUPFD_CLOEXEC:
-		/* FALL THROUGH */
-#endif
-#if defined F_DUP2FD_CLOEXEC
-	case F_DUP2FD_CLOEXEC:
+/*
+ * Accumulate the contents of the directory open at fd, whose path is the
+ * first len bytes of du->buf, into sum. Takes ownership of fd.
+ */
+static u_error_t du_walk(struct du *du, int fd, size_t len, int depth, struct du_sum *sum) {
+	struct dirent *ent = NULL, *res;
+	DIR *dp = NULL;
+	struct stat st;
+	long namemax;
+	int error;
+
+	if (-1 == (namemax = fpathconf(fd, _PC_NAME_MAX)))
+		goto syerr;
+
+	if (!(ent = malloc(sizeof *ent + namemax + 1)))
+		goto syerr;
+
+	if (!(dp = fdopendir(fd)))
+		goto syerr;
+
+	fd = -1;
+
+	while (!(error = u_readdir_r(dp, ent, &res)) && res) {
+		const char *name = res->d_name;
+
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
+
+		if (0 != fstatat(dirfd(dp), name, &st, AT_SYMLINK_NOFOLLOW)) {
+			du->nerror++;
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			struct du_sum sub = { 0, 0, 0 };
+			size_t namelen = strlen(name), n = len;
+			int nfd;
+
+			if (du->xdev && st.st_dev != du->dev)
+				continue;
+
+			du_add(&sub, &st);
+
+			if ((error = u_openat(&nfd, dirfd(dp), name, DU_OFLAGS, 0))) {
+				if (error == ENOMEM)
+					goto error;
+
+				du->nerror++;
+			} else {
+				if (du->bufsiz < len + namelen + 2 && (error = u_realloc(&du->buf, &du->bufsiz, len + namelen + 2))) {
+					u_close(&nfd);
+					goto error;
+				}
+
+				if (n > 0 && du->buf[n - 1] != '/')
+					du->buf[n++] = '/';
+
+				memcpy(&du->buf[n], name, namelen);
+
+				if ((error = du_walk(du, nfd, n + namelen, depth + 1, &sub)))
+					goto error;
+			}
+
+			sum->blocks += sub.blocks;
+			sum->size += sub.size;
+			sum->count += sub.count;
+		} else {
+			if (!du->links && st.st_nlink > 1) {
+				_Bool isnew;
+
+				if ((error = du_insert(du, st.st_dev, st.st_ino, &isnew)))
+					goto error;
+
+				if (!isnew)
+					continue;
+			}
+
+			du_add(sum, &st);
+		}
+	}
+
+	if (error)
+		du->nerror++;
+
+	closedir(dp);
+	free(ent);
+
+	return (depth <= du->maxdepth)? du_record(du, len, sum) : 0;
+syerr:
+	error = errno;
+error:
+	if (dp)
+		closedir(dp);
+	u_close(&fd);
+	free(ent);
+
+	return error;
+} /* du_walk() */
+
+static void du_free(struct du *du) {
+	size_t i;
+
+	for (i = 0; i < du->nent; i++)
+		free(du->ent[i].path);
+
+	free(du->ent);
+	free(du->seen);
+	free(du->buf);
+} /* du_free() */
+
+/*
+ * du(path[, opts])
+ *
+ * Returns a table of column arrays (path, blocks, size, count) with one
+ * row per directory no deeper than opts.depth, children before parents,
+ * plus the number of entries which couldn't be read.
+ */
+static int unix_du(lua_State *L) {
+	size_t len;
+	const char *path = luaL_checklstring(L, 1, &len);
+	struct du du = { 0 };
+	struct du_sum sum = { 0, 0, 0 };
+	struct stat st;
+	int fd = -1, error;
+	size_t i;
+
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+
+		du.maxdepth = unixL_optfint(L, 2, "depth", 0);
+
+		lua_getfield(L, 2, "xdev");
+		du.xdev = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "links");
+		du.links = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+
+	if ((error = u_realloc(&du.buf, &du.bufsiz, len + 1)))
+		goto error;
+
+	memcpy(du.buf, path, len + 1);
+
+	if (0 != lstat(path, &st))
+		goto syerr;
+
+	du.dev = st.st_dev;
+	du_add(&sum, &st);
+
+	if (S_ISDIR(st.st_mode)) {
+		if ((error = u_open(&fd, path, DU_OFLAGS, 0)))
+			goto error;
+
+		if ((error = du_walk(&du, fd, len, 0, &sum)))
+			goto error;
+	} else if ((error = du_record(&du, len, &sum))) {
+		goto error;
+	}
+
+	lua_createtable(L, 0, 4);
+
+	lua_createtable(L, du.nent, 0);
+	for (i = 0; i < du.nent; i++) {
+		lua_pushstring(L, du.ent[i].path);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "path");
+
+	lua_createtable(L, du.nent, 0);
+	for (i = 0; i < du.nent; i++) {
+		unixL_pushunsigned(L, du.ent[i].sum.blocks);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "blocks");
+
+	lua_createtable(L, du.nent, 0);
+	for (i = 0; i < du.nent; i++) {
+		unixL_pushunsigned(L, du.ent[i].sum.size);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "size");
+
+	lua_createtable(L, du.nent, 0);
+	for (i = 0; i < du.nent; i++) {
+		unixL_pushunsigned(L, du.ent[i].sum.count);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "count");
+
+	unixL_pushunsigned(L, du.nerror);
+	du_free(&du);
+
+	return 2;
+syerr:
+	error = errno;
+error:
+	du_free(&du);
+
+	return unixL_pusherror(L, error, "du", "~$#");
+} /* unix_du() */
+#endif
+
+
+static int unix_dup(lua_State *L) {
+	int ofd = unixL_checkfileno(L, 1);
+	u_flags_t flags = luaL_optinteger(L, 2, 0);
+	int nfd, error;
+
+	if ((error = u_dup(&nfd, ofd, flags)))
+		return unixL_pusherror(L, error, "dup", "~$#");
+
+	lua_pushinteger(L, nfd);
+
+	return 1;
+} /* unix_dup() */
+
+
+static int unix_dup2(lua_State *L) {
+	int ofd = unixL_checkfileno(L, 1);
+	int nfd = unixL_checkfileno(L, 2);
+	u_flags_t flags = luaL_optinteger(L, 3, 0);
+	int error;
+
+	if ((error = u_dup2(ofd, nfd, flags)))
+		return unixL_pusherror(L, error, "dup2", "~$#");
+
+	fdobj_invalidate(L, 2);
+
+	lua_pushinteger(L, nfd);
+
+	return 1;
+} /* unix_dup2() */
+
+
+#if HAVE_DUP3
+static int unix_dup3(lua_State *L) {
+	int ofd = unixL_checkfileno(L, 1);
+	int nfd = unixL_checkfileno(L, 2);
+	u_flags_t flags = unixL_checkinteger(L, 3, U_FLAGS_MIN, U_FLAGS_MAX);
+	int error;
+
+	if ((error = u_dup2(ofd, nfd, flags)))
+		return unixL_pusherror(L, error, "dup2", "~$#");
+
+	fdobj_invalidate(L, 2);
+
+	lua_pushinteger(L, nfd);
+
+	return 1;
+} /* unix_dup3() */
+#endif
+
+
+static u_error_t exec_addarg(unixL_State *U, size_t *arrp, const char *s) {
+	int error;
+
+	if ((error = u_reallocarray_char_pp(&U->exec.arr, &U->exec.arrsiz, (*arrp)+1)))
+		return error;
+
+	U->exec.arr[(*arrp)++] = (char *)(s);
+
+	return 0;
+} /* exec_addarg() */
+
+
+static u_error_t exec_addtable(lua_State *L, unixL_State *U, size_t *arrp, int index, int anchorindex) {
+	size_t i = 0;
+	int error = 0;
+
+	IPAIRS_BEGIN(L, index);
+
+	if (i++ >= INT_MAX)
+		IPAIRS_STOP(L);
+
+	if ((error = exec_addarg(U, arrp, luaL_checkstring(L, -1))))
+		IPAIRS_STOP(L);
+
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, anchorindex, *arrp); /* anchor value */
+
+	IPAIRS_END(L);
+
+	return error;
+} /* exec_addtable() */
+
+
+/*
+ * Apply exec options. .closefrom marks every descriptor from that number
+ * up close-on-exec rather than closing them, so they survive a failed exec.
+ */
+static u_error_t exec_setopts(lua_State *L, int index) {
+	unsigned fd;
+
+	if (lua_isnoneornil(L, index))
+		return 0;
+
+	luaL_checktype(L, index, LUA_TTABLE);
+
+	lua_getfield(L, index, "closefrom");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	fd = unixL_checkinteger(L, -1, 0, UINT_MAX);
+	lua_pop(L, 1);
+
+	return u_close_range(fd, UINT_MAX, CLOSE_RANGE_CLOEXEC);
+} /* exec_setopts() */
+
+
+static int unix_execve(lua_State *L) {
+	unixL_State *U = unixL_getstate(L);
+	const char *path = luaL_checkstring(L, 1);
+	size_t arrp = 0, argc = 0;
+	int error;
+
+	lua_settop(L, 4); /* path, argv, env, opts */
+	lua_newtable(L); /* string anchor */
+
+	if (!lua_isnil(L, 2)) {
+		if ((error = exec_addtable(L, U, &arrp, 2, 5)))
+			goto error;
+	}
+
+	argc = arrp;
+
+	if ((error = exec_addarg(U, &arrp, NULL)))
+		goto error;
+
+	if (!lua_isnil(L, 3)) {
+		if ((error = exec_addtable(L, U, &arrp, 3, 5)))
+			goto error;
+	}
+
+	if ((error = exec_addarg(U, &arrp, NULL)))
+		goto error;
+
+	if ((error = exec_setopts(L, 4)))
+		goto error;
+
+	execve(path, U->exec.arr, &U->exec.arr[argc + 1]);
+	error = errno;
+error:
+	return unixL_pusherror(L, error, "execve", "0$#");
+} /* unix_execve() */
+
+
+static int unix_execl(lua_State *L) {
+	unixL_State *U = unixL_getstate(L);
+	const char *path = luaL_checkstring(L, 1);
+	size_t arrp = 0;
+	int top, i, error;
+
+	top = lua_gettop(L);
+
+	for (i = 2; i <= top; i++) {
+		if ((error = exec_addarg(U, &arrp, luaL_checkstring(L, i))))
+			goto error;
+	}
+
+	if ((error = exec_addarg(U, &arrp, NULL)))
+		goto error;
+
+	execv(path, U->exec.arr);
+	error = errno;
+error:
+	return unixL_pusherror(L, error, "execl", "0$#");
+} /* unix_execl() */
+
+
+static int unix_execlp(lua_State *L) {
+	unixL_State *U = unixL_getstate(L);
+	const char *file = luaL_checkstring(L, 1);
+	size_t arrp = 0;
+	int top, i, error;
+
+	top = lua_gettop(L);
+
+	for (i = 2; i <= top; i++) {
+		if ((error = exec_addarg(U, &arrp, luaL_checkstring(L, i))))
+			goto error;
+	}
+
+	if ((error = exec_addarg(U, &arrp, NULL)))
+		goto error;
+
+	execvp(file, U->exec.arr);
+	error = errno;
+error:
+	return unixL_pusherror(L, error, "execlp", "0$#");
+} /* unix_execlp() */
+
+
+static int unix_execvp(lua_State *L) {
+	unixL_State *U = unixL_getstate(L);
+	const char *file = luaL_checkstring(L, 1);
+	size_t arrp = 0;
+	int error;
+
+	lua_settop(L, 3); /* file, argv, opts */
+	lua_newtable(L); /* string anchor */
+
+	if (!lua_isnil(L, 2)) {
+		if ((error = exec_addtable(L, U, &arrp, 2, 4)))
+			goto error;
+	}
+
+	if ((error = exec_addarg(U, &arrp, NULL)))
+		goto error;
+
+	if ((error = exec_setopts(L, 3)))
+		goto error;
+
+	execvp(file, U->exec.arr);
+	error = errno;
+error:
+	return unixL_pusherror(L, error, "execvp", "0$#");
+} /* unix_execvp() */
+
+
+static int unix__exit(lua_State *L) {
+	int status;
+
+	if (lua_isboolean(L, 1))
+		status = (lua_toboolean(L, 1))? EXIT_SUCCESS : EXIT_FAILURE;
+	else
+		status = luaL_optint(L, 1, EXIT_SUCCESS);
+
+	if (L) /* quiet statement not reached warning */
+		_exit(status);
+
+	return 0;
+} /* unix__exit() */
+
+
+static int unix_exit(lua_State *L) {
+	int status;
+	if (lua_isboolean(L, 1))
+		status = (lua_toboolean(L, 1))? EXIT_SUCCESS : EXIT_FAILURE;
+	else
+		status = luaL_optint(L, 1, EXIT_SUCCESS);
+
+	if (L) /* quiet statement not reached warning */
+		exit(status);
+
+	return 0;
+} /* unix_exit() */
+
+
+#if defined SEEK_DATA && defined SEEK_HOLE
+static int extents_next(lua_State *L) {
+	int fd = unixL_checkfileno(L, lua_upvalueindex(1));
+	off_t pos = unixL_checkoff(L, lua_upvalueindex(2));
+	off_t end = unixL_checkoff(L, lua_upvalueindex(3));
+	off_t next;
+	_Bool isdata;
+
+	if (pos >= end)
+		return 0;
+
+	if (-1 == (next = lseek(fd, pos, SEEK_DATA))) {
+		if (errno != ENXIO)
+			return luaL_error(L, "extents: %s", unixL_strerror(L, errno));
+
+		/* only a hole remains */
+		next = end;
+		isdata = 0;
+	} else if (next > pos) {
+		isdata = 0;
+	} else {
+		if (-1 == (next = lseek(fd, pos, SEEK_HOLE)))
+			return luaL_error(L, "extents: %s", unixL_strerror(L, errno));
+
+		isdata = 1;
+	}
+
+	next = MIN(next, end);
+
+	unixL_pushoff(L, next);
+	lua_replace(L, lua_upvalueindex(2));
+
+	unixL_pushoff(L, pos);
+	unixL_pushoff(L, next - pos);
+	lua_pushboolean(L, isdata);
+
+	return 3;
+} /* extents_next() */
+
+static int unix_extents(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+	off_t offset = unixL_optoff(L, 2, 0);
+	off_t end;
+	struct stat st;
+
+	luaL_argcheck(L, offset >= 0, 2, "negative offset");
+
+	if (0 != fstat(fd, &st))
+		return unixL_pusherror(L, errno, "extents", "~$#");
+
+	end = st.st_size;
+
+	if (!lua_isnoneornil(L, 3)) {
+		off_t len = unixL_checkoff(L, 3);
+
+		luaL_argcheck(L, len >= 0, 3, "negative length");
+
+		if (offset < end && len < end - offset)
+			end = offset + len;
+	}
+
+	lua_pushvalue(L, 1);
+	unixL_pushoff(L, offset);
+	unixL_pushoff(L, end);
+	lua_pushcclosure(L, &extents_next, 3);
+
+	return 1;
+} /* unix_extents() */
+#endif
+
+
+static int unix_faccessat(lua_State *L) {
+	int fd = unixL_checkatfileno(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	int mode = luaL_checkint(L, 3);
+	int flags = luaL_checkint(L, 4);
+
+	if (0 != faccessat(fd, path, mode, flags))
+		return unixL_pusherror(L, errno, "faccessat", "~$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_faccessat() */
+
+
+#if HAVE_FALLOCATE
+static int unix_fallocate(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+	int mode = unixL_checkint(L, 2);
+	off_t offset = unixL_checkoff(L, 3);
+	off_t len = unixL_checkoff(L, 4);
+
+	if (0 != fallocate(fd, mode, offset, len))
+		return unixL_pusherror(L, errno, "fallocate", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_fallocate() */
+#endif
+
+
+static int fcntl_flock(lua_State *L, int fd, int cmd, int index) {
+	struct flock l = { 0 };
+
+	l.l_type = F_WRLCK;
+	l.l_whence = SEEK_SET;
+
+	if (!lua_isnoneornil(L, index)) {
+		luaL_checktype(L, index, LUA_TTABLE);
+
+		lua_getfield(L, index, "type");
+		l.l_type = luaL_optint(L, -1, l.l_type);
+		lua_pop(L, 1);
+
+		lua_getfield(L, index, "whence");
+		l.l_whence = luaL_optint(L, -1, l.l_whence);
+		lua_pop(L, 1);
+
+		lua_getfield(L, index, "start");
+		l.l_start = luaL_optint(L, -1, l.l_start);
+		lua_pop(L, 1);
+
+		lua_getfield(L, index, "len");
+		l.l_len = luaL_optint(L, -1, l.l_len);
+		lua_pop(L, 1);
+	}
+
+	if (-1 == fcntl(fd, cmd, &l))
+		return unixL_pusherror(L, errno, "fcntl", "~$#");
+
+	if (cmd == F_GETLK
+#if defined F_OFD_GETLK
+	|| cmd == F_OFD_GETLK
+#endif
+	) {
+		lua_createtable(L, 0, 5);
+
+		lua_pushinteger(L, l.l_type);
+		lua_setfield(L, -2, "type");
+
+		lua_pushinteger(L, l.l_whence);
+		lua_setfield(L, -2, "whence");
+
+		lua_pushinteger(L, l.l_start);
+		lua_setfield(L, -2, "start");
+
+		lua_pushinteger(L, l.l_len);
+		lua_setfield(L, -2, "len");
+
+		lua_pushinteger(L, l.l_pid);
+		lua_setfield(L, -2, "pid");
+
+		return 1;
+	} else {
+		lua_pushboolean(L, 1);
+
+		return 1;
+	}
+} /* fcntl_flock() */
+
+
+static int unix_fcntl(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+	int cmd = luaL_checkint(L, 2);
+	struct fdobj *fo = luaL_testudata(L, 1, "struct fd");
+	u_flags_t flags;
+	int dupfd, pid, error;
+
+	switch (cmd) {
+#if defined F_DUPFD_CLOEXEC
+	case F_DUPFD_CLOEXEC:
+		/* FALL THROUGH */
+#endif
+#if defined F_DUP2FD_CLOEXEC
+	case F_DUP2FD_CLOEXEC:
+		/* FALL THROUGH */
+#endif
+#if defined F_DUP2FD
+	case F_DUP2FD:
 		/* FALL THROUGH */
 #endif
-#if defined F_DUP2FD
-	case F_DUP2FD:
-		/* FALL THROUGH */
+	case F_DUPFD:
+		if (-1 == (dupfd = fcntl(fd, cmd, unixL_checkfileno(L, 3))))
+			goto syerr;
+
+		/* F_DUP2FD may have replaced an object's descriptor */
+		fdobj_invalidate(L, 3);
+
+		unixL_pushinteger(L, dupfd);
+
+		return 1;
+	case F_GETFD:
+		if ((flags = fcntl(fd, cmd)) < 0)
+			goto syerr;
+
+		unixL_pushinteger(L, flags);
+
+		return 1;
+	case F_GETFL:
+		if ((error = u_getflags(fd, &flags)))
+			goto error;
+
+		unixL_pushinteger(L, flags);
+
+		return 1;
+	case F_SETFD:
+		if (-1 == fcntl(fd, cmd, (int)luaL_checkint(L, 3)))
+			goto syerr;
+
+		if (fo && fo->haveflags) {
+			if (luaL_checkint(L, 3) & FD_CLOEXEC)
+				fo->flags |= U_CLOEXEC;
+			else
+				fo->flags &= ~U_CLOEXEC;
+		}
+
+		lua_pushboolean(L, 1);
+
+		return 1;
+	case F_SETFL:
+		flags = luaL_checknumber(L, 3);
+
+		if (-1 == fcntl(fd, cmd, (int)(U_SYSFLAGS & flags)))
+			goto syerr;
+
+		if (flags & U_CLOEXEC) {
+			if (-1 == fcntl(fd, F_SETFD, FD_CLOEXEC))
+				goto syerr;
+		}
+
+		/* the system ignores some flags, so refetch when next needed */
+		if (fo)
+			fo->haveflags = 0;
+
+		lua_pushboolean(L, 1);
+
+		return 1;
+	case F_GETOWN:
+		if (-1 == (pid = fcntl(fd, cmd)))
+			goto syerr;
+
+		lua_pushinteger(L, pid);
+
+		return 1;
+	case F_SETOWN:
+		pid = luaL_checkint(L, 3);
+
+		if (-1 == fcntl(fd, cmd, pid))
+			goto syerr;
+
+		lua_pushboolean(L, 1);
+
+		return 1;
+	case F_GETLK:
+	case F_SETLK:
+	case F_SETLKW:
+#if defined F_OFD_GETLK
+	case F_OFD_GETLK:
+#endif
+#if defined F_OFD_SETLK
+	case F_OFD_SETLK:
+#endif
+#if defined F_OFD_SETLKW
+	case F_OFD_SETLKW:
+#endif
+		return fcntl_flock(L, fd, cmd, 3);
+#if defined F_CLOSEM
+	case F_CLOSEM:
+		if (-1 == fcntl(fd, cmd))
+			goto syerr;
+
+		lua_pushboolean(L, 1);
+
+		return 1;
+#endif
+#if defined F_MAXFD
+	case F_MAXFD: {
+		int maxfd;
+
+		if (-1 == (maxfd = fcntl(fd, cmd)))
+			goto syerr;
+
+		lua_pushinteger(L, maxfd);
+
+		return 1;
+	}
+#endif
+#if defined F_GETPIPE_SZ
+	case F_GETPIPE_SZ: {
+		int size;
+
+		if (-1 == (size = fcntl(fd, cmd)))
+			goto syerr;
+
+		lua_pushinteger(L, size);
+
+		return 1;
+	}
+#endif
+#if defined F_SETPIPE_SZ
+	case F_SETPIPE_SZ: {
+		int size;
+
+		/* returns the actual size, which may have been rounded up */
+		if (-1 == (size = fcntl(fd, cmd, unixL_checkint(L, 3))))
+			goto syerr;
+
+		lua_pushinteger(L, size);
+
+		return 1;
+	}
+#endif
+#if defined F_GETPATH
+	case F_GETPATH: {
+		unixL_State *U = unixL_getstate(L);
+
+		if (U->bufsiz < MAXPATHLEN + 1) {
+			if ((error = u_realloc(&U->buf, &U->bufsiz, MAXPATHLEN + 1)))
+				goto error;
+		}
+
+		if (-1 == fcntl(fd, cmd, U->buf))
+			goto syerr;
+
+		lua_pushstring(L, U->buf);
+
+		return 1;
+	}
+#endif
+	default:
+		/*
+		 * NOTE: We don't allow unsupported operations because we
+		 * cannot know the argument type that fcntl expects. If it's
+		 * a pointer then this interface becomes a vector for
+		 * reading or writing random process memory.
+		 */
+		return luaL_error(L, "%d: unsupported fcntl operation", cmd);
+	} /* switch () */
+syerr:
+	error = errno;
+error:
+	return unixL_pusherror(L, error, "fcntl", "~$#");
+} /* unix_fcntl() */
+
+
+static int unsafe_fcntl(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+	int cmd = luaL_checkint(L, 2);
+	int n, r, error;
+
+	n = lua_gettop(L);
+	luaL_argcheck(L, n <= 3, 4, lua_pushfstring(L, "expected 3 arguments, got %d", n));
+
+	switch (lua_type(L, 3)) {
+	case LUA_TNONE: {
+		if (-1 == (r = fcntl(fd, cmd, (intptr_t)0)))
+			goto syerr;
+
+		lua_pushinteger(L, r);
+		return 1;
+	}
+	case LUA_TNUMBER: {
+		intptr_t arg = unixL_checkinteger(L, 3, INTPTR_MIN, INTPTR_MAX);
+
+		if (-1 == (r = fcntl(fd, cmd, arg)))
+			goto syerr;
+
+		lua_pushinteger(L, r);
+		return 1;
+	}
+	case LUA_TSTRING: {
+		const struct iovec iov = unixL_checkstring(L, 3, 0, SIZE_MAX);
+		unixL_State *U = unixL_getstate(L);
+
+		if (U->bufsiz < iov.iov_len && (error = u_realloc(&U->buf, &U->bufsiz, iov.iov_len)))
+			goto error;
+		memcpy(U->buf, iov.iov_base, iov.iov_len);
+
+		if (-1 == (r = fcntl(fd, cmd, U->buf)))
+			goto syerr;
+
+		lua_pushinteger(L, r);
+		lua_pushlstring(L, U->buf, iov.iov_len);
+		return 2;
+	}
+	}
+
+	return luaL_argerror(L, 3, lua_pushfstring(L, "expected integer or string, got %s", luaL_typename(L, 3)));
+syerr:
+	error = errno;
+error:
+	return unixL_pusherror(L, error, "fcntl", "~$#");
+} /* unsafe_fcntl() */
+
+
+#if HAVE_FDATASYNC
+static int unix_fdatasync(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+
+	if (0 != fdatasync(fd))
+		return unixL_pusherror(L, errno, "fdatasync", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_fdatasync() */
+#endif
+
+
+static int unix_fdopen(lua_State *L) {
+	u_flags_t flags;
+	const char *mode;
+	int fd, error;
+	luaL_Stream *fh;
+	int vmode;
+	size_t vsize;
+	_Bool vbuf;
+
+	lua_settop(L, 4);
+	luaL_argcheck(L, lua_type(L, 1) != LUA_TUSERDATA, 1, "cannot steal descriptor from existing handle");
+	fd = unixL_checkfileno(L, 1);
+	unixL_checkflags(L, 2, &mode, &flags, NULL);
+	vbuf = unixL_optvbuf(L, 3, &vmode, &vsize);
+
+	fh = unixL_prepfile(L);
+
+	if ((error = u_fdopen(&fh->f, &fd, mode, flags)))
+		return unixL_pusherror(L, error, "fdopen", "~$#");
+
+	if (vbuf && (error = unixL_setvbuf(L, -1, vmode, vsize)))
+		return unixL_pusherror(L, error, "fdopen", "~$#");
+
+	return 1;
+} /* unix_fdopen() */
+
+
+#if HAVE_FDOPENDIR
+static int unix_fdopendir(lua_State *L) {
+	DIR **dp;
+	int fd, error;
+
+	lua_settop(L, 1);
+	luaL_argcheck(L, lua_type(L, 1) != LUA_TUSERDATA, 1, "cannot steal descriptor from existing handle");
+	fd = unixL_checkfileno(L, 1);
+
+	dp = lua_newuserdata(L, sizeof *dp);
+	*dp = NULL;
+	luaL_setmetatable(L, "DIR*");
+
+	if ((error = u_fdopendir(dp, &fd, 0)))
+		return unixL_pusherror(L, error, "fdopendir", "~$#");
+
+	return 1;
+} /* unix_fdopendir() */
+#endif /* HAVE_FDOPENDIR */
+
+
+static int unix_fdup(lua_State *L) {
+	int fd = -1, ofd, error;
+	u_flags_t flags;
+	const char *mode;
+	luaL_Stream *fh;
+	int vmode;
+	size_t vsize;
+	_Bool vbuf;
+
+	lua_settop(L, 4);
+	ofd = unixL_checkfileno(L, 1);
+	unixL_checkflags(L, 2, &mode, &flags, NULL);
+	vbuf = unixL_optvbuf(L, 3, &vmode, &vsize);
+
+	fh = unixL_prepfile(L);
+
+	if ((error = u_dup(&fd, ofd, flags)))
+		goto error;
+
+	if ((error = u_fdopen(&fh->f, &fd, mode, flags)))
+		goto error;
+
+	if (vbuf && (error = unixL_setvbuf(L, -1, vmode, vsize)))
+		goto error;
+
+	return 1;
+error:
+	u_close(&fd);
+
+	return unixL_pusherror(L, error, "fopen", "~$#");
+} /* unix_fdup() */
+
+
+static struct fdobj *fdobj_checkself(lua_State *L, int index) {
+	struct fdobj *fo = luaL_checkudata(L, index, "struct fd");
+
+	luaL_argcheck(L, fo->fd != -1, index, "attempt to use a closed descriptor");
+
+	return fo;
+} /* fdobj_checkself() */
+
+static int fdobj_fileno(lua_State *L) {
+	struct fdobj *fo = luaL_checkudata(L, 1, "struct fd");
+
+	lua_pushinteger(L, fo->fd);
+
+	return 1;
+} /* fdobj_fileno() */
+
+/*
+ * Give up ownership, returning the integer descriptor.
+ */
+static int fdobj_release(lua_State *L) {
+	struct fdobj *fo = fdobj_checkself(L, 1);
+
+	lua_pushinteger(L, fo->fd);
+	fo->fd = -1;
+
+	return 1;
+} /* fdobj_release() */
+
+static int fdobj_flags(lua_State *L) {
+	struct fdobj *fo = fdobj_checkself(L, 1);
+	u_flags_t flags;
+	int error;
+
+	if (lua_toboolean(L, 2))
+		fo->haveflags = 0;
+
+	if ((error = fdobj_getflags(fo, &flags)))
+		return unixL_pusherror(L, error, "flags", "~$#");
+
+	unixL_pushinteger(L, flags);
+
+	return 1;
+} /* fdobj_flags() */
+
+static int fdobj_xflag(lua_State *L, u_flags_t flag, const char *what) {
+	struct fdobj *fo = fdobj_checkself(L, 1);
+	u_flags_t flags;
+	int error;
+
+	if (!lua_isnoneornil(L, 2)) {
+		if ((error = fdobj_setflag(fo, flag, lua_toboolean(L, 2))))
+			return unixL_pusherror(L, error, what, "~$#");
+	}
+
+	if ((error = fdobj_getflags(fo, &flags)))
+		return unixL_pusherror(L, error, what, "~$#");
+
+	lua_pushboolean(L, !!(flags & flag));
+
+	return 1;
+} /* fdobj_xflag() */
+
+static int fdobj_nonblock(lua_State *L) {
+	return fdobj_xflag(L, O_NONBLOCK, "nonblock");
+} /* fdobj_nonblock() */
+
+static int fdobj_cloexec(lua_State *L) {
+	return fdobj_xflag(L, U_CLOEXEC, "cloexec");
+} /* fdobj_cloexec() */
+
+static int fdobj_type(lua_State *L) {
+	struct fdobj *fo = fdobj_checkself(L, 1);
+	mode_t type = 0;
+	int error;
+
+	if ((error = fdobj_gettype(fo, &type)))
+		return unixL_pusherror(L, error, "type", "~$#");
+
+	lua_pushinteger(L, type);
+
+	return 1;
+} /* fdobj_type() */
+
+static int fdobj_close(lua_State *L) {
+	struct fdobj *fo = luaL_checkudata(L, 1, "struct fd");
+	int error = 0;
+
+	/* AT_FDCWD, as from dirat, isn't a descriptor */
+	if (fo->fd >= 0)
+		error = u_close_nocancel(fo->fd);
+
+	fo->fd = -1;
+
+	if (error)
+		return unixL_pusherror(L, error, "close", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* fdobj_close() */
+
+static int fdobj__gc(lua_State *L) {
+	struct fdobj *fo = luaL_checkudata(L, 1, "struct fd");
+
+	if (fo->fd >= 0)
+		u_close(&fo->fd);
+
+	return 0;
+} /* fdobj__gc() */
+
+static int fdobj__tostring(lua_State *L) {
+	struct fdobj *fo = luaL_checkudata(L, 1, "struct fd");
+
+	if (fo->fd == -1)
+		lua_pushstring(L, "fd (closed)");
+	else
+		lua_pushfstring(L, "fd (%d)", fo->fd);
+
+	return 1;
+} /* fdobj__tostring() */
+
+static const luaL_Reg fdobj_methods[] = {
+	{ "fileno",   &fdobj_fileno },
+	{ "release",  &fdobj_release },
+	{ "flags",    &fdobj_flags },
+	{ "nonblock", &fdobj_nonblock },
+	{ "cloexec",  &fdobj_cloexec },
+	{ "type",     &fdobj_type },
+	{ "close",    &fdobj_close },
+	{ NULL,       NULL },
+}; /* fdobj_methods[] */
+
+static const luaL_Reg fdobj_metamethods[] = {
+	{ "__gc",       &fdobj__gc },
+	{ "__close",    &fdobj__gc },
+	{ "__tostring", &fdobj__tostring },
+	{ NULL,         NULL },
+}; /* fdobj_metamethods[] */
+
+/*
+ * fd(fd)
+ *
+ * Take ownership of an integer descriptor. FILE, DIR, and fd handles
+ * keep theirs, so they are duplicated instead.
+ */
+static int unix_fd(lua_State *L) {
+	struct fdobj *fo;
+	int error;
+
+	lua_settop(L, 1);
+
+	fo = fdobj_push(L);
+
+	if (lua_type(L, 1) == LUA_TNUMBER) {
+		fo->fd = unixL_checkfileno(L, 1);
+	} else if ((error = u_dup(&fo->fd, unixL_checkfileno(L, 1), U_CLOEXEC))) {
+		return unixL_pusherror(L, error, "fd", "~$#");
+	}
+
+	return 1;
+} /* unix_fd() */
+
+
+static int unix_feof(lua_State *L) {
+	lua_pushboolean(L, feof(unixL_checkfile(L, 1)));
+	return 1;
+} /* unix_feof() */
+
+
+static int unix_ferror(lua_State *L) {
+	lua_pushboolean(L, ferror(unixL_checkfile(L, 1)));
+	return 1;
+} /* unix_ferror() */
+
+
+static int unix_fgetc(lua_State *L) {
+	FILE *fp = unixL_checkfile(L, 1);
+	int c;
+
+	if (EOF == (c = fgetc(fp))) {
+		if (ferror(fp))
+			return unixL_pusherror(L, errno, "fgetc", "~$#");
+
+		return 0;
+	}
+
+	lua_pushinteger(L, c);
+
+	return 1;
+} /* unix_fgetc() */
+
+
+static int unix_fileno(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+
+	lua_pushinteger(L, fd);
+
+	return 1;
+} /* unix_fileno() */
+
+
+static int unix_flockfile(lua_State *L) {
+	flockfile(unixL_checkfile(L, 1));
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_flockfile() */
+
+
+#if HAVE_FMEMOPEN
+static int unsafe_fmemopen(lua_State *L) {
+	void *addr = unixL_checklightuserdata(L, 1);
+	size_t size = unixL_checksize(L, 2);
+	const char *mode = luaL_checkstring(L, 3);
+	luaL_Stream *fh;
+
+	fh = unixL_prepfile(L);
+	if (!(fh->f = fmemopen(addr, size, mode)))
+		return unixL_pusherror(L, errno, "fmemopen", "~$#");
+
+	return 1;
+} /* unsafe_fmemopen() */
+#endif
+
+
+#if HAVE_FMEMOPEN
+static int unix_fmemopen(lua_State *L) {
+	size_t size;
+	const char *data = luaL_checklstring(L, 1, &size);
+	luaL_Stream *fh;
+
+	lua_settop(L, 1);
+
+	fh = unixL_prepfile(L);
+
+	/* the string is never written, as the stream is read-only */
+	if (!(fh->f = fmemopen((void *)data, size, "r"))) {
+		/* some implementations reject a zero-length buffer */
+		if (size > 0 || !(fh->f = fopen("/dev/null", "r")))
+			return unixL_pusherror(L, errno, "fmemopen", "~$#");
+	}
+
+	/* the stream reads the string in place, so pin it */
+	lua_pushvalue(L, 1);
+	unixL_anchor(L, -2, "data");
+
+	return 1;
+} /* unix_fmemopen() */
 #endif
-	case F_DUPFD:
-		if (-1 == (dupfd = fcntl(fd, cmd, unixL_checkfileno(L, 3))))
-			goto syerr;
 
-		unixL_pushinteger(L, dupfd);
 
-		return 1;
-	case F_GETFD:
-		if ((flags = fcntl(fd, cmd)) < 0)
-			goto syerr;
+#if HAVE_FOPENCOOKIE || HAVE_FUNOPEN
+/*
+ * Growable write stream, like open_memstream(3). The buffer is shared
+ * between the stream and a userdata anchored to the handle, and freed
+ * when both are done with it. That way the contents remain available
+ * after the stream is closed, and neither finalizer needs to run first.
+ */
+struct memstream {
+	char *buf;
+	size_t bufsiz, size, pos;
+	int refs;
+}; /* struct memstream */
+
+#if HAVE_FOPENCOOKIE && __GLIBC__
+typedef off64_t ms_off_t;
+#else
+typedef off_t ms_off_t;
+#endif
+
+static void ms_release(struct memstream *ms) {
+	if (--ms->refs > 0)
+		return;
+
+	free(ms->buf);
+	free(ms);
+} /* ms_release() */
+
+static ssize_t ms_read(void *arg, char *dst, size_t lim) {
+	struct memstream *ms = arg;
+	size_t n = (ms->pos < ms->size)? MIN(lim, ms->size - ms->pos) : 0;
+
+	memcpy(dst, &ms->buf[ms->pos], n);
+	ms->pos += n;
+
+	return n;
+} /* ms_read() */
+
+static ssize_t ms_write(void *arg, const char *src, size_t len) {
+	struct memstream *ms = arg;
+	size_t end;
+	int error;
+
+	if (len > SIZE_MAX - ms->pos) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+
+	end = ms->pos + len;
+
+	if (end > ms->bufsiz) {
+		size_t bufsiz = MAX(ms->bufsiz, 256);
+
+		while (bufsiz < end)
+			bufsiz = (bufsiz > SIZE_MAX / 2)? end : bufsiz * 2;
+
+		if ((error = u_realloc(&ms->buf, &ms->bufsiz, bufsiz))) {
+			errno = error;
+			return -1;
+		}
+	}
+
+	/* seeking past the end leaves a hole of zeros */
+	if (ms->pos > ms->size)
+		memset(&ms->buf[ms->size], 0, ms->pos - ms->size);
+
+	memcpy(&ms->buf[ms->pos], src, len);
+	ms->pos = end;
+	ms->size = MAX(ms->size, end);
+
+	return len;
+} /* ms_write() */
+
+static int ms_seek(void *arg, ms_off_t *off, int whence) {
+	struct memstream *ms = arg;
+	ms_off_t base;
+
+	switch (whence) {
+	case SEEK_SET:
+		base = 0;
+		break;
+	case SEEK_CUR:
+		base = ms->pos;
+		break;
+	case SEEK_END:
+		base = ms->size;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (*off < -base) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ms->pos = base + *off;
+	*off = ms->pos;
+
+	return 0;
+} /* ms_seek() */
+
+static int ms_close(void *arg) {
+	ms_release(arg);
+
+	return 0;
+} /* ms_close() */
+
+#if HAVE_FUNOPEN
+static int ms_readfn(void *arg, char *dst, int lim) {
+	return ms_read(arg, dst, lim);
+} /* ms_readfn() */
+
+static int ms_writefn(void *arg, const char *src, int len) {
+	return ms_write(arg, src, len);
+} /* ms_writefn() */
+
+static fpos_t ms_seekfn(void *arg, fpos_t off, int whence) {
+	ms_off_t pos = off;
+
+	if (0 != ms_seek(arg, &pos, whence))
+		return -1;
+
+	return pos;
+} /* ms_seekfn() */
+#endif
+
+static int ms__gc(lua_State *L) {
+	struct memstream **ms = lua_touserdata(L, 1);
+
+	if (*ms) {
+		ms_release(*ms);
+		*ms = NULL;
+	}
+
+	return 0;
+} /* ms__gc() */
+
+static struct memstream *ms_checkfile(lua_State *L, int index) {
+	struct memstream **ms;
+
+	luaL_checkudata(L, index, LUA_FILEHANDLE);
+
+	if (unixL_getanchor(L, index, "memstream") != LUA_TUSERDATA)
+		luaL_argerror(L, index, "not a memory stream");
 
-		unixL_pushinteger(L, flags);
+	ms = luaL_checkudata(L, -1, "struct memstream");
+	lua_pop(L, 1);
 
-		return 1;
-	case F_GETFL:
-		if ((error = u_getflags(fd, &flags)))
-			goto error;
+	return *ms;
+} /* ms_checkfile() */
 
-		unixL_pushinteger(L, flags);
+static int unix_open_memstream(lua_State *L) {
+	const char *mode = luaL_optstring(L, 1, "w");
+	struct memstream **ms;
+	luaL_Stream *fh;
+	int error;
 
-		return 1;
-	case F_SETFD:
-		if (-1 == fcntl(fd, cmd, (int)luaL_checkint(L, 3)))
-			goto syerr;
+	lua_settop(L, 1);
 
-		lua_pushboolean(L, 1);
+	luaL_argcheck(L, *mode == 'w' || *mode == 'a', 1, "expected write or append mode");
 
-		return 1;
-	case F_SETFL:
-		flags = luaL_checknumber(L, 3);
+	ms = lua_newuserdata(L, sizeof *ms);
+	*ms = NULL;
+	luaL_setmetatable(L, "struct memstream");
 
-		if (-1 == fcntl(fd, cmd, (int)(U_SYSFLAGS & flags)))
-			goto syerr;
+	fh = unixL_prepfile(L);
 
-		if (flags & U_CLOEXEC) {
-			if (-1 == fcntl(fd, F_SETFD, FD_CLOEXEC))
-				goto syerr;
-		}
+	if (!(*ms = calloc(1, sizeof **ms)))
+		goto syerr;
+	(*ms)->refs = 1;
 
-		lua_pushboolean(L, 1);
+	{
+#if HAVE_FOPENCOOKIE
+		cookie_io_functions_t io = { &ms_read, &ms_write, &ms_seek, &ms_close };
 
-		return 1;
-	case F_GETOWN:
-		if (-1 == (pid = fcntl(fd, cmd)))
+		if (!(fh->f = fopencookie(*ms, mode, io)))
+			goto syerr;
+#else
+		if (!(fh->f = funopen(*ms, &ms_readfn, &ms_writefn, &ms_seekfn, &ms_close)))
 			goto syerr;
+#endif
+	}
 
-		lua_pushinteger(L, pid);
+	/* the stream now holds its own reference */
+	(*ms)->refs++;
 
-		return 1;
-	case F_SETOWN:
-		pid = luaL_checkint(L, 3);
+	lua_pushvalue(L, -2);
+	unixL_anchor(L, -2, "memstream");
 
-		if (-1 == fcntl(fd, cmd, pid))
-			goto syerr;
+	return 1;
+syerr:
+	error = errno;
 
-		lua_pushboolean(L, 1);
+	return unixL_pusherror(L, error, "open_memstream", "~$#");
+} /* unix_open_memstream() */
 
-		return 1;
-	case F_GETLK:
-	case F_SETLK:
-	case F_SETLKW:
-		return fcntl_flock(L, fd, cmd, 3);
-#if defined F_CLOSEM
-	case F_CLOSEM:
-		if (-1 == fcntl(fd, cmd))
-			goto syerr;
+/*
+ * Flush the stream if still open and return its contents so far.
+ */
+static int unix_getmemstream(lua_State *L) {
+	struct memstream *ms = ms_checkfile(L, 1);
+	luaL_Stream *fh = lua_touserdata(L, 1);
 
-		lua_pushboolean(L, 1);
+	if (fh->f && 0 != fflush(fh->f))
+		return unixL_pusherror(L, errno, "getmemstream", "~$#");
 
-		return 1;
-#endif
-#if defined F_MAXFD
-	case F_MAXFD: {
-		int maxfd;
+	lua_pushlstring(L, (ms->buf)? ms->buf : "", ms->size);
 
-		if (-1 == (maxfd = fcntl(fd, cmd)))
-			goto syerr;
+	return 1;
+} /* unix_getmemstream() */
 
-		lua_pushinteger(L, maxfd);
+static const luaL_Reg ms_metamethods[] = {
+	{ "__gc", &ms__gc },
+	{ NULL,   NULL }
+}; /* ms_metamethods[] */
 
-		return 1;
-	}
+static const luaL_Reg ms_methods[] = {
+	{ NULL, NULL }
+}; /* ms_methods[] */
 #endif
-#if defined F_GETPATH
-	case F_GETPATH: {
-		unixL_State *U = unixL_getstate(L);
 
-		if (U->bufsiz < MAXPATHLEN + 1) {
-			if ((error = u_realloc(&U->buf, &U->bufsiz, MAXPATHLEN + 1)))
-				goto error;
-		}
 
-		if (-1 == fcntl(fd, cmd, U->buf))
-			goto syerr;
+/*
+ * Compiled fnmatch pattern. The pattern is split into literal chunks at
+ * each metacharacter. Patterns made only of literals and stars are
+ * matched directly with memcmp and a leftmost chunk search; anything
+ * else goes to fnmatch(3), but only after checking the literal prefix
+ * and suffix, which rejects most subjects cheaply.
+ */
+enum fnm_kind {
+	FNM_K_LITERAL, /* no metacharacters */
+	FNM_K_STARS,   /* literal chunks separated by stars */
+	FNM_K_GENERIC, /* fnmatch(3) with prefix/suffix prefilter */
+}; /* enum fnm_kind */
 
-		lua_pushstring(L, U->buf);
+struct fnm_chunk {
+	size_t off, len;
+}; /* struct fnm_chunk */
 
-		return 1;
-	}
-#endif
-	default:
-		/*
-		 * NOTE: We don't allow unsupported operations because we
-		 * cannot know the argument type that fcntl expects. If it's
-		 * a pointer then this interface becomes a vector for
-		 * reading or writing random process memory.
-		 */
-		return luaL_error(L, "%d: unsupported fcntl operation", cmd);
-	} /* switch () */
-syerr:
-	error = errno;
-error:
-	return unixL_pusherror(L, error, "fcntl", "~$#");
-} /* unix_fcntl() */
+struct u_fnmatch {
+	int flags;
+	enum fnm_kind kind;
+	_Bool prefilter; /* chunk[0] and chunk[nchunk - 1] must match literally */
 
+	struct fnm_chunk *chunk;
+	size_t nchunk;
 
-static int unsafe_fcntl(lua_State *L) {
-	int fd = unixL_checkfileno(L, 1);
-	int cmd = luaL_checkint(L, 2);
-	int n, r, error;
+	char *lit; /* unescaped literal bytes */
+	char *pattern;
+}; /* struct u_fnmatch */
 
-	n = lua_gettop(L);
-	luaL_argcheck(L, n <= 3, 4, lua_pushfstring(L, "expected 3 arguments, got %d", n));
+/* length of bracket expression at p, or 0 if unterminated */
+static size_t fnm_bracket(const char *p, int flags) {
+	const char *q = p + 1;
 
-	switch (lua_type(L, 3)) {
-	case LUA_TNONE: {
-		if (-1 == (r = fcntl(fd, cmd, (intptr_t)0)))
-			goto syerr;
+	if (*q == '!' || *q == '^')
+		q++;
+	if (*q == ']')
+		q++;
 
-		lua_pushinteger(L, r);
-		return 1;
-	}
-	case LUA_TNUMBER: {
-		intptr_t arg = unixL_checkinteger(L, 3, INTPTR_MIN, INTPTR_MAX);
+	while (*q && *q != ']') {
+		if (*q == '[' && (q[1] == ':' || q[1] == '=' || q[1] == '.')) {
+			const char *end = q + 2;
+			int term = q[1];
 
-		if (-1 == (r = fcntl(fd, cmd, arg)))
-			goto syerr;
+			while (*end && !(end[0] == term && end[1] == ']'))
+				end++;
 
-		lua_pushinteger(L, r);
-		return 1;
+			q = (*end)? end + 2 : q + 1;
+		} else if (*q == '\\' && !(flags & FNM_NOESCAPE) && q[1]) {
+			q += 2;
+		} else {
+			q++;
+		}
 	}
-	case LUA_TSTRING: {
-		const struct iovec iov = unixL_checkstring(L, 3, 0, SIZE_MAX);
-		unixL_State *U = unixL_getstate(L);
-
-		if (U->bufsiz < iov.iov_len && (error = u_realloc(&U->buf, &U->bufsiz, iov.iov_len)))
-			goto error;
-		memcpy(U->buf, iov.iov_base, iov.iov_len);
 
-		if (-1 == (r = fcntl(fd, cmd, U->buf)))
-			goto syerr;
+	return (*q)? (size_t)(q + 1 - p) : 0;
+} /* fnm_bracket() */
 
-		lua_pushinteger(L, r);
-		lua_pushlstring(L, U->buf, iov.iov_len);
-		return 2;
-	}
-	}
+static void fnm_compile(struct u_fnmatch *fnm, const char *p) {
+	size_t nstar = 0, n = 0, bracket;
+	_Bool generic = 0;
 
-	return luaL_argerror(L, 3, lua_pushfstring(L, "expected integer or string, got %s", luaL_typename(L, 3)));
-syerr:
-	error = errno;
-error:
-	return unixL_pusherror(L, error, "fcntl", "~$#");
-} /* unsafe_fcntl() */
+	fnm->chunk[0].off = 0;
+	fnm->chunk[0].len = 0;
+	fnm->nchunk = 1;
 
+	while (*p) {
+		if (*p == '\\' && !(fnm->flags & FNM_NOESCAPE)) {
+			if (!p[1]) {
+				/* trailing backslash; let fnmatch decide */
+				generic = 1;
+				break;
+			}
 
-#if HAVE_FDATASYNC
-static int unix_fdatasync(lua_State *L) {
-	int fd = unixL_checkfileno(L, 1);
+			fnm->lit[n++] = p[1];
+			p += 2;
+		} else if (*p == '*' || *p == '?' || (*p == '[' && (bracket = fnm_bracket(p, fnm->flags)))) {
+			if (*p == '*') {
+				nstar++;
+				p++;
+			} else {
+				generic = 1;
+				p += (*p == '?')? 1 : bracket;
+			}
 
-	if (0 != fdatasync(fd))
-		return unixL_pusherror(L, errno, "fdatasync", "0$#");
+			fnm->chunk[fnm->nchunk - 1].len = n - fnm->chunk[fnm->nchunk - 1].off;
+			fnm->chunk[fnm->nchunk].off = n;
+			fnm->nchunk++;
+		} else {
+			fnm->lit[n++] = *p++;
+		}
+	}
 
-	lua_pushboolean(L, 1);
+	fnm->chunk[fnm->nchunk - 1].len = n - fnm->chunk[fnm->nchunk - 1].off;
 
-	return 1;
-} /* unix_fdatasync() */
-#endif
+	/* only these flags leave literal characters matching themselves */
+	fnm->prefilter = !(fnm->flags & ~(FNM_PERIOD|FNM_NOESCAPE|FNM_PATHNAME));
 
+	if (!fnm->prefilter || generic || (fnm->flags & FNM_PATHNAME)) {
+		fnm->kind = FNM_K_GENERIC;
+	} else if (nstar == 0) {
+		fnm->kind = FNM_K_LITERAL;
+	} else {
+		fnm->kind = FNM_K_STARS;
+	}
+} /* fnm_compile() */
 
-static int unix_fdopen(lua_State *L) {
-	u_flags_t flags;
-	const char *mode;
-	int fd, error;
-	luaL_Stream *fh;
+static const char *fnm_memmem(const char *s, size_t slen, const char *p, size_t plen) {
+	const char *end;
 
-	lua_settop(L, 2);
-	luaL_argcheck(L, lua_type(L, 1) != LUA_TUSERDATA, 1, "cannot steal descriptor from existing handle");
-	fd = unixL_checkfileno(L, 1);
-	unixL_checkflags(L, 2, &mode, &flags, NULL);
+	if (plen == 0)
+		return s;
+	if (plen > slen)
+		return NULL;
 
-	fh = unixL_prepfile(L);
+	for (end = s + (slen - plen) + 1; (s = memchr(s, *p, end - s)); s++) {
+		if (!memcmp(s, p, plen))
+			return s;
+	}
 
-	if ((error = u_fdopen(&fh->f, &fd, mode, flags)))
-		return unixL_pusherror(L, error, "fdopen", "~$#");
+	return NULL;
+} /* fnm_memmem() */
 
-	return 1;
-} /* unix_fdopen() */
+static _Bool fnm_match(const struct u_fnmatch *fnm, const char *s, size_t len) {
+	const struct fnm_chunk *first = &fnm->chunk[0], *last = &fnm->chunk[fnm->nchunk - 1];
+	size_t lo, hi, i;
+	const char *pos;
 
+	if (fnm->kind == FNM_K_LITERAL)
+		return len == first->len && !memcmp(s, fnm->lit, len);
 
-#if HAVE_FDOPENDIR
-static int unix_fdopendir(lua_State *L) {
-	DIR **dp;
-	int fd, error;
+	if (fnm->prefilter && fnm->nchunk > 1) {
+		if (len < first->len + last->len)
+			return 0;
+		if (memcmp(s, &fnm->lit[first->off], first->len))
+			return 0;
+		if (memcmp(&s[len - last->len], &fnm->lit[last->off], last->len))
+			return 0;
+	}
 
-	lua_settop(L, 1);
-	luaL_argcheck(L, lua_type(L, 1) != LUA_TUSERDATA, 1, "cannot steal descriptor from existing handle");
-	fd = unixL_checkfileno(L, 1);
+	if (fnm->kind == FNM_K_GENERIC)
+		return 0 == fnmatch(fnm->pattern, s, fnm->flags);
 
-	dp = lua_newuserdata(L, sizeof *dp);
-	*dp = NULL;
-	luaL_setmetatable(L, "DIR*");
+	/* a leading period can't be matched by a star */
+	if ((fnm->flags & FNM_PERIOD) && len > 0 && *s == '.' && first->len == 0)
+		return 0;
 
-	if ((error = u_fdopendir(dp, &fd, 0)))
-		return unixL_pusherror(L, error, "fdopendir", "~$#");
+	lo = first->len;
+	hi = len - last->len;
 
-	return 1;
-} /* unix_fdopendir() */
-#endif /* HAVE_FDOPENDIR */
+	for (i = 1; i < fnm->nchunk - 1; i++) {
+		const struct fnm_chunk *chunk = &fnm->chunk[i];
 
+		if (!(pos = fnm_memmem(&s[lo], hi - lo, &fnm->lit[chunk->off], chunk->len)))
+			return 0;
 
-static int unix_fdup(lua_State *L) {
-	int fd = -1, ofd, error;
-	u_flags_t flags;
-	const char *mode;
-	luaL_Stream *fh;
+		lo = (pos - s) + chunk->len;
+	}
 
-	lua_settop(L, 2);
-	ofd = unixL_checkfileno(L, 1);
-	unixL_checkflags(L, 2, &mode, &flags, NULL);
+	return 1;
+} /* fnm_match() */
 
-	fh = unixL_prepfile(L);
+static struct u_fnmatch *fnm_checkself(lua_State *L, int index) {
+	return luaL_checkudata(L, index, "fnmatch_t");
+} /* fnm_checkself() */
 
-	if ((error = u_dup(&fd, ofd, flags)))
-		goto error;
+static int fnm_match_(lua_State *L) {
+	struct u_fnmatch *fnm = fnm_checkself(L, 1);
+	size_t len;
+	const char *s = luaL_checklstring(L, 2, &len);
 
-	if ((error = u_fdopen(&fh->f, &fd, mode, flags)))
-		goto error;
+	lua_pushboolean(L, fnm_match(fnm, s, len));
 
 	return 1;
-error:
-	u_close(&fd);
+} /* fnm_match_() */
 
-	return unixL_pusherror(L, error, "fopen", "~$#");
-} /* unix_fdup() */
+/* test(subjects): boolean for each subject */
+static int fnm_test(lua_State *L) {
+	struct u_fnmatch *fnm = fnm_checkself(L, 1);
+	const char *s;
+	size_t len;
+	int i, n;
 
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = lua_rawlen(L, 2);
+	lua_createtable(L, n, 0);
 
-static int unix_feof(lua_State *L) {
-	lua_pushboolean(L, feof(unixL_checkfile(L, 1)));
-	return 1;
-} /* unix_feof() */
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 2, i);
+		s = lua_tolstring(L, -1, &len);
+		lua_pop(L, 1);
 
+		lua_pushboolean(L, s && fnm_match(fnm, s, len));
+		lua_rawseti(L, -2, i);
+	}
 
-static int unix_ferror(lua_State *L) {
-	lua_pushboolean(L, ferror(unixL_checkfile(L, 1)));
 	return 1;
-} /* unix_ferror() */
+} /* fnm_test() */
 
+/* filter(subjects): indexes of matching subjects */
+static int fnm_filter(lua_State *L) {
+	struct u_fnmatch *fnm = fnm_checkself(L, 1);
+	const char *s;
+	size_t len;
+	int i, j, n;
 
-static int unix_fgetc(lua_State *L) {
-	FILE *fp = unixL_checkfile(L, 1);
-	int c;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = lua_rawlen(L, 2);
+	lua_newtable(L);
 
-	if (EOF == (c = fgetc(fp))) {
-		if (ferror(fp))
-			return unixL_pusherror(L, errno, "fgetc", "~$#");
+	for (i = 1, j = 0; i <= n; i++) {
+		lua_rawgeti(L, 2, i);
+		s = lua_tolstring(L, -1, &len);
+		lua_pop(L, 1);
 
-		return 0;
+		if (s && fnm_match(fnm, s, len)) {
+			lua_pushinteger(L, i);
+			lua_rawseti(L, -2, ++j);
+		}
 	}
 
-	lua_pushinteger(L, c);
+	return 1;
+} /* fnm_filter() */
+
+static int fnm__tostring(lua_State *L) {
+	lua_pushstring(L, fnm_checkself(L, 1)->pattern);
 
 	return 1;
-} /* unix_fgetc() */
+} /* fnm__tostring() */
 
+static const luaL_Reg fnm_methods[] = {
+	{ "match",  &fnm_match_ },
+	{ "test",   &fnm_test },
+	{ "filter", &fnm_filter },
+	{ NULL,     NULL }
+}; /* fnm_methods[] */
 
-static int unix_fileno(lua_State *L) {
-	int fd = unixL_checkfileno(L, 1);
+static const luaL_Reg fnm_metamethods[] = {
+	{ "__tostring", &fnm__tostring },
+	{ NULL,         NULL }
+}; /* fnm_metamethods[] */
+
+
+static int unix_fnmatchcomp(lua_State *L) {
+	size_t len;
+	const char *patt = luaL_checklstring(L, 1, &len);
+	int flags = unixL_optint(L, 2, 0);
+	struct u_fnmatch *fnm;
+	size_t nchunk = len + 2, size;
 
-	lua_pushinteger(L, fd);
+	if (len > (SIZE_MAX - sizeof *fnm) / (sizeof *fnm->chunk + 4))
+		return luaL_error(L, "fnmatchcomp: pattern too long");
 
-	return 1;
-} /* unix_fileno() */
+	size = sizeof *fnm + (nchunk * sizeof *fnm->chunk) + (2 * (len + 1));
+	fnm = lua_newuserdata(L, size);
+	memset(fnm, 0, sizeof *fnm);
 
+	fnm->flags = flags;
+	fnm->chunk = (struct fnm_chunk *)&fnm[1];
+	fnm->lit = (char *)&fnm->chunk[nchunk];
+	fnm->pattern = &fnm->lit[len + 1];
+	memcpy(fnm->pattern, patt, len + 1);
 
-static int unix_flockfile(lua_State *L) {
-	flockfile(unixL_checkfile(L, 1));
+	fnm_compile(fnm, fnm->pattern);
 
-	lua_pushboolean(L, 1);
+	luaL_setmetatable(L, "fnmatch_t");
 
 	return 1;
-} /* unix_flockfile() */
+} /* unix_fnmatchcomp() */
 
 
-#if HAVE_FMEMOPEN
-static int unsafe_fmemopen(lua_State *L) {
-	void *addr = unixL_checklightuserdata(L, 1);
-	size_t size = unixL_checksize(L, 2);
-	const char *mode = luaL_checkstring(L, 3);
-	luaL_Stream *fh;
+static int unix_fnmatch(lua_State *L) {
+	struct u_fnmatch *fnm;
+	const char *patt, *subject;
+	size_t len;
+	int flags;
 
-	fh = unixL_prepfile(L);
-	if (!(fh->f = fmemopen(addr, size, mode)))
-		return unixL_pusherror(L, errno, "fmemopen", "~$#");
+	if ((fnm = luaL_testudata(L, 1, "fnmatch_t"))) {
+		subject = luaL_checklstring(L, 2, &len);
 
-	return 1;
-} /* unsafe_fmemopen() */
-#endif
+		lua_pushboolean(L, 1);
+		lua_pushboolean(L, fnm_match(fnm, subject, len));
 
+		return 2;
+	}
 
-static int unix_fnmatch(lua_State *L) {
-	const char *patt = luaL_checkstring(L, 1);
-	const char *subject = luaL_checkstring(L, 2);
-	int flags = luaL_optint(L, 3, 0);
+	patt = luaL_checkstring(L, 1);
+	subject = luaL_checkstring(L, 2);
+	flags = luaL_optint(L, 3, 0);
 
 	switch (fnmatch(patt, subject, flags)) {
 	case 0:
@@ -6475,11 +9243,15 @@ static int unix_fopenat(lua_State *L) {
 	u_flags_t flags;
 	mode_t perm;
 	luaL_Stream *fh;
+	int vmode;
+	size_t vsize;
+	_Bool vbuf;
 
-	lua_settop(L, 4);
+	lua_settop(L, 6);
 	at = unixL_checkatfileno(L, 1);
 	path = luaL_checkstring(L, 2);
 	unixL_checkflags(L, 3, &mode, &flags, &perm);
+	vbuf = unixL_optvbuf(L, 5, &vmode, &vsize);
 
 	fh = unixL_prepfile(L);
 	if (-1 == (fd = openat(at, path, flags, perm)))
@@ -6489,9 +9261,13 @@ static int unix_fopenat(lua_State *L) {
 		goto syerr;
 	fd = -1;
 
+	if (vbuf && (error = unixL_setvbuf(L, -1, vmode, vsize)))
+		goto error;
+
 	return 1;
 syerr:
 	error = errno;
+error:
 	u_close(&fd);
 
 	return unixL_pusherror(L, error, "fopenat", "~$#");
@@ -6504,9 +9280,14 @@ static int unix_fpipe(lua_State *L) {
 	luaL_Stream *fh[2] = { NULL, NULL };
 	u_flags_t flags;
 	const char *mode;
+	int vmode;
+	size_t vsize, size;
+	_Bool vbuf;
 
-	lua_settop(L, 1);
+	lua_settop(L, 4);
 	unixL_checkflags(L, 1, &mode, &flags, NULL);
+	vbuf = unixL_optvbuf(L, 2, &vmode, &vsize);
+	size = unixL_optsize(L, 4, 0);
 
 	mode = NULL;
 	flags &= ~(O_ACCMODE|O_APPEND);
@@ -6517,11 +9298,19 @@ static int unix_fpipe(lua_State *L) {
 	if ((error = u_pipe(fd, flags)))
 		goto error;
 
+	if (size > 0 && (error = u_setpipesz(fd[1], size)))
+		goto error;
+
 	if ((error = u_fdopen(&fh[0]->f, &fd[0], mode, flags|O_RDONLY)))
 		goto error;
 	if ((error = u_fdopen(&fh[1]->f, &fd[1], mode, flags|O_WRONLY)))
 		goto error;
 
+	if (vbuf && (error = unixL_setvbuf(L, -2, vmode, vsize)))
+		goto error;
+	if (vbuf && (error = unixL_setvbuf(L, -1, vmode, vsize)))
+		goto error;
+
 	return 2;
 error:
 	u_close(&fd[0]);
@@ -7639,61 +10428,490 @@ static int unix_gettimeofday(lua_State *L) {
 	if (lua_isnoneornil(L, 1) || !lua_toboolean(L, 1)) {
 		lua_pushnumber(L, u_tv2f(&tv));
 
-		return 1;
-	} else {
-		lua_pushinteger(L, tv.tv_sec);
-		lua_pushinteger(L, tv.tv_usec);
+		return 1;
+	} else {
+		lua_pushinteger(L, tv.tv_sec);
+		lua_pushinteger(L, tv.tv_usec);
+
+		return 2;
+	}
+} /* unix_gettimeofday() */
+
+
+static int unix_getsockname(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+	int error;
+
+	if ((error = unixL_getsockname(L, fd, &getsockname)))
+		return unixL_pusherror(L, error, "getsockname", "~$#");
+
+	return 1;
+} /* unix_getsockname() */
+
+
+static int unsafe_getsockopt(lua_State *L) {
+	unixL_State *U = unixL_getstate(L);
+	int fd = unixL_checkfileno(L, 1);
+	int level = unixL_checkint(L, 2);
+	int type = unixL_checkint(L, 3);
+	const struct iovec iov = unixL_checkstring(L, 4, 0, INT_MAX); /* length must fit socklen_t */
+	socklen_t bufsiz;
+	int n, error;
+
+	n = lua_gettop(L);
+	luaL_argcheck(L, n <= 4, 5, lua_pushfstring(L, "expected 4 arguments, got %d", n));
+
+	if (U->bufsiz < iov.iov_len && (error = u_realloc(&U->buf, &U->bufsiz, iov.iov_len)))
+		goto error;
+	memcpy(U->buf, iov.iov_base, iov.iov_len);
+	bufsiz = iov.iov_len;
+
+	if (0 != getsockopt(fd, level, type, U->buf, &bufsiz))
+		goto syerr;
+
+	lua_pushlstring(L, U->buf, bufsiz);
+	return 1;
+syerr:
+	error = errno;
+error:
+	return unixL_pusherror(L, error, "getsockopt", "~$#");
+} /* unsafe_getsockopt() */
+
+
+static int unix_getuid(lua_State *L) {
+	lua_pushinteger(L, getuid());
+
+	return 1;
+} /* unix_getuid() */
+
+
+/*
+ * Our own glob rather than glob(3) so we can match segment-wise relative
+ * to directory descriptors, skip reading directories for literal
+ * segments, and offer GLOB_ONLYDIR and GLOB_BRACE portably. Flag values
+ * are private to this module.
+ */
+#define U_GLOB_ERR      0x01 /* stop on unreadable directories */
+#define U_GLOB_MARK     0x02 /* append / to directories */
+#define U_GLOB_NOCHECK  0x04 /* return pattern if nothing matches */
+#define U_GLOB_NOESCAPE 0x08 /* backslash isn't special */
+#define U_GLOB_NOSORT   0x10
+#define U_GLOB_BRACE    0x20 /* expand {a,b} alternatives */
+#define U_GLOB_ONLYDIR  0x40 /* only match directories */
+#define U_GLOB_PERIOD   0x80 /* wildcards may match leading period */
+
+#define GLOB_OFLAGS (O_RDONLY|O_DIRECTORY|U_CLOEXEC)
+
+struct glob_seg {
+	char *name;
+	_Bool literal; /* no wildcards; escapes already removed */
+}; /* struct glob_seg */
+
+U_REALLOCARRAY_GENERATE(struct glob_seg *, u_reallocarray_glob_seg)
+
+struct glob {
+	int flags;
+
+	char **path; /* results */
+	size_t npath, pathsiz;
+
+	char *buf; /* path of current directory */
+	size_t bufsiz;
+
+	struct glob_seg *seg; /* segments of current pattern */
+	size_t nseg, segsiz;
+	_Bool slash; /* pattern had trailing slash */
+}; /* struct glob */
+
+static _Bool glob_isliteral(const struct glob *g, const char *seg) {
+	for (; *seg; seg++) {
+		switch (*seg) {
+		case '\\':
+			if (!(g->flags & U_GLOB_NOESCAPE) && seg[1])
+				seg++;
+			break;
+		case '*': case '?': case '[':
+			return 0;
+		}
+	}
+
+	return 1;
+} /* glob_isliteral() */
+
+/* strip escapes in place from a literal segment */
+static void glob_unescape(const struct glob *g, char *seg) {
+	char *dst = seg;
+
+	if (g->flags & U_GLOB_NOESCAPE)
+		return;
+
+	for (; *seg; seg++) {
+		if (*seg == '\\' && seg[1])
+			seg++;
+		*dst++ = *seg;
+	}
+
+	*dst = '\0';
+} /* glob_unescape() */
+
+/* append name to directory path at len, returning new length */
+static u_error_t glob_setpath(struct glob *g, size_t len, const char *name, size_t *_len) {
+	size_t namelen = strlen(name);
+	size_t n = len;
+	int error;
+
+	if (g->bufsiz < len + namelen + 3 && (error = u_realloc(&g->buf, &g->bufsiz, len + namelen + 3)))
+		return error;
+
+	if (n > 0 && g->buf[n - 1] != '/')
+		g->buf[n++] = '/';
+
+	memcpy(&g->buf[n], name, namelen + 1);
+	*_len = n + namelen;
+
+	return 0;
+} /* glob_setpath() */
+
+static u_error_t glob_addpath(struct glob *g, const char *path, size_t len, _Bool mark) {
+	char *copy;
+	int error;
+
+	if ((error = u_reallocarray_char_pp(&g->path, &g->pathsiz, g->npath + 1)))
+		return error;
+
+	if (!(copy = malloc(len + 2)))
+		return errno;
+
+	memcpy(copy, path, len);
+
+	if (mark && (len == 0 || path[len - 1] != '/'))
+		copy[len++] = '/';
+
+	copy[len] = '\0';
+	g->path[g->npath++] = copy;
+
+	return 0;
+} /* glob_addpath() */
+
+/*
+ * Handle a matched entry. isdir is -1 if unknown, in which case we only
+ * stat if it matters.
+ */
+static u_error_t glob_found(struct glob *g, int at, const char *name, size_t len, int isdir) {
+	_Bool needdir = (g->flags & U_GLOB_ONLYDIR) || g->slash;
+	struct stat st;
+
+	if (isdir == -1 && (needdir || (g->flags & U_GLOB_MARK))) {
+		if (0 == fstatat(at, name, &st, 0))
+			isdir = !!S_ISDIR(st.st_mode);
+		else if (0 == fstatat(at, name, &st, AT_SYMLINK_NOFOLLOW))
+			isdir = 0; /* dangling symbolic link */
+		else
+			return 0;
+	}
+
+	if (needdir && !isdir)
+		return 0;
+
+	return glob_addpath(g, g->buf, len, isdir > 0 && ((g->flags & U_GLOB_MARK) || g->slash));
+} /* glob_found() */
+
+static _Bool glob_iserror(const struct glob *g, int error) {
+	return error == ENOMEM || ((g->flags & U_GLOB_ERR) && error != ENOENT && error != ENOTDIR);
+} /* glob_iserror() */
+
+/*
+ * Match segment i against the directory open at fd, whose path is the
+ * first len bytes of g->buf. Takes ownership of fd.
+ */
+static u_error_t glob_walk(struct glob *g, int fd, size_t len, size_t i) {
+	const char *seg = g->seg[i].name;
+	_Bool last = (i + 1 == g->nseg);
+	struct dirent *ent = NULL, *res;
+	DIR *dp = NULL;
+	size_t n;
+	long namemax;
+	int fnflags, isdir, error;
+
+	if (g->seg[i].literal) {
+		struct stat st;
+		int nfd;
+
+		if ((error = glob_setpath(g, len, seg, &n)))
+			goto error;
+
+		if (last) {
+			if (0 == fstatat(fd, seg, &st, AT_SYMLINK_NOFOLLOW))
+				error = glob_found(g, fd, seg, n, S_ISLNK(st.st_mode)? -1 : !!S_ISDIR(st.st_mode));
+			else if (glob_iserror(g, errno))
+				error = errno;
+
+			u_close(&fd);
+
+			return error;
+		}
+
+		error = u_openat(&nfd, fd, seg, GLOB_OFLAGS, 0);
+		u_close(&fd);
+
+		if (error)
+			return (glob_iserror(g, error))? error : 0;
+
+		return glob_walk(g, nfd, n, i + 1);
+	}
+
+	if (-1 == (namemax = fpathconf(fd, _PC_NAME_MAX)))
+		goto syerr;
+
+	if (!(ent = malloc(sizeof *ent + namemax + 1)))
+		goto syerr;
+
+	if (!(dp = fdopendir(fd)))
+		goto syerr;
+
+	fd = -1;
+
+	fnflags = (g->flags & U_GLOB_PERIOD)? 0 : FNM_PERIOD;
+	fnflags |= (g->flags & U_GLOB_NOESCAPE)? FNM_NOESCAPE : 0;
+
+	while (!(error = u_readdir_r(dp, ent, &res)) && res) {
+		const char *name = res->d_name;
+
+		if ((g->flags & U_GLOB_PERIOD) && (!strcmp(name, ".") || !strcmp(name, "..")))
+			continue;
+
+		if (0 != fnmatch(seg, name, fnflags))
+			continue;
+
+		isdir = -1;
+#if defined DT_DIR && defined DT_LNK && defined DT_UNKNOWN
+		if (res->d_type != DT_UNKNOWN && res->d_type != DT_LNK)
+			isdir = (res->d_type == DT_DIR);
+#endif
+
+		if ((error = glob_setpath(g, len, name, &n)))
+			goto error;
+
+		if (last) {
+			if ((error = glob_found(g, dirfd(dp), name, n, isdir)))
+				goto error;
+		} else if (isdir != 0) {
+			int nfd;
+
+			if ((error = u_openat(&nfd, dirfd(dp), name, GLOB_OFLAGS, 0))) {
+				if (glob_iserror(g, error))
+					goto error;
+				continue;
+			}
+
+			if ((error = glob_walk(g, nfd, n, i + 1)))
+				goto error;
+		}
+	}
+
+	if (error && glob_iserror(g, error))
+		goto error;
+
+	closedir(dp);
+	free(ent);
+
+	return 0;
+syerr:
+	error = errno;
+error:
+	if (dp)
+		closedir(dp);
+	u_close(&fd);
+	free(ent);
+
+	return error;
+} /* glob_walk() */
+
+static u_error_t glob_pattern(struct glob *g, const char *pattern) {
+	char *copy, *cp;
+	size_t len;
+	int fd = -1, error;
+
+	if (!(copy = strdup(pattern)))
+		return errno;
+
+	len = strlen(copy);
+	g->slash = (len > 1 && copy[len - 1] == '/');
+	g->nseg = 0;
+
+	for (cp = copy; *cp; ) {
+		cp += strspn(cp, "/");
+
+		if (!*cp)
+			break;
+
+		if ((error = u_reallocarray_glob_seg(&g->seg, &g->segsiz, g->nseg + 1)))
+			goto error;
+
+		g->seg[g->nseg].name = cp;
+		cp += strcspn(cp, "/");
+
+		if (*cp)
+			*cp++ = '\0';
+
+		if ((g->seg[g->nseg].literal = glob_isliteral(g, g->seg[g->nseg].name)))
+			glob_unescape(g, g->seg[g->nseg].name);
+
+		g->nseg++;
+	}
+
+	if (g->bufsiz < 2 && (error = u_realloc(&g->buf, &g->bufsiz, 2)))
+		goto error;
+
+	len = (*pattern == '/');
+	g->buf[0] = '/';
+	g->buf[len] = '\0';
+
+	if (g->nseg == 0) {
+		/* "" matches nothing, "/" matches only itself */
+		if (len && (error = glob_addpath(g, "/", 1, 0)))
+			goto error;
+
+		free(copy);
+
+		return 0;
+	}
+
+	if ((error = u_open(&fd, (len)? "/" : ".", GLOB_OFLAGS, 0))) {
+		if (glob_iserror(g, error))
+			goto error;
+
+		free(copy);
+
+		return 0;
+	}
+
+	error = glob_walk(g, fd, len, 0);
+	free(copy);
+
+	return error;
+error:
+	free(copy);
+
+	return error;
+} /* glob_pattern() */
+
+/* find matching close brace, or NULL */
+static const char *glob_endbrace(const struct glob *g, const char *p) {
+	int depth = 0;
+
+	for (; *p; p++) {
+		if (*p == '\\' && !(g->flags & U_GLOB_NOESCAPE) && p[1]) {
+			p++;
+		} else if (*p == '{') {
+			depth++;
+		} else if (*p == '}' && --depth == 0) {
+			return p;
+		}
+	}
+
+	return NULL;
+} /* glob_endbrace() */
+
+static u_error_t glob_brace(struct glob *g, const char *pattern) {
+	const char *lb, *rb = NULL, *alt, *p;
+	size_t prelen;
+	char *buf;
+	int depth, error;
+
+	for (lb = pattern; *lb; lb++) {
+		if (*lb == '\\' && !(g->flags & U_GLOB_NOESCAPE) && lb[1])
+			lb++;
+		else if (*lb == '{' && (rb = glob_endbrace(g, lb)))
+			break;
+	}
+
+	if (!*lb)
+		return glob_pattern(g, pattern);
+
+	prelen = lb - pattern;
+
+	if (!(buf = malloc(strlen(pattern) + 1)))
+		return errno;
+
+	memcpy(buf, pattern, prelen);
+
+	for (alt = p = lb + 1, depth = 0; p <= rb; p++) {
+		if (*p == '\\' && !(g->flags & U_GLOB_NOESCAPE) && p[1]) {
+			p++;
+		} else if (*p == '{') {
+			depth++;
+		} else if (*p == '}' && depth > 0) {
+			depth--;
+		} else if ((*p == ',' && depth == 0) || p == rb) {
+			memcpy(&buf[prelen], alt, p - alt);
+			strcpy(&buf[prelen + (p - alt)], rb + 1);
+
+			if ((error = glob_brace(g, buf))) {
+				free(buf);
+				return error;
+			}
 
-		return 2;
+			alt = p + 1;
+		}
 	}
-} /* unix_gettimeofday() */
 
+	free(buf);
 
-static int unix_getsockname(lua_State *L) {
-	int fd = unixL_checkfileno(L, 1);
-	int error;
+	return 0;
+} /* glob_brace() */
 
-	if ((error = unixL_getsockname(L, fd, &getsockname)))
-		return unixL_pusherror(L, error, "getsockname", "~$#");
+static int glob_cmp(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+} /* glob_cmp() */
 
-	return 1;
-} /* unix_getsockname() */
+static void glob_free(struct glob *g) {
+	size_t i;
 
+	for (i = 0; i < g->npath; i++)
+		free(g->path[i]);
 
-static int unsafe_getsockopt(lua_State *L) {
-	unixL_State *U = unixL_getstate(L);
-	int fd = unixL_checkfileno(L, 1);
-	int level = unixL_checkint(L, 2);
-	int type = unixL_checkint(L, 3);
-	const struct iovec iov = unixL_checkstring(L, 4, 0, INT_MAX); /* length must fit socklen_t */
-	socklen_t bufsiz;
-	int n, error;
+	free(g->path);
+	free(g->buf);
+	free(g->seg);
+} /* glob_free() */
 
-	n = lua_gettop(L);
-	luaL_argcheck(L, n <= 4, 5, lua_pushfstring(L, "expected 4 arguments, got %d", n));
+/* glob(pattern[, flags]) */
+static int unix_glob(lua_State *L) {
+	const char *pattern = luaL_checkstring(L, 1);
+	struct glob g = { .flags = unixL_optint(L, 2, 0) };
+	size_t i;
+	int error;
 
-	if (U->bufsiz < iov.iov_len && (error = u_realloc(&U->buf, &U->bufsiz, iov.iov_len)))
-		goto error;
-	memcpy(U->buf, iov.iov_base, iov.iov_len);
-	bufsiz = iov.iov_len;
+	if (g.flags & U_GLOB_BRACE)
+		error = glob_brace(&g, pattern);
+	else
+		error = glob_pattern(&g, pattern);
 
-	if (0 != getsockopt(fd, level, type, U->buf, &bufsiz))
-		goto syerr;
+	if (error) {
+		glob_free(&g);
+		return unixL_pusherror(L, error, "glob", "~$#");
+	}
 
-	lua_pushlstring(L, U->buf, bufsiz);
-	return 1;
-syerr:
-	error = errno;
-error:
-	return unixL_pusherror(L, error, "getsockopt", "~$#");
-} /* unsafe_getsockopt() */
+	if (!(g.flags & U_GLOB_NOSORT))
+		qsort(g.path, g.npath, sizeof *g.path, &glob_cmp);
 
+	lua_createtable(L, MAX(g.npath, 1), 0);
 
-static int unix_getuid(lua_State *L) {
-	lua_pushinteger(L, getuid());
+	for (i = 0; i < g.npath; i++) {
+		lua_pushstring(L, g.path[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	if (g.npath == 0 && (g.flags & U_GLOB_NOCHECK)) {
+		lua_pushvalue(L, 1);
+		lua_rawseti(L, -2, 1);
+	}
+
+	glob_free(&g);
 
 	return 1;
-} /* unix_getuid() */
+} /* unix_glob() */
 
 
 static int unix_grantpt(lua_State *L) {
@@ -7791,153 +11009,534 @@ static int unsafe_ioctl(lua_State *L) {
 			goto error;
 		memcpy(U->buf, iov.iov_base, iov.iov_len);
 
-		if (-1 == (r = ioctl(fd, cmd, U->buf)))
-			goto syerr;
+		if (-1 == (r = ioctl(fd, cmd, U->buf)))
+			goto syerr;
+
+		lua_pushinteger(L, r);
+		lua_pushlstring(L, U->buf, iov.iov_len);
+		return 2;
+	}
+	}
+
+	return luaL_argerror(L, 3, lua_pushfstring(L, "expected integer or string, got %s", luaL_typename(L, 3)));
+syerr:
+	error = errno;
+error:
+	return unixL_pusherror(L, error, "ioctl", "~$#");
+} /* unsafe_ioctl() */
+
+
+static int unix_isatty(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+
+	/* NB: POSIX doesn't require implementations to set errno */
+	errno = 0;
+	if (isatty(fd)) {
+		return lua_pushboolean(L, 1), 1;
+	} else if (errno == EBADF) {
+		return unixL_pusherror(L, errno, "isatty", "0$#");
+	} else {
+		return lua_pushboolean(L, 0), 1;
+	}
+} /* unix_isatty() */
+
+
+#if HAVE_GETAUXVAL
+#include <sys/auxv.h>
+#endif
+
+MAYBEUSED static int unix_issetugid_other(lua_State *L) {
+	lua_pushboolean(L, (geteuid() != getuid()) || (getegid() != getgid()));
+
+	return 0;
+} /* unix_issetugid_other() */
+
+MAYBEUSED static int unix_issetugid_linux(lua_State *L) {
+#if HAVE_GETAUXVAL && defined AT_SECURE
+	unsigned long auxval;
+
+	errno = 0;
+	auxval = getauxval(AT_SECURE);
+
+	if (auxval != 0 || errno != ENOENT) {
+		lua_pushboolean(L, !auxval);
+
+		return 1;
+	}
+#endif
+
+#if HAVE__LIBC_ENABLE_SECURE
+	extern int __libc_enable_secure;
+
+	lua_pushboolean(L, __libc_enable_secure);
+
+	return 1;
+#else
+	return unix_issetugid_other(L);
+#endif
+} /* unix_issetugid_linux() */
+
+MAYBEUSED static int unix_issetugid(lua_State *L) {
+#if HAVE_ISSETUGID
+	lua_pushboolean(L, issetugid());
+
+	return 1;
+#elif __linux
+	return unix_issetugid_linux(L);
+#else
+	return unix_issetugid_other(L);
+#endif
+} /* unix_issetugid() */
+
+
+static int unix_kill(lua_State *L) {
+	if (0 != kill(luaL_checkint(L, 1), luaL_checkint(L, 2)))
+		return unixL_pusherror(L, errno, "kill", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_kill() */
+
+
+static int unix_lchown(lua_State *L) {
+	uid_t uid = unixL_optuid(L, 2, -1);
+	gid_t gid = unixL_optgid(L, 3, -1);
+
+	if (0 != lchown(luaL_checkstring(L, 1), uid, gid))
+		return unixL_pusherror(L, errno, "lchown", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_lchown() */
+
+
+static int unix_link(lua_State *L) {
+	const char *src = luaL_checkstring(L, 1);
+	const char *dst = luaL_checkstring(L, 2);
+
+	if (0 != link(src, dst))
+		return unixL_pusherror(L, errno, "link", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_link() */
+
+
+#if defined SOMAXCONN
+#define U_SOMAXCONN SOMAXCONN
+#else
+#define U_SOMAXCONN 128
+#endif
+
+static int unix_listen(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+	int backlog = unixL_optint(L, 2, U_SOMAXCONN);
+
+	if (0 != listen(fd, backlog))
+		return unixL_pusherror(L, errno, "listen", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_listen() */
+
+
+static int unix_lockf(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+	int cmd = unixL_checkint(L, 2);
+	off_t size = unixL_optoff(L, 3, 0);
+
+	if (0 != lockf(fd, cmd, size))
+		return unixL_pusherror(L, errno, "lockf", "~$#");
+
+	lua_pushvalue(L, 1);
+
+	return 1;
+} /* unix_lockf() */
+
+
+/*
+ * Byte-range lock manager. Uses open file description locks where
+ * available, which are owned by the description rather than the process,
+ * so they are not dropped when another descriptor for the same file is
+ * closed and do conflict between threads. Otherwise falls back to
+ * process-scoped POSIX locks.
+ *
+ * By default a lock is a single non-blocking attempt which, when the
+ * range is held, suggests a retry delay growing exponentially across
+ * failed calls, so an event loop can schedule the retry rather than the
+ * thread stalling. Waiting with a deadline retries the non-blocking lock
+ * with the same backoff, as there's no portable way to bound F_SETLKW,
+ * and blocking in F_SETLKW must be asked for.
+ */
+#if defined F_OFD_SETLK && defined F_OFD_SETLKW && defined F_OFD_GETLK
+#define LM_OFD 1
+#define LM_SETLK F_OFD_SETLK
+#define LM_SETLKW F_OFD_SETLKW
+#define LM_GETLK F_OFD_GETLK
+#else
+#define LM_OFD 0
+#define LM_SETLK F_SETLK
+#define LM_SETLKW F_SETLKW
+#define LM_GETLK F_GETLK
+#endif
+
+#define LM_MINWAIT 0.001
+#define LM_MAXWAIT 0.064
+
+struct lockmgr {
+	int fd;
+	double backoff; /* next suggested retry delay after contention */
+
+	struct {
+		unsigned long long locks, unlocks, contended, retries, timeouts;
+		double waited, maxwait;
+	} stats;
+}; /* struct lockmgr */
+
+static struct lockmgr *lm_checkself(lua_State *L, int index) {
+	struct lockmgr *lm = luaL_checkudata(L, index, "struct lockmgr");
+
+	luaL_argcheck(L, lm->fd != -1, index, "attempt to use a closed lock manager");
+
+	return lm;
+} /* lm_checkself() */
+
+static double lm_now(void) {
+#if __APPLE__
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return u_tv2f(&tv);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return u_ts2f(&ts);
+#endif
+} /* lm_now() */
+
+static int lm_checktype(lua_State *L, int index, int def) {
+	const char *type;
+
+	if (lua_isnoneornil(L, index))
+		return def;
+	if (lua_type(L, index) == LUA_TNUMBER)
+		return luaL_checkint(L, index);
+
+	type = luaL_checkstring(L, index);
+
+	switch (*type) {
+	case 'r':
+		return F_RDLCK;
+	case 'w':
+		return F_WRLCK;
+	default:
+		return luaL_argerror(L, index, lua_pushfstring(L, "%s: invalid lock type", type));
+	}
+} /* lm_checktype() */
+
+static void lm_checkrange(lua_State *L, int index, struct flock *l) {
+	memset(l, 0, sizeof *l);
+	l->l_whence = SEEK_SET;
+	l->l_start = unixL_checkoff(L, index);
+	l->l_len = unixL_optoff(L, index + 1, 0);
+} /* lm_checkrange() */
+
+/*
+ * Acquire the range, waiting at most timeout seconds. A timeout of 0
+ * makes one attempt, failing with EAGAIN and the delay to retry after in
+ * *retry. A negative timeout blocks until the lock is granted.
+ */
+static u_error_t lm_acquire(struct lockmgr *lm, struct flock *l, double timeout, double *retry) {
+	struct timespec ts = { 0, 0 };
+	double begin, elapsed, backoff = LM_MINWAIT;
+	int error;
+
+	*retry = 0;
+
+	if (0 == fcntl(lm->fd, LM_SETLK, l)) {
+		lm->stats.locks++;
+		lm->backoff = 0;
+		return 0;
+	} else if (errno != EAGAIN && errno != EACCES) {
+		return errno;
+	}
+
+	lm->stats.contended++;
+
+	if (timeout == 0) {
+		*retry = MAX(lm->backoff, LM_MINWAIT);
+		lm->backoff = MIN(*retry * 2, LM_MAXWAIT);
+
+		return EAGAIN;
+	}
+
+	begin = lm_now();
+
+	for (;;) {
+		if (timeout < 0) {
+			if (0 == fcntl(lm->fd, LM_SETLKW, l)) {
+				error = 0;
+				break;
+			} else if ((error = errno) != EINTR) {
+				break;
+			}
+
+			continue;
+		}
 
-		lua_pushinteger(L, r);
-		lua_pushlstring(L, U->buf, iov.iov_len);
-		return 2;
-	}
-	}
+		elapsed = lm_now() - begin;
 
-	return luaL_argerror(L, 3, lua_pushfstring(L, "expected integer or string, got %s", luaL_typename(L, 3)));
-syerr:
-	error = errno;
-error:
-	return unixL_pusherror(L, error, "ioctl", "~$#");
-} /* unsafe_ioctl() */
+		if (elapsed >= timeout) {
+			lm->stats.timeouts++;
+			error = ETIMEDOUT;
 
+			break;
+		}
 
-static int unix_isatty(lua_State *L) {
-	int fd = unixL_checkfileno(L, 1);
+		nanosleep(u_f2ts(&ts, MIN(backoff, timeout - elapsed)), NULL);
+		backoff = MIN(backoff * 2, LM_MAXWAIT);
+		lm->stats.retries++;
 
-	/* NB: POSIX doesn't require implementations to set errno */
-	errno = 0;
-	if (isatty(fd)) {
-		return lua_pushboolean(L, 1), 1;
-	} else if (errno == EBADF) {
-		return unixL_pusherror(L, errno, "isatty", "0$#");
-	} else {
-		return lua_pushboolean(L, 0), 1;
+		if (0 == fcntl(lm->fd, LM_SETLK, l)) {
+			error = 0;
+			break;
+		} else if ((error = errno) != EAGAIN && error != EACCES) {
+			break;
+		}
 	}
-} /* unix_isatty() */
 
+	elapsed = lm_now() - begin;
+	lm->stats.waited += elapsed;
+	lm->stats.maxwait = MAX(lm->stats.maxwait, elapsed);
 
-#if HAVE_GETAUXVAL
-#include <sys/auxv.h>
-#endif
+	if (error)
+		return error;
 
-MAYBEUSED static int unix_issetugid_other(lua_State *L) {
-	lua_pushboolean(L, (geteuid() != getuid()) || (getegid() != getgid()));
+	lm->stats.locks++;
+	lm->backoff = 0;
 
 	return 0;
-} /* unix_issetugid_other() */
+} /* lm_acquire() */
 
-MAYBEUSED static int unix_issetugid_linux(lua_State *L) {
-#if HAVE_GETAUXVAL && defined AT_SECURE
-	unsigned long auxval;
+/*
+ * lock(start[, len][, type][, timeout])
+ *
+ * len of 0 extends to the end of file, type defaults to a write lock, and
+ * timeout defaults to a single attempt. A negative timeout waits
+ * indefinitely.
+ */
+static int lm_lock(lua_State *L) {
+	struct lockmgr *lm = lm_checkself(L, 1);
+	struct flock l;
+	double timeout, retry;
+	int error;
 
-	errno = 0;
-	auxval = getauxval(AT_SECURE);
+	lm_checkrange(L, 2, &l);
+	l.l_type = lm_checktype(L, 4, F_WRLCK);
+	timeout = luaL_optnumber(L, 5, 0);
+	luaL_argcheck(L, timeout == timeout, 5, "timeout is NaN");
 
-	if (auxval != 0 || errno != ENOENT) {
-		lua_pushboolean(L, !auxval);
+	if ((error = lm_acquire(lm, &l, timeout, &retry))) {
+		int n = unixL_pusherror(L, error, "lock", "0$#");
 
-		return 1;
-	}
-#endif
+		if (error != EAGAIN)
+			return n;
 
-#if HAVE__LIBC_ENABLE_SECURE
-	extern int __libc_enable_secure;
+		lua_pushnumber(L, retry);
 
-	lua_pushboolean(L, __libc_enable_secure);
+		return n + 1;
+	}
+
+	lua_pushboolean(L, 1);
 
 	return 1;
-#else
-	return unix_issetugid_other(L);
-#endif
-} /* unix_issetugid_linux() */
+} /* lm_lock() */
 
-MAYBEUSED static int unix_issetugid(lua_State *L) {
-#if HAVE_ISSETUGID
-	lua_pushboolean(L, issetugid());
+static int lm_trylock(lua_State *L) {
+	lua_settop(L, 4);
+	lua_pushnumber(L, 0);
 
-	return 1;
-#elif __linux
-	return unix_issetugid_linux(L);
-#else
-	return unix_issetugid_other(L);
-#endif
-} /* unix_issetugid() */
+	return lm_lock(L);
+} /* lm_trylock() */
 
+static int lm_unlock(lua_State *L) {
+	struct lockmgr *lm = lm_checkself(L, 1);
+	struct flock l;
 
-static int unix_kill(lua_State *L) {
-	if (0 != kill(luaL_checkint(L, 1), luaL_checkint(L, 2)))
-		return unixL_pusherror(L, errno, "kill", "0$#");
+	lm_checkrange(L, 2, &l);
+	l.l_type = F_UNLCK;
+
+	if (0 != fcntl(lm->fd, LM_SETLK, &l))
+		return unixL_pusherror(L, errno, "unlock", "0$#");
+
+	lm->stats.unlocks++;
 
 	lua_pushboolean(L, 1);
 
 	return 1;
-} /* unix_kill() */
+} /* lm_unlock() */
 
+/*
+ * test(start[, len][, type])
+ *
+ * Returns false if the lock could be placed, otherwise a table describing
+ * a conflicting lock.
+ */
+static int lm_test(lua_State *L) {
+	struct lockmgr *lm = lm_checkself(L, 1);
+	struct flock l;
 
-static int unix_lchown(lua_State *L) {
-	uid_t uid = unixL_optuid(L, 2, -1);
-	gid_t gid = unixL_optgid(L, 3, -1);
+	lm_checkrange(L, 2, &l);
+	l.l_type = lm_checktype(L, 4, F_WRLCK);
 
-	if (0 != lchown(luaL_checkstring(L, 1), uid, gid))
-		return unixL_pusherror(L, errno, "lchown", "0$#");
+	if (0 != fcntl(lm->fd, LM_GETLK, &l))
+		return unixL_pusherror(L, errno, "test", "~$#");
 
-	lua_pushboolean(L, 1);
+	if (l.l_type == F_UNLCK) {
+		lua_pushboolean(L, 0);
 
-	return 1;
-} /* unix_lchown() */
+		return 1;
+	}
 
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, l.l_type);
+	lua_setfield(L, -2, "type");
+	unixL_pushoff(L, l.l_start);
+	lua_setfield(L, -2, "start");
+	unixL_pushoff(L, l.l_len);
+	lua_setfield(L, -2, "len");
+	lua_pushinteger(L, l.l_pid);
+	lua_setfield(L, -2, "pid");
 
-static int unix_link(lua_State *L) {
-	const char *src = luaL_checkstring(L, 1);
-	const char *dst = luaL_checkstring(L, 2);
+	return 1;
+} /* lm_test() */
+
+static int lm_stats(lua_State *L) {
+	struct lockmgr *lm = lm_checkself(L, 1);
+
+	lua_createtable(L, 0, 8);
+	unixL_pushunsigned(L, lm->stats.locks);
+	lua_setfield(L, -2, "locks");
+	unixL_pushunsigned(L, lm->stats.unlocks);
+	lua_setfield(L, -2, "unlocks");
+	unixL_pushunsigned(L, lm->stats.contended);
+	lua_setfield(L, -2, "contended");
+	unixL_pushunsigned(L, lm->stats.retries);
+	lua_setfield(L, -2, "retries");
+	unixL_pushunsigned(L, lm->stats.timeouts);
+	lua_setfield(L, -2, "timeouts");
+	lua_pushnumber(L, lm->stats.waited);
+	lua_setfield(L, -2, "waited");
+	lua_pushnumber(L, lm->stats.maxwait);
+	lua_setfield(L, -2, "maxwait");
+	lua_pushboolean(L, LM_OFD);
+	lua_setfield(L, -2, "ofd");
 
-	if (0 != link(src, dst))
-		return unixL_pusherror(L, errno, "link", "0$#");
+	return 1;
+} /* lm_stats() */
 
-	lua_pushboolean(L, 1);
+static int lm_fileno(lua_State *L) {
+	struct lockmgr *lm = luaL_checkudata(L, 1, "struct lockmgr");
 
-	return 1;
-} /* unix_link() */
+	lua_pushinteger(L, lm->fd);
 
+	return 1;
+} /* lm_fileno() */
 
-#if defined SOMAXCONN
-#define U_SOMAXCONN SOMAXCONN
-#else
-#define U_SOMAXCONN 128
-#endif
+/*
+ * The description is private to the manager unless fileno was dup'd, so
+ * closing it releases every lock held through it.
+ */
+static int lm_close(lua_State *L) {
+	struct lockmgr *lm = luaL_checkudata(L, 1, "struct lockmgr");
+	int error;
 
-static int unix_listen(lua_State *L) {
-	int fd = unixL_checkfileno(L, 1);
-	int backlog = unixL_optint(L, 2, U_SOMAXCONN);
+	if (lm->fd != -1) {
+		error = u_close_nocancel(lm->fd);
+		lm->fd = -1;
 
-	if (0 != listen(fd, backlog))
-		return unixL_pusherror(L, errno, "listen", "0$#");
+		if (error)
+			return unixL_pusherror(L, error, "close", "0$#");
+	}
 
 	lua_pushboolean(L, 1);
 
 	return 1;
-} /* unix_listen() */
+} /* lm_close() */
 
+static int lm__gc(lua_State *L) {
+	struct lockmgr *lm = luaL_checkudata(L, 1, "struct lockmgr");
 
-static int unix_lockf(lua_State *L) {
-	int fd = unixL_checkfileno(L, 1);
-	int cmd = unixL_checkint(L, 2);
-	off_t size = unixL_optoff(L, 3, 0);
+	u_close(&lm->fd);
 
-	if (0 != lockf(fd, cmd, size))
-		return unixL_pusherror(L, errno, "lockf", "~$#");
+	return 0;
+} /* lm__gc() */
+
+static const luaL_Reg lm_methods[] = {
+	{ "lock",    &lm_lock },
+	{ "trylock", &lm_trylock },
+	{ "unlock",  &lm_unlock },
+	{ "test",    &lm_test },
+	{ "stats",   &lm_stats },
+	{ "fileno",  &lm_fileno },
+	{ "close",   &lm_close },
+	{ NULL,      NULL },
+}; /* lm_methods[] */
+
+static const luaL_Reg lm_metamethods[] = {
+	{ "__gc", &lm__gc },
+	{ NULL,   NULL },
+}; /* lm_metamethods[] */
 
-	lua_pushvalue(L, 1);
+/*
+ * lockmgr(path|file|dir|fd[, mode][, perm])
+ *
+ * The manager always gets an open file description of its own, so it is
+ * a distinct lock owner from the source handle and from other managers,
+ * and closing it drops its locks. Handles are reopened rather than
+ * duplicated, keeping their access mode unless mode is given. A path is
+ * opened read-write and created if missing unless mode is given.
+ */
+static int unix_lockmgr(lua_State *L) {
+	struct lockmgr *lm;
+	u_flags_t flags;
+	const char *mode;
+	mode_t perm;
+	int ofd, error;
+
+	lua_settop(L, 3);
+
+	if (lua_type(L, 1) == LUA_TSTRING && lua_isnil(L, 2)) {
+		flags = O_RDWR|O_CREAT;
+		perm = unixL_optmode(L, 3, 0666, 0666);
+	} else {
+		unixL_checkflags(L, 2, &mode, &flags, &perm);
+	}
+
+	lm = lua_newuserdata(L, sizeof *lm);
+	memset(lm, 0, sizeof *lm);
+	lm->fd = -1;
+	luaL_setmetatable(L, "struct lockmgr");
+
+	if (-1 != (ofd = unixL_optfileno(L, 1, -1))) {
+		if ((error = unixL_reopen(L, &lm->fd, ofd, flags|U_CLOEXEC)))
+			goto error;
+	} else {
+		if ((error = u_open(&lm->fd, luaL_checkstring(L, 1), flags|U_CLOEXEC, perm)))
+			goto error;
+	}
 
 	return 1;
-} /* unix_lockf() */
+error:
+	return unixL_pusherror(L, error, "lockmgr", "~$#");
+} /* unix_lockmgr() */
 
 
 static int unix_LOG_MASK(lua_State *L) {
@@ -8074,30 +11673,213 @@ static int unix_mkfifo(lua_State *L) {
 	const char *path = luaL_checkstring(L, 1);
 	mode_t mode = unixL_optmode(L, 2, 0666, 0666);
 
-	if (0 != mkfifo(path, mode))
-		return unixL_pusherror(L, errno, "mkfifo", "0$#");
+	if (0 != mkfifo(path, mode))
+		return unixL_pusherror(L, errno, "mkfifo", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_mkfifo() */
+
+
+#if HAVE_MKFIFOAT
+static int unix_mkfifoat(lua_State *L) {
+	int at = unixL_checkatfileno(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	mode_t mode = unixL_optmode(L, 3, 0666, 0666);
+
+	if (0 != mkfifoat(at, path, mode))
+		return unixL_pusherror(L, errno, "mkfifoat", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_mkfifoat() */
+#endif
+
+
+static char *mkpath_prep(lua_State *L, int index, size_t *_len) {
+	size_t len;
+	const char *path = luaL_checklstring(L, index, &len);
+	char *dir, *slash;
+
+	dir = lua_newuserdata(L, len + 1);
+	memcpy(dir, path, len + 1);
+
+	slash = dir + len;
+	while (--slash > dir && *slash == '/')
+		*slash = '\0';
+
+	*_len = strlen(dir);
+
+	return dir;
+} /* mkpath_prep() */
+
+/*
+ * Probe back from the leaf for the deepest existing ancestor. On success
+ * *pos is the offset of the end of that ancestor, which is len if the
+ * entire path already exists, or 0 if no ancestor was found.
+ */
+static u_error_t mkpath_probe(char *dir, size_t len, size_t *pos) {
+	struct stat st;
+	size_t end = len;
+	int lc, error;
+
+	while (end > 0) {
+		lc = dir[end];
+		dir[end] = '\0';
+		error = (0 == stat(dir, &st))? 0 : errno;
+		dir[end] = lc;
+
+		if (!error) {
+			if (!S_ISDIR(st.st_mode))
+				return ENOTDIR;
+
+			*pos = end;
+
+			return 0;
+		} else if (error != ENOENT) {
+			return error;
+		}
+
+		while (end > 0 && dir[end - 1] != '/')
+			end--;
+		while (end > 0 && dir[end - 1] == '/')
+			end--;
+	}
+
+	*pos = 0;
+
+	return 0;
+} /* mkpath_probe() */
+
+/* create each component after pos using full paths */
+static u_error_t mkpath_slow(char *dir, size_t pos, mode_t mode, mode_t imode) {
+	char *slash = dir + pos;
+	mode_t _mode;
+	int lc;
+
+	while (*slash) {
+		slash += strspn(slash, "/");
+		slash += strcspn(slash, "/");
+
+		lc = *slash;
+		*slash = '\0';
+
+		_mode = (lc == '\0')? mode : imode;
+
+		if (0 == mkdir(dir, 0700 & _mode)) {
+			if (0 != chmod(dir, _mode))
+				goto syerr;
+		} else {
+			int error = errno;
+			struct stat st;
+
+			if (0 != stat(dir, &st)) {
+				*slash = lc;
+				return error;
+			}
+
+			if (!S_ISDIR(st.st_mode)) {
+				*slash = lc;
+				return ENOTDIR;
+			}
+		}
+
+		*slash = lc;
+	}
+
+	return 0;
+syerr:
+	*slash = lc;
+
+	return errno;
+} /* mkpath_slow() */
+
+/*
+ * Create each component after pos relative to its parent's descriptor so
+ * the kernel doesn't re-resolve the full path for every component.
+ */
+static u_error_t mkpath_create(char *dir, size_t pos, mode_t mode, mode_t imode) {
+#if HAVE_MKDIRAT && HAVE_FCHMODAT
+	char *slash = dir + pos, *name;
+	int fd = -1, lc, error;
+	mode_t _mode;
+
+	if (pos > 0) {
+		lc = dir[pos];
+		dir[pos] = '\0';
+		error = u_open(&fd, dir, U_ATFLAGS, 0);
+		dir[pos] = lc;
+	} else {
+		error = u_open(&fd, (*dir == '/')? "/" : ".", U_ATFLAGS, 0);
+	}
+
+	if (error == EACCES)
+		return mkpath_slow(dir, pos, mode, imode);
+	else if (error)
+		return error;
+
+	while (*(slash += strspn(slash, "/"))) {
+		name = slash;
+		slash += strcspn(slash, "/");
+
+		lc = *slash;
+		*slash = '\0';
+
+		_mode = (lc == '\0')? mode : imode;
+
+		if (0 == mkdirat(fd, name, 0700 & _mode)) {
+			if (0 != fchmodat(fd, name, _mode, 0))
+				goto syerr;
+		} else {
+			struct stat st;
+
+			error = errno;
+
+			if (0 != fstatat(fd, name, &st, 0))
+				goto error;
 
-	lua_pushboolean(L, 1);
+			if (!S_ISDIR(st.st_mode)) {
+				error = ENOTDIR;
+				goto error;
+			}
+		}
 
-	return 1;
-} /* unix_mkfifo() */
+		if (lc != '\0') {
+			int nfd;
 
+			error = u_openat(&nfd, fd, name, U_ATFLAGS, 0);
+			*slash = lc;
 
-#if HAVE_MKFIFOAT
-static int unix_mkfifoat(lua_State *L) {
-	int at = unixL_checkatfileno(L, 1);
-	const char *path = luaL_checkstring(L, 2);
-	mode_t mode = unixL_optmode(L, 3, 0666, 0666);
+			if (error == EACCES) {
+				u_close(&fd);
+				return mkpath_slow(dir, slash - dir, mode, imode);
+			} else if (error) {
+				goto error;
+			}
 
-	if (0 != mkfifoat(at, path, mode))
-		return unixL_pusherror(L, errno, "mkfifoat", "0$#");
+			u_close(&fd);
+			fd = nfd;
+		} else {
+			*slash = lc;
+		}
+	}
 
-	lua_pushboolean(L, 1);
+	u_close(&fd);
 
-	return 1;
-} /* unix_mkfifoat() */
-#endif
+	return 0;
+syerr:
+	error = errno;
+error:
+	*slash = lc;
+	u_close(&fd);
 
+	return error;
+#else
+	return mkpath_slow(dir, pos, mode, imode);
+#endif
+} /* mkpath_create() */
 
 /*
  * Patterned after the mkpath routine from BSD mkdir implementations for
@@ -8113,60 +11895,94 @@ static int unix_mkfifoat(lua_State *L) {
  *    value, the target directory is chmod'd using that mode value,
  *    unaltered by the umask. On OpenBSD intermediate directories are also
  *    chmod'd with that mode value.
+ *
+ * Unlike BSD mkpath we first probe back from the leaf, so a path that
+ * already exists costs a single stat(2) and never queries the umask.
  */
 static int unix_mkpath(lua_State *L) {
-	size_t len;
-	const char *path = luaL_checklstring(L, 1, &len);
-	mode_t cmask, mode, imode, _mode;
-	char *dir, *slash;
-	int lc;
+	mode_t cmask, mode, imode;
+	size_t len, pos;
+	char *dir;
+	int error;
 
-	cmask = unixL_getumask(L);
-	mode = 0777 & ~cmask;
-	imode = 0300 | mode;
+	lua_settop(L, 3);
+	dir = mkpath_prep(L, 1, &len);
 
-	mode = unixL_optmode(L, 2, mode, mode) & ~cmask;
-	imode = unixL_optmode(L, 3, imode, imode) & ~cmask;
+	if ((error = mkpath_probe(dir, len, &pos)))
+		goto error;
 
-	dir = lua_newuserdata(L, len + 1);
-	memcpy(dir, path, len + 1);
+	if (pos < len) {
+		cmask = unixL_getumask(L);
+		mode = 0777 & ~cmask;
+		imode = 0300 | mode;
 
-	slash = dir + len;
-	while (--slash > dir && *slash == '/')
-		*slash = '\0';
+		mode = unixL_optmode(L, 2, mode, mode) & ~cmask;
+		imode = unixL_optmode(L, 3, imode, imode) & ~cmask;
 
-	slash = dir;
+		if ((error = mkpath_create(dir, pos, mode, imode)))
+			goto error;
+	}
 
-	while (*slash) {
-		slash += strspn(slash, "/");
-		slash += strcspn(slash, "/");
+	lua_pushboolean(L, 1);
 
-		lc = *slash;
-		*slash = '\0';
+	return 1;
+error:
+	return unixL_pusherror(L, error, "mkpath", "0$#");
+} /* unix_mkpath() */
 
-		_mode = (lc == '\0')? mode : imode;
 
-		if (0 == mkdir(dir, 0700 & _mode)) {
-			if (0 != chmod(dir, _mode))
-				return unixL_pusherror(L, errno, "mkpath", "0$#");
-		} else {
-			int error = errno;
-			struct stat st;
+/*
+ * mkpaths(paths[, mode][, imode])
+ *
+ * Like mkpath over each path in the array. Paths sharing a prefix are
+ * cheap as the leaf probe stops at the first existing ancestor. On failure
+ * also returns the index of the offending path.
+ */
+static int unix_mkpaths(lua_State *L) {
+	mode_t cmask, mode = 0, imode = 0;
+	_Bool masked = 0;
+	size_t len, pos;
+	char *dir;
+	int i, n, error;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 3);
+	n = lua_rawlen(L, 1);
 
-			if (0 != stat(dir, &st))
-				return unixL_pusherror(L, error, "mkpath", "0$#");
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 1, i);
+		dir = mkpath_prep(L, -1, &len);
 
-			if (!S_ISDIR(st.st_mode))
-				return unixL_pusherror(L, ENOTDIR, "mkpath", "0$#");
+		if ((error = mkpath_probe(dir, len, &pos)))
+			goto error;
+
+		if (pos < len) {
+			if (!masked) {
+				cmask = unixL_getumask(L);
+				mode = 0777 & ~cmask;
+				imode = 0300 | mode;
+
+				mode = unixL_optmode(L, 2, mode, mode) & ~cmask;
+				imode = unixL_optmode(L, 3, imode, imode) & ~cmask;
+				masked = 1;
+			}
+
+			if ((error = mkpath_create(dir, pos, mode, imode)))
+				goto error;
 		}
 
-		*slash = lc;
+		lua_pop(L, 2);
 	}
 
 	lua_pushboolean(L, 1);
 
 	return 1;
-} /* unix_mkpath() */
+error:
+	n = unixL_pusherror(L, error, "mkpaths", "0$#");
+	lua_pushinteger(L, i);
+
+	return n + 1;
+} /* unix_mkpaths() */
 
 
 static int unsafe_mlock(lua_State *L) {
@@ -8236,6 +12052,32 @@ static int unsafe_munlockall(lua_State *L) {
 } /* unsafe_munlockall() */
 
 
+#if HAVE_VMSPLICE
+/*
+ * Without SPLICE_F_GIFT the pipe references the pages rather than
+ * copying them, so the memory must not be modified or freed until the
+ * reader has consumed it.
+ */
+static int unsafe_vmsplice(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+	struct iovec iov;
+	unsigned flags;
+	ssize_t n;
+
+	iov.iov_base = unixL_checklightuserdata(L, 2);
+	iov.iov_len = unixL_checksize(L, 3);
+	flags = unixL_optinteger(L, 4, 0, 0, UINT_MAX);
+
+	if (-1 == (n = vmsplice(fd, &iov, 1, flags)))
+		return unixL_pusherror(L, errno, "vmsplice", "~$#");
+
+	unixL_pushsize(L, n);
+
+	return 1;
+} /* unsafe_vmsplice() */
+#endif
+
+
 static int unsafe_munmap(lua_State *L) {
 	void *addr = unixL_checklightuserdata(L, 1);
 	size_t len = unixL_checksize(L, 2);
@@ -8553,31 +12395,356 @@ static int unix_pathconf(lua_State *L) {
 
 	lua_pushinteger(L, v);
 
-	return 1;
-} /* unix_pathconf() */
+	return 1;
+} /* unix_pathconf() */
+
+
+static int unix_pipe(lua_State *L) {
+	int fd[2] = { -1, -1 }, error;
+	u_flags_t flags;
+	const char *mode;
+	size_t size;
+
+	lua_settop(L, 2);
+	unixL_checkflags(L, 1, &mode, &flags, NULL);
+	size = unixL_optsize(L, 2, 0);
+
+	if ((error = u_pipe(fd, flags)))
+		goto error;
+
+	if (size > 0 && (error = u_setpipesz(fd[1], size)))
+		goto error;
+
+	lua_pushinteger(L, fd[0]);
+	lua_pushinteger(L, fd[1]);
+
+	return 2;
+error:
+	u_close(&fd[0]);
+	u_close(&fd[1]);
+
+	return unixL_pusherror(L, error, "pipe", "~$#");
+} /* unix_pipe() */
+
+
+/*
+ * Pipe channel for streaming between a parent and child. Messages are
+ * framed with a length header, and a frame no larger than PIPE_BUF is
+ * written with a single writev, which POSIX makes atomic, so concurrent
+ * writers never interleave. Reads are buffered so many small frames cost
+ * one read(2).
+ */
+#if defined PIPE_BUF
+#define CH_PIPE_BUF PIPE_BUF
+#else
+#define CH_PIPE_BUF _POSIX_PIPE_BUF
+#endif
+
+#define CH_HDRSIZ (sizeof (uint32_t))
+#define CH_READSIZ 65536
+
+struct channel {
+	int fd[2];
+	_Bool atomic;
+
+	char *buf;
+	size_t bufsiz, pos, end;
+
+	struct {
+		unsigned long long sent, received, bytes, reads, writes;
+	} stats;
+}; /* struct channel */
+
+static struct channel *ch_checkself(lua_State *L, int index) {
+	return luaL_checkudata(L, index, "struct channel");
+} /* ch_checkself() */
+
+static u_error_t ch_writev(struct channel *ch, struct iovec *iov, int iovcnt) {
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		if (-1 == (n = writev(ch->fd[1], iov, iovcnt))) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		ch->stats.writes++;
+
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+} /* ch_writev() */
+
+/*
+ * Ensure at least n bytes are buffered. Returns EPIPE on end of file.
+ */
+static u_error_t ch_fill(struct channel *ch, size_t n) {
+	ssize_t count;
+	int error;
+
+	if (ch->end - ch->pos >= n)
+		return 0;
+
+	if (ch->pos > 0) {
+		memmove(ch->buf, &ch->buf[ch->pos], ch->end - ch->pos);
+		ch->end -= ch->pos;
+		ch->pos = 0;
+	}
+
+	if (ch->bufsiz < MAX(n, CH_READSIZ)) {
+		if ((error = u_realloc(&ch->buf, &ch->bufsiz, MAX(n, CH_READSIZ))))
+			return error;
+	}
+
+	while (ch->end < n) {
+		if (-1 == (count = read(ch->fd[0], &ch->buf[ch->end], ch->bufsiz - ch->end))) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		ch->stats.reads++;
+
+		if (count == 0)
+			return EPIPE;
+
+		ch->end += count;
+	}
+
+	return 0;
+} /* ch_fill() */
+
+static int ch_send(lua_State *L) {
+	struct channel *ch = ch_checkself(L, 1);
+	size_t len;
+	const char *src = luaL_checklstring(L, 2, &len);
+	struct iovec iov[2];
+	uint32_t hdr;
+	int error;
+
+	if (ch->fd[1] == -1) {
+		error = EBADF;
+		goto error;
+	}
+
+	if (len > UINT32_MAX || (ch->atomic && len > CH_PIPE_BUF - CH_HDRSIZ)) {
+		error = EMSGSIZE;
+		goto error;
+	}
+
+	hdr = len;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof hdr;
+	iov[1].iov_base = (void *)src;
+	iov[1].iov_len = len;
+
+	if ((error = ch_writev(ch, iov, 2)))
+		goto error;
+
+	ch->stats.sent++;
+	ch->stats.bytes += len;
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+error:
+	return unixL_pusherror(L, error, "send", "0$#");
+} /* ch_send() */
+
+static int ch_recv(lua_State *L) {
+	struct channel *ch = ch_checkself(L, 1);
+	uint32_t hdr;
+	int error;
+
+	if (ch->fd[0] == -1) {
+		error = EBADF;
+		goto error;
+	}
+
+	if ((error = ch_fill(ch, CH_HDRSIZ))) {
+		/* end of file between frames is a clean end of stream */
+		if (error == EPIPE && ch->pos == ch->end)
+			return 0;
+		goto error;
+	}
+
+	memcpy(&hdr, &ch->buf[ch->pos], sizeof hdr);
+
+	if ((error = ch_fill(ch, CH_HDRSIZ + (size_t)hdr)))
+		goto error;
+
+	lua_pushlstring(L, &ch->buf[ch->pos + CH_HDRSIZ], hdr);
+	ch->pos += CH_HDRSIZ + hdr;
+	ch->stats.received++;
+
+	return 1;
+error:
+	/* a partial frame means the writer died mid-message */
+	return unixL_pusherror(L, (error == EPIPE)? EIO : error, "recv", "~$#");
+} /* ch_recv() */
+
+static int ch_fileno(lua_State *L) {
+	struct channel *ch = ch_checkself(L, 1);
+
+	lua_pushinteger(L, ch->fd[0]);
+	lua_pushinteger(L, ch->fd[1]);
+
+	return 2;
+} /* ch_fileno() */
+
+static int ch_size(lua_State *L) {
+	struct channel *ch = ch_checkself(L, 1);
+	int fd = (ch->fd[1] != -1)? ch->fd[1] : ch->fd[0];
+	int error;
+
+	if (!lua_isnoneornil(L, 2)) {
+		if ((error = u_setpipesz(fd, unixL_checksize(L, 2))))
+			return unixL_pusherror(L, error, "size", "~$#");
+	}
+
+#if defined F_GETPIPE_SZ
+	{
+		int size;
+
+		if (-1 == (size = fcntl(fd, F_GETPIPE_SZ)))
+			return unixL_pusherror(L, errno, "size", "~$#");
+
+		lua_pushinteger(L, size);
+	}
+#else
+	return unixL_pusherror(L, ENOTSUP, "size", "~$#");
+#endif
+
+	return 1;
+} /* ch_size() */
+
+static int ch_stats(lua_State *L) {
+	struct channel *ch = ch_checkself(L, 1);
+
+	lua_createtable(L, 0, 6);
+	unixL_pushunsigned(L, ch->stats.sent);
+	lua_setfield(L, -2, "sent");
+	unixL_pushunsigned(L, ch->stats.received);
+	lua_setfield(L, -2, "received");
+	unixL_pushunsigned(L, ch->stats.bytes);
+	lua_setfield(L, -2, "bytes");
+	unixL_pushunsigned(L, ch->stats.writes);
+	lua_setfield(L, -2, "writes");
+	unixL_pushunsigned(L, ch->stats.reads);
+	lua_setfield(L, -2, "reads");
+	unixL_pushsize(L, ch->end - ch->pos);
+	lua_setfield(L, -2, "buffered");
+
+	return 1;
+} /* ch_stats() */
+
+/*
+ * close([which]), where which is "r" or "w" to close only the read or
+ * write end, as the parent and child each do after fork.
+ */
+static int ch_close(lua_State *L) {
+	static const char *const opts[] = { "rw", "r", "w", NULL };
+	struct channel *ch = ch_checkself(L, 1);
+	int which = luaL_checkoption(L, 2, "rw", opts);
+	int i, error = 0, _error;
+
+	for (i = 0; i < 2; i++) {
+		if (which && which != i + 1)
+			continue;
+
+		if (ch->fd[i] != -1) {
+			if ((_error = u_close_nocancel(ch->fd[i])) && !error)
+				error = _error;
+			ch->fd[i] = -1;
+		}
+	}
+
+	if (ch->fd[0] == -1) {
+		free(ch->buf);
+		ch->buf = NULL;
+		ch->bufsiz = 0;
+		ch->pos = 0;
+		ch->end = 0;
+	}
+
+	if (error)
+		return unixL_pusherror(L, error, "close", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* ch_close() */
+
+static int ch__gc(lua_State *L) {
+	struct channel *ch = ch_checkself(L, 1);
+
+	u_close(&ch->fd[0]);
+	u_close(&ch->fd[1]);
+	free(ch->buf);
+	ch->buf = NULL;
+
+	return 0;
+} /* ch__gc() */
+
+static const luaL_Reg ch_methods[] = {
+	{ "send",   &ch_send },
+	{ "recv",   &ch_recv },
+	{ "fileno", &ch_fileno },
+	{ "size",   &ch_size },
+	{ "stats",  &ch_stats },
+	{ "close",  &ch_close },
+	{ NULL,     NULL },
+}; /* ch_methods[] */
+
+static const luaL_Reg ch_metamethods[] = {
+	{ "__gc", &ch__gc },
+	{ NULL,   NULL },
+}; /* ch_metamethods[] */
+
+static int unix_channel(lua_State *L) {
+	struct channel *ch;
+	size_t size = 0;
+	int error;
+
+	lua_settop(L, 1);
 
+	ch = lua_newuserdata(L, sizeof *ch);
+	memset(ch, 0, sizeof *ch);
+	ch->fd[0] = -1;
+	ch->fd[1] = -1;
+	luaL_setmetatable(L, "struct channel");
 
-static int unix_pipe(lua_State *L) {
-	int fd[2] = { -1, -1 }, error;
-	u_flags_t flags;
-	const char *mode;
+	if (!lua_isnil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
 
-	lua_settop(L, 1);
-	unixL_checkflags(L, 1, &mode, &flags, NULL);
+		lua_getfield(L, 1, "size");
+		size = unixL_optsize(L, -1, 0);
+		lua_pop(L, 1);
 
-	if ((error = u_pipe(fd, flags)))
-		goto error;
+		lua_getfield(L, 1, "atomic");
+		ch->atomic = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
 
-	lua_pushinteger(L, fd[0]);
-	lua_pushinteger(L, fd[1]);
+	if ((error = u_pipe(ch->fd, U_CLOEXEC)))
+		return unixL_pusherror(L, error, "channel", "~$#");
 
-	return 2;
-error:
-	u_close(&fd[0]);
-	u_close(&fd[1]);
+	if (size > 0 && (error = u_setpipesz(ch->fd[1], size)))
+		return unixL_pusherror(L, error, "channel", "~$#");
 
-	return unixL_pusherror(L, error, "pipe", "~$#");
-} /* unix_pipe() */
+	return 1;
+} /* unix_channel() */
 
 
 static u_error_t poll_add(unixL_State *U, int fd, short events, size_t *nfds, size_t *mfds) {
@@ -8793,6 +12960,255 @@ static int unix_read(lua_State *L) {
 } /* unix_read() */
 
 
+/*
+ * Sequential reader which keeps posix_fadvise(WILLNEED) a window ahead of
+ * the read offset and DONTNEED a window behind it, so that streaming a
+ * large file neither stalls on each chunk nor evicts the page cache.
+ */
+struct reader {
+	int fd;
+	_Bool owned; /* opened from a path; close on __gc */
+	_Bool dontneed;
+	size_t chunk, window, pagesize;
+	off_t offset;  /* next pread */
+	off_t advised; /* end of WILLNEED region */
+	off_t dropped; /* start of region not yet DONTNEED; page aligned */
+	struct timeval start;
+	struct {
+		unsigned long long bytes, reads, willneed, dontneed;
+		double wait;
+	} stats;
+}; /* struct reader */
+
+static struct reader *rd_checkself(lua_State *L, int index) {
+	struct reader *rd = luaL_checkudata(L, index, "struct reader");
+
+	luaL_argcheck(L, rd->fd != -1, index, "attempt to use a closed reader");
+
+	return rd;
+} /* rd_checkself() */
+
+static void rd_reset(struct reader *rd, off_t offset) {
+	rd->offset = offset;
+	rd->advised = offset;
+	rd->dropped = offset - (offset % rd->pagesize);
+} /* rd_reset() */
+
+static void rd_advise(struct reader *rd) {
+#if HAVE_POSIX_FADVISE
+	off_t end;
+
+	/* top up in half-window steps to amortize the syscall */
+	if (rd->advised - rd->offset <= (off_t)(rd->window / 2)) {
+		end = rd->offset + rd->window;
+
+		if (0 == posix_fadvise(rd->fd, rd->advised, end - rd->advised, POSIX_FADV_WILLNEED))
+			rd->stats.willneed += end - rd->advised;
+
+		rd->advised = end;
+	}
+
+	/* only whole pages are dropped, so keep the boundary page aligned */
+	if (rd->dontneed && rd->offset - rd->dropped >= (off_t)rd->window) {
+		end = rd->offset - (rd->offset % rd->pagesize);
+
+		if (0 == posix_fadvise(rd->fd, rd->dropped, end - rd->dropped, POSIX_FADV_DONTNEED))
+			rd->stats.dontneed += end - rd->dropped;
+
+		rd->dropped = end;
+	}
+#else
+	(void)rd;
+#endif
+} /* rd_advise() */
+
+static int rd_read(lua_State *L) {
+	unixL_State *U = unixL_getstate(L);
+	struct reader *rd = rd_checkself(L, 1);
+	struct timeval t0, t1;
+	ssize_t n;
+	int error;
+
+	if (U->bufsiz < rd->chunk && (error = u_realloc(&U->buf, &U->bufsiz, rd->chunk)))
+		return unixL_pusherror(L, error, "read", "~$#");
+
+	rd_advise(rd);
+
+	gettimeofday(&t0, NULL);
+	n = pread(rd->fd, U->buf, rd->chunk, rd->offset);
+	gettimeofday(&t1, NULL);
+
+	if (n == -1)
+		return unixL_pusherror(L, errno, "read", "~$#");
+
+	rd->stats.wait += u_tv2f(&t1) - u_tv2f(&t0);
+	rd->stats.reads++;
+
+	if (n == 0)
+		return 0;
+
+	rd->offset += n;
+	rd->stats.bytes += n;
+
+	lua_pushlstring(L, U->buf, n);
+
+	return 1;
+} /* rd_read() */
+
+static int rd_seek(lua_State *L) {
+	struct reader *rd = rd_checkself(L, 1);
+	off_t offset = unixL_checkoff(L, 2);
+
+	luaL_argcheck(L, offset >= 0, 2, "negative offset");
+
+	rd_reset(rd, offset);
+
+	lua_pushvalue(L, 1);
+
+	return 1;
+} /* rd_seek() */
+
+static int rd_tell(lua_State *L) {
+	struct reader *rd = rd_checkself(L, 1);
+
+	unixL_pushoff(L, rd->offset);
+
+	return 1;
+} /* rd_tell() */
+
+static int rd_stats(lua_State *L) {
+	struct reader *rd = luaL_checkudata(L, 1, "struct reader");
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	lua_createtable(L, 0, 6);
+	unixL_pushunsigned(L, rd->stats.bytes);
+	lua_setfield(L, -2, "bytes");
+	unixL_pushunsigned(L, rd->stats.reads);
+	lua_setfield(L, -2, "reads");
+	unixL_pushunsigned(L, rd->stats.willneed);
+	lua_setfield(L, -2, "willneed");
+	unixL_pushunsigned(L, rd->stats.dontneed);
+	lua_setfield(L, -2, "dontneed");
+	lua_pushnumber(L, rd->stats.wait);
+	lua_setfield(L, -2, "wait");
+	lua_pushnumber(L, u_tv2f(&now) - u_tv2f(&rd->start));
+	lua_setfield(L, -2, "elapsed");
+
+	return 1;
+} /* rd_stats() */
+
+static int rd_close(lua_State *L) {
+	struct reader *rd = luaL_checkudata(L, 1, "struct reader");
+	int error = 0;
+
+	if (rd->fd != -1) {
+#if HAVE_POSIX_FADVISE
+		if (rd->dontneed && rd->offset > rd->dropped)
+			posix_fadvise(rd->fd, rd->dropped, rd->offset - rd->dropped, POSIX_FADV_DONTNEED);
+#endif
+		/* u_close preserves errno rather than reporting failure */
+		if (rd->owned)
+			error = u_close_nocancel(rd->fd);
+
+		rd->fd = -1;
+	}
+
+	if (error)
+		return unixL_pusherror(L, error, "close", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* rd_close() */
+
+static int rd__gc(lua_State *L) {
+	struct reader *rd = luaL_checkudata(L, 1, "struct reader");
+
+	if (rd->owned)
+		u_close(&rd->fd);
+
+	rd->fd = -1;
+
+	return 0;
+} /* rd__gc() */
+
+static const luaL_Reg rd_methods[] = {
+	{ "read",  &rd_read },
+	{ "seek",  &rd_seek },
+	{ "tell",  &rd_tell },
+	{ "stats", &rd_stats },
+	{ "close", &rd_close },
+	{ NULL,    NULL },
+}; /* rd_methods[] */
+
+static const luaL_Reg rd_metamethods[] = {
+	{ "__gc", &rd__gc },
+	{ NULL,   NULL },
+}; /* rd_metamethods[] */
+
+static int unix_reader(lua_State *L) {
+	struct reader *rd;
+	long pagesize;
+	int error;
+
+	lua_settop(L, 2);
+
+	rd = lua_newuserdata(L, sizeof *rd);
+	memset(rd, 0, sizeof *rd);
+	rd->fd = -1;
+	rd->dontneed = 1;
+	rd->chunk = 1 << 17;
+	luaL_setmetatable(L, "struct reader");
+
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+
+		lua_getfield(L, 2, "chunk");
+		rd->chunk = unixL_optsize(L, -1, rd->chunk);
+		luaL_argcheck(L, rd->chunk > 0, 2, "chunk size must be positive");
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "window");
+		rd->window = unixL_optsize(L, -1, 0);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "dontneed");
+		if (!lua_isnil(L, -1))
+			rd->dontneed = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+
+	if (rd->window < rd->chunk)
+		rd->window = (rd->window)? rd->chunk : 16 * rd->chunk;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	rd->pagesize = (pagesize > 0)? (size_t)pagesize : 4096;
+
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		if ((error = u_open(&rd->fd, lua_tostring(L, 1), O_RDONLY|U_CLOEXEC, 0)))
+			return unixL_pusherror(L, error, "reader", "~$#");
+
+		rd->owned = 1;
+		rd_reset(rd, 0);
+	} else {
+		rd->fd = unixL_checkfileno(L, 1);
+		rd_reset(rd, 0);
+
+		/* keep a FILE, DIR, or fd handle from closing the descriptor */
+		if (lua_type(L, 1) == LUA_TUSERDATA) {
+			lua_pushvalue(L, 1);
+			unixL_anchor(L, -2, "handle");
+		}
+	}
+
+	gettimeofday(&rd->start, NULL);
+
+	return 1;
+} /* unix_reader() */
+
+
 static int unix_readdir(lua_State *L) {
 	return dir_read(L);
 } /* unix_readdir() */
@@ -8873,13 +13289,27 @@ static int unsafe_reallocarray(lua_State *L) {
 
 static int unix_realpath(lua_State *L) {
 	unixL_State *U = unixL_getstate(L);
+	const char *src = luaL_checkstring(L, 1), *real;
 	char *path;
-	size_t len;
+	size_t hash = 0, len;
 	int error;
 
-	if (!(path = realpath(luaL_checkstring(L, 1), NULL)))
+	/* relative paths depend on the working directory, so aren't cached */
+	if (U->rpcache.max > 0 && *src == '/') {
+		hash = rpcache_hash(src);
+
+		if ((real = rpcache_lookup(U, src, hash))) {
+			lua_pushstring(L, real);
+			return 1;
+		}
+	}
+
+	if (!(path = realpath(src, NULL)))
 		return unixL_pusherror(L, errno, "realpath", "~$#");
 
+	if (U->rpcache.max > 0 && *src == '/')
+		rpcache_insert(U, src, hash, path);
+
 	len = 0; // cursor argument will be updated to the passed strlen
 	error = u_appends(&U->buf, &U->bufsiz, &len, path, strlen(path));
 	free(path);
@@ -8891,6 +13321,30 @@ static int unix_realpath(lua_State *L) {
 } /* unix_realpath() */
 
 
+static int unix_realpathcache(lua_State *L) {
+	unixL_State *U = unixL_getstate(L);
+	int error;
+
+	if (!lua_isnoneornil(L, 1)) {
+		if ((error = rpcache_setmax(U, unixL_checkinteger(L, 1, 0, 1 << 20))))
+			return luaL_error(L, "realpathcache: %s", unixL_strerror(L, error));
+	}
+
+	if (!lua_isnoneornil(L, 2))
+		U->rpcache.strict = lua_toboolean(L, 2);
+
+	if (lua_toboolean(L, 3))
+		U->rpcache.gen++;
+
+	unixL_pushsize(L, U->rpcache.count);
+	unixL_pushunsigned(L, U->rpcache.hits);
+	unixL_pushunsigned(L, U->rpcache.misses);
+	unixL_pushunsigned(L, U->rpcache.gen);
+
+	return 4;
+} /* unix_realpathcache() */
+
+
 static int unix_recv(lua_State *L) {
 	unixL_State *U = unixL_getstate(L);
 	int fd = unixL_checkfileno(L, 1);
@@ -8931,39 +13385,242 @@ static int unix_recvfrom(lua_State *L) {
 
 	lua_pushlstring(L, U->buf, n);
 
-	/* TODO: What if our buffer is too small? */
-	ud = lua_newuserdata(L, fromlen);
-	memcpy(ud, &from, MIN(fromlen, sizeof from));
-	luaL_setmetatable(L, "struct sockaddr");
+	/* TODO: What if our buffer is too small? */
+	ud = lua_newuserdata(L, fromlen);
+	memcpy(ud, &from, MIN(fromlen, sizeof from));
+	luaL_setmetatable(L, "struct sockaddr");
+
+	return 2;
+} /* unix_recvfrom() */
+
+
+static int unix_recvfromto(lua_State *L) {
+	unixL_State *U = unixL_getstate(L);
+	int fd = unixL_checkfileno(L, 1);
+	size_t size = unixL_checksize(L, 2);
+	int flags = unixL_optinteger(L, 3, 0, 0, INT_MAX);
+	struct sockaddr_storage from, to;
+	size_t fromlen, tolen;
+	ssize_t n;
+	int error;
+
+	if (U->bufsiz < size && ((error = u_realloc(&U->buf, &U->bufsiz, size))))
+		return unixL_pusherror(L, error, "recvfromto", "~$#");
+
+	fromlen = sizeof from;
+	tolen = sizeof to;
+	if (-1 == (n = u_recvfromto(fd, U->buf, size, flags, (struct sockaddr *)&from, &fromlen, (struct sockaddr *)&to, &tolen, &error)))
+		return unixL_pusherror(L, error, "recvfromto", "~$#");
+
+	lua_pushlstring(L, U->buf, n);
+	unixL_newsockaddr(L, &from, fromlen);
+	unixL_newsockaddr(L, &to, tolen);
+
+	return 3;
+} /* unix_recvfromto() */
+
+
+/*
+ * Descriptor passing over AF_UNIX sockets. Credentials use the Linux
+ * SCM_CREDENTIALS interface; other systems' variants differ too much in
+ * who must send what to be worth emulating.
+ */
+#define MSG_MAXFDS_DEFAULT 64
+
+static int msg_pushdata(lua_State *L) {
+	lua_pushlstring(L, lua_touserdata(L, 1), (size_t)lua_tointeger(L, 2));
+
+	return 1;
+} /* msg_pushdata() */
+
+static void msg_closefds(struct msghdr *msg) {
+	struct cmsghdr *cmsg;
+	size_t count, i;
+	int rfd;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+
+		for (i = 0; i < count; i++) {
+			memcpy(&rfd, (char *)CMSG_DATA(cmsg) + i * sizeof rfd, sizeof rfd);
+			u_close(&rfd);
+		}
+	}
+} /* msg_closefds() */
+
+static int unix_recvmsg(lua_State *L) {
+	unixL_State *U = unixL_getstate(L);
+	int fd = unixL_checkfileno(L, 1);
+	size_t size = unixL_checksize(L, 2);
+	int flags = unixL_optinteger(L, 3, 0, 0, INT_MAX);
+	size_t maxfds = MSG_MAXFDS_DEFAULT, ctlsiz, nfds = 0, i;
+	_Bool cloexec = 1, cred = 0, passcred = 0, gotcred = 0;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	void *ctl;
+	ssize_t n;
+	int error;
+
+	lua_settop(L, 4);
+
+	if (!lua_isnil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+
+		lua_getfield(L, 4, "maxfds");
+		maxfds = unixL_optsize(L, -1, maxfds);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 4, "cloexec");
+		cloexec = lua_isnil(L, -1) || lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 4, "cred");
+		cred = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+
+	luaL_argcheck(L, maxfds <= INT_MAX / sizeof (int), 4, "too many descriptors");
+
+	if (U->bufsiz < size && ((error = u_realloc(&U->buf, &U->bufsiz, size))))
+		return unixL_pusherror(L, error, "recvmsg", "~$#");
+
+	ctlsiz = (maxfds)? CMSG_SPACE(maxfds * sizeof (int)) : 0;
+#if defined SCM_CREDENTIALS
+	if (cred) {
+		/* left enabled, as the kernel only attaches credentials while it's set */
+		if (0 != setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &(int){ 1 }, sizeof (int)))
+			return unixL_pusherror(L, errno, "recvmsg", "~$#");
+
+		passcred = 1;
+	} else {
+		int on = 0;
+		socklen_t onlen = sizeof on;
+
+		passcred = 0 == getsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, &onlen) && on;
+	}
+
+	/* once SO_PASSCRED is set the kernel places credentials first */
+	if (passcred)
+		ctlsiz += CMSG_SPACE(sizeof (struct ucred));
+#else
+	if (cred)
+		return unixL_pusherror(L, ENOTSUP, "recvmsg", "~$#");
+#endif
+
+	/* userdata is suitably aligned for struct cmsghdr */
+	ctl = lua_newuserdata(L, MAX(ctlsiz, 1));
+	memset(ctl, 0, ctlsiz);
+
+	/*
+	 * Allocate everything the results need before receiving, so a memory
+	 * error can't leak the descriptors. Only the data string is created
+	 * afterwards, in protected mode.
+	 */
+	lua_pushcfunction(L, &msg_pushdata);
+	lua_createtable(L, (int)maxfds, 0);
+
+	if (passcred) {
+		lua_createtable(L, 0, 3);
+		lua_pushinteger(L, 0);
+		lua_setfield(L, -2, "pid");
+		lua_pushinteger(L, 0);
+		lua_setfield(L, -2, "uid");
+		lua_pushinteger(L, 0);
+		lua_setfield(L, -2, "gid");
+	} else {
+		lua_pushnil(L);
+	}
+
+	luaL_checkstack(L, 4, "recvmsg");
+
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = U->buf;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = (ctlsiz)? ctl : NULL;
+	msg.msg_controllen = ctlsiz;
+
+#if defined MSG_CMSG_CLOEXEC
+	if (cloexec)
+		flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+	if (-1 == (n = recvmsg(fd, &msg, flags)))
+		return unixL_pusherror(L, errno, "recvmsg", "~$#");
+
+#if defined MSG_CMSG_CLOEXEC
+	/* Linux echoes this back */
+	msg.msg_flags &= ~MSG_CMSG_CLOEXEC;
+#endif
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		if (cmsg->cmsg_type == SCM_RIGHTS) {
+			size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+			int rfd;
+
+			for (i = 0; i < count; i++) {
+				memcpy(&rfd, (char *)CMSG_DATA(cmsg) + i * sizeof rfd, sizeof rfd);
+
+				/* CMSG_SPACE padding can fit more than maxfds */
+				if (nfds >= maxfds) {
+					u_close(&rfd);
+					memcpy((char *)CMSG_DATA(cmsg) + i * sizeof rfd, &rfd, sizeof rfd);
+					msg.msg_flags |= MSG_CTRUNC;
+
+					continue;
+				}
+#if !defined MSG_CMSG_CLOEXEC
+				if (cloexec)
+					(void)u_setflag(rfd, U_CLOEXEC, 1);
+#endif
+				lua_pushinteger(L, rfd);
+				lua_rawseti(L, -3, ++nfds);
+			}
+#if defined SCM_CREDENTIALS
+		} else if (passcred && cmsg->cmsg_type == SCM_CREDENTIALS && cmsg->cmsg_len >= CMSG_LEN(sizeof (struct ucred))) {
+			struct ucred uc;
+
+			memcpy(&uc, CMSG_DATA(cmsg), sizeof uc);
 
-	return 2;
-} /* unix_recvfrom() */
+			lua_pushinteger(L, uc.pid);
+			lua_setfield(L, -2, "pid");
+			unixL_pushinteger(L, uc.uid);
+			lua_setfield(L, -2, "uid");
+			unixL_pushinteger(L, uc.gid);
+			lua_setfield(L, -2, "gid");
+			gotcred = 1;
+#endif
+		}
+	}
 
+	if (!gotcred) {
+		lua_pushnil(L);
+		lua_replace(L, -2);
+	}
 
-static int unix_recvfromto(lua_State *L) {
-	unixL_State *U = unixL_getstate(L);
-	int fd = unixL_checkfileno(L, 1);
-	size_t size = unixL_checksize(L, 2);
-	int flags = unixL_optinteger(L, 3, 0, 0, INT_MAX);
-	struct sockaddr_storage from, to;
-	size_t fromlen, tolen;
-	ssize_t n;
-	int error;
+	lua_pushvalue(L, -3);
+	lua_pushlightuserdata(L, U->buf);
+	lua_pushinteger(L, n);
 
-	if (U->bufsiz < size && ((error = u_realloc(&U->buf, &U->bufsiz, size))))
-		return unixL_pusherror(L, error, "recvfromto", "~$#");
+	if (0 != lua_pcall(L, 2, 1, 0)) {
+		msg_closefds(&msg);
 
-	fromlen = sizeof from;
-	tolen = sizeof to;
-	if (-1 == (n = u_recvfromto(fd, U->buf, size, flags, (struct sockaddr *)&from, &fromlen, (struct sockaddr *)&to, &tolen, &error)))
-		return unixL_pusherror(L, error, "recvfromto", "~$#");
+		return unixL_pusherror(L, ENOMEM, "recvmsg", "~$#");
+	}
 
-	lua_pushlstring(L, U->buf, n);
-	unixL_newsockaddr(L, &from, fromlen);
-	unixL_newsockaddr(L, &to, tolen);
+	lua_replace(L, -4);
+	lua_pushinteger(L, msg.msg_flags);
 
-	return 3;
-} /* unix_recvfromto() */
+	return 4;
+} /* unix_recvmsg() */
 
 static int sa__index_in(lua_State *L, const struct sockaddr_in *in, const char *k) {
 	if (!strcmp(k, "addr")) {
@@ -9473,33 +14130,449 @@ static int unix_rmdir(lua_State *L) {
 } /* unix_rmdir() */
 
 
-static int unix_shutdown(lua_State *L) {
-	int fd = unixL_checkfileno(L, 1);
-	int how = unixL_checkint(L, 2);
+#if HAVE_UNLINKAT && HAVE_FDOPENDIR
+/*
+ * Never follow a symbolic link when descending. O_NOFOLLOW only protects
+ * the final component, but every openat is relative to the parent so
+ * that's the only component there is.
+ */
+#define RMTREE_OFLAGS (O_RDONLY|O_DIRECTORY|O_NOFOLLOW|U_CLOEXEC)
+
+/*
+ * The walk is iterative and holds a single open directory at a time, so
+ * depth isn't limited by the descriptor limit. Each level records the
+ * identity and name of the directory it descended into; returning to the
+ * parent opens ".." and checks it's still the directory we came from.
+ */
+struct rmtree {
+	struct {
+		dev_t dev;
+		ino_t ino;
+		char *name; /* entry in the parent */
+	} *level;
+	size_t nlevel, depth;
+	dev_t dev; /* root */
+	ino_t ino;
+
+	struct dirent *ent;
+	size_t entsiz;
+
+	unixL_Unsigned *count;
+}; /* struct rmtree */
+
+static u_error_t rmtree_opendir(struct rmtree *rt, DIR **dp, int *fd) {
+	long namemax;
+	size_t size;
+	int error;
+
+	if (-1 == (namemax = fpathconf(*fd, _PC_NAME_MAX)))
+		namemax = NAME_MAX;
+
+	size = sizeof *rt->ent + namemax + 1;
+
+	if (rt->entsiz < size) {
+		if ((error = u_realloc((char **)&rt->ent, &rt->entsiz, size)))
+			return error;
+	}
+
+	/* descriptor is already close-on-exec, so skip u_fdopendir */
+	if (!(*dp = fdopendir(*fd)))
+		return errno;
+
+	*fd = -1;
+
+	return 0;
+} /* rmtree_opendir() */
+
+/* unlink a non-directory, with isdir set if it turns out to be one */
+static u_error_t rmtree_unlink(struct rmtree *rt, int at, const char *name, _Bool *isdir) {
+	if (0 == unlinkat(at, name, 0)) {
+		++*rt->count;
+		return 0;
+	} else if (errno == ENOENT) {
+		return 0;
+	} else if (errno == EISDIR || errno == EPERM) {
+		/* replaced with a directory after we looked, or DT_UNKNOWN */
+		*isdir = 1;
+		return 0;
+	}
+
+	return errno;
+} /* rmtree_unlink() */
+
+/* descend into the subdirectory name of *dp, replacing *dp */
+static u_error_t rmtree_descend(struct rmtree *rt, DIR **dp, const char *name) {
+	struct stat st;
+	char *copy = NULL;
+	int fd = -1, error;
+
+	if ((error = u_openat(&fd, dirfd(*dp), name, RMTREE_OFLAGS, 0))) {
+		if (error == ENOENT)
+			return 0;
+
+		if (error != ENOTDIR && error != ELOOP)
+			return error;
+
+		/* replaced with a file or symbolic link; retry as file */
+		if (0 == unlinkat(dirfd(*dp), name, 0))
+			++*rt->count;
+		else if (errno != ENOENT)
+			return errno;
+
+		return 0;
+	}
+
+	if (0 != fstat(fd, &st))
+		goto syerr;
+
+	if (!(copy = strdup(name)))
+		goto syerr;
+
+	if (rt->depth >= rt->nlevel) {
+		size_t n = MAX(8, rt->nlevel * 2);
+		void *p;
+
+		if (!(p = realloc(rt->level, n * sizeof *rt->level)))
+			goto syerr;
+
+		rt->level = p;
+		rt->nlevel = n;
+	}
+
+	closedir(*dp);
+	*dp = NULL;
+
+	rt->level[rt->depth].dev = st.st_dev;
+	rt->level[rt->depth].ino = st.st_ino;
+	rt->level[rt->depth].name = copy;
+	rt->depth++;
+
+	if ((error = rmtree_opendir(rt, dp, &fd)))
+		u_close(&fd);
+
+	return error;
+syerr:
+	error = errno;
+	free(copy);
+	u_close(&fd);
+
+	return error;
+} /* rmtree_descend() */
+
+/* return from the emptied directory *dp to its parent and remove it */
+static u_error_t rmtree_ascend(struct rmtree *rt, DIR **dp) {
+	struct stat st;
+	int fd = -1, error;
+	size_t i = rt->depth - 1;
+
+	if ((error = u_openat(&fd, dirfd(*dp), "..", RMTREE_OFLAGS & ~O_NOFOLLOW, 0)))
+		return error;
+
+	if (0 != fstat(fd, &st))
+		goto syerr;
+
+	/* parent must be the directory we descended from */
+	if ((i > 0)
+	?   (st.st_dev != rt->level[i - 1].dev || st.st_ino != rt->level[i - 1].ino)
+	:   (st.st_dev != rt->dev || st.st_ino != rt->ino)) {
+		error = ESTALE;
+		goto error;
+	}
+
+	closedir(*dp);
+	*dp = NULL;
+
+	if (0 == unlinkat(fd, rt->level[i].name, AT_REMOVEDIR)) {
+		++*rt->count;
+	} else if (errno != ENOENT) {
+		goto syerr;
+	}
+
+	free(rt->level[i].name);
+	rt->level[i].name = NULL;
+	rt->depth--;
+
+	/* rescanning only finds entries not yet removed */
+	if ((error = rmtree_opendir(rt, dp, &fd)))
+		u_close(&fd);
+
+	return error;
+syerr:
+	error = errno;
+error:
+	u_close(&fd);
+
+	return error;
+} /* rmtree_ascend() */
+
+/* remove the contents of the directory fd, taking ownership of fd */
+static u_error_t rmtree_walk(int fd, unixL_Unsigned *count) {
+	struct rmtree rt = { .count = count };
+	struct dirent *res;
+	struct stat st;
+	DIR *dp = NULL;
+	_Bool isdir;
+	int error;
+
+	if (0 != fstat(fd, &st))
+		goto syerr;
+
+	rt.dev = st.st_dev;
+	rt.ino = st.st_ino;
+
+	if ((error = rmtree_opendir(&rt, &dp, &fd)))
+		goto error;
+
+	for (;;) {
+		if ((error = u_readdir_r(dp, rt.ent, &res)))
+			goto error;
+
+		if (!res) {
+			if (rt.depth == 0)
+				break;
+
+			if ((error = rmtree_ascend(&rt, &dp)))
+				goto error;
+
+			continue;
+		}
+
+		if (!strcmp(res->d_name, ".") || !strcmp(res->d_name, ".."))
+			continue;
+
+#if defined DT_DIR && defined DT_UNKNOWN
+		if (res->d_type == DT_UNKNOWN) {
+			if (0 != fstatat(dirfd(dp), res->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+				if (errno == ENOENT)
+					continue;
+				goto syerr;
+			}
+
+			isdir = S_ISDIR(st.st_mode);
+		} else {
+			isdir = (res->d_type == DT_DIR);
+		}
+#else
+		isdir = 0;
+#endif
+
+		if (!isdir && (error = rmtree_unlink(&rt, dirfd(dp), res->d_name, &isdir)))
+			goto error;
+
+		if (isdir && (error = rmtree_descend(&rt, &dp, res->d_name)))
+			goto error;
+	}
+
+	error = 0;
+	goto error;
+syerr:
+	error = errno;
+error:
+	if (dp)
+		closedir(dp);
+	u_close(&fd);
+
+	while (rt.depth > 0)
+		free(rt.level[--rt.depth].name);
+	free(rt.level);
+	free(rt.ent);
+
+	return error;
+} /* rmtree_walk() */
+
+/*
+ * rmtree(path|file|dir|fd[, opts])
+ *
+ * Remove a directory hierarchy without following symbolic links. Given a
+ * descriptor only the directory's contents are removed.
+ */
+static int unix_rmtree(lua_State *L) {
+	unixL_Unsigned count = 0;
+	_Bool keep = 0;
+	int fd = -1, error;
+
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "keep");
+		keep = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		const char *path = lua_tostring(L, 1);
+		struct stat st;
+
+		if (0 != lstat(path, &st))
+			goto syerr;
+
+		if (!S_ISDIR(st.st_mode)) {
+			if (keep) {
+				error = ENOTDIR;
+				goto error;
+			}
+
+			if (0 != unlink(path))
+				goto syerr;
+
+			count++;
+		} else {
+			if ((error = u_open(&fd, path, RMTREE_OFLAGS, 0)))
+				goto error;
+
+			if ((error = rmtree_walk(fd, &count)))
+				goto error;
+
+			if (!keep) {
+				if (0 != rmdir(path))
+					goto syerr;
+
+				count++;
+			}
+		}
+	} else {
+		/* new open file description so we don't move the caller's cursor */
+		if ((error = u_openat(&fd, unixL_checkfileno(L, 1), ".", RMTREE_OFLAGS, 0)))
+			goto error;
+
+		if ((error = rmtree_walk(fd, &count)))
+			goto error;
+	}
+
+	unixL_pushunsigned(L, count);
+
+	return 1;
+syerr:
+	error = errno;
+error:
+	return unixL_pusherror(L, error, "rmtree", "0$#");
+} /* unix_rmtree() */
+#endif
+
+
+static int unix_shutdown(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+	int how = unixL_checkint(L, 2);
+
+	if (0 != shutdown(fd, how))
+		return unixL_pusherror(L, errno, "shutdown", "~$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_shutdown() */
+
+
+static int unix_send(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+	size_t size;
+	const char *src = luaL_checklstring(L, 2, &size);
+	int flags = unixL_optinteger(L, 3, 0, 0, INT_MAX);
+	ssize_t n;
+
+	if (-1 == (n = send(fd, src, size, flags)))
+		return unixL_pusherror(L, errno, "send", "~$#");
+
+	unixL_pushsize(L, n);
+
+	return 1;
+} /* unix_send() */
+
+
+static int unix_sendmsg(lua_State *L) {
+	int fd = unixL_checkfileno(L, 1);
+	size_t size;
+	const char *src = luaL_checklstring(L, 2, &size);
+	int flags = unixL_optinteger(L, 3, 0, 0, INT_MAX);
+	size_t nfds = 0, ctlsiz = 0, i;
+	_Bool cred = 0;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	void *ctl;
+	ssize_t n;
+
+	lua_settop(L, 4);
+
+	if (!lua_isnil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+
+		lua_getfield(L, 4, "cred");
+		cred = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 4, "fds");
+		if (!lua_isnil(L, -1)) {
+			luaL_checktype(L, -1, LUA_TTABLE);
+			nfds = lua_rawlen(L, -1);
+		}
+		lua_replace(L, 4);
+	}
+
+	luaL_argcheck(L, nfds <= INT_MAX / sizeof (int), 4, "too many descriptors");
+
+	if (nfds > 0)
+		ctlsiz += CMSG_SPACE(nfds * sizeof (int));
+#if defined SCM_CREDENTIALS
+	if (cred)
+		ctlsiz += CMSG_SPACE(sizeof (struct ucred));
+#else
+	if (cred)
+		return unixL_pusherror(L, ENOTSUP, "sendmsg", "~$#");
+#endif
+
+	ctl = lua_newuserdata(L, MAX(ctlsiz, 1));
+	memset(ctl, 0, ctlsiz);
+
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = (void *)src;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = (ctlsiz)? ctl : NULL;
+	msg.msg_controllen = ctlsiz;
+
+	cmsg = (ctlsiz)? CMSG_FIRSTHDR(&msg) : NULL;
+
+	if (nfds > 0) {
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof (int));
+
+		/* descriptors, FILE handles, or DIR handles */
+		for (i = 0; i < nfds; i++) {
+			int sfd;
 
-	if (0 != shutdown(fd, how))
-		return unixL_pusherror(L, errno, "shutdown", "~$#");
+			lua_rawgeti(L, 4, i + 1);
+			sfd = unixL_optfileno(L, -1, -1);
+			lua_pop(L, 1);
 
-	lua_pushboolean(L, 1);
+			if (sfd < 0)
+				return luaL_argerror(L, 4, lua_pushfstring(L, "fds[%d]: no file descriptor specified", (int)i + 1));
 
-	return 1;
-} /* unix_shutdown() */
+			memcpy((char *)CMSG_DATA(cmsg) + i * sizeof sfd, &sfd, sizeof sfd);
+		}
 
+		cmsg = CMSG_NXTHDR(&msg, cmsg);
+	}
 
-static int unix_send(lua_State *L) {
-	int fd = unixL_checkfileno(L, 1);
-	size_t size;
-	const char *src = luaL_checklstring(L, 2, &size);
-	int flags = unixL_optinteger(L, 3, 0, 0, INT_MAX);
-	ssize_t n;
+#if defined SCM_CREDENTIALS
+	if (cred) {
+		struct ucred uc = { getpid(), geteuid(), getegid() };
 
-	if (-1 == (n = send(fd, src, size, flags)))
-		return unixL_pusherror(L, errno, "send", "~$#");
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_CREDENTIALS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof uc);
+		memcpy(CMSG_DATA(cmsg), &uc, sizeof uc);
+	}
+#endif
+
+	if (-1 == (n = sendmsg(fd, &msg, flags)))
+		return unixL_pusherror(L, errno, "sendmsg", "~$#");
 
 	unixL_pushsize(L, n);
 
 	return 1;
-} /* unix_send() */
+} /* unix_sendmsg() */
 
 
 static int unix_sendto(lua_State *L) {
@@ -9771,6 +14844,25 @@ static int unix_setuid(lua_State *L) {
 } /* unix_setuid() */
 
 
+static int unix_setvbuf(lua_State *L) {
+	int mode;
+	size_t size;
+	int error;
+
+	lua_settop(L, 3);
+	unixL_checkfile(L, 1);
+	luaL_checkany(L, 2);
+	unixL_optvbuf(L, 2, &mode, &size);
+
+	if ((error = unixL_setvbuf(L, 1, mode, size)))
+		return unixL_pusherror(L, error, "setvbuf", "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* unix_setvbuf() */
+
+
 static int unix_sigaction(lua_State *L) {
 	int signo = luaL_checkint(L, 1);
 	struct sigaction act, oact;
@@ -9878,78 +14970,537 @@ static int unix_sigismember(lua_State *L) {
 } /* unix_sigismember() */
 
 
-static int unix_sigprocmask(lua_State *L) {
-	int how = luaL_optint(L, 1, SIG_BLOCK);
-	sigset_t tmp, *set, *oset;
+static int unix_sigprocmask(lua_State *L) {
+	int how = luaL_optint(L, 1, SIG_BLOCK);
+	sigset_t tmp, *set, *oset;
+
+	lua_settop(L, 3);
+
+	set = (!lua_isnil(L, 2))? unixL_tosigset(L, 2, &tmp) : NULL;
+	oset = unixL_tosigset(L, 3, NULL);
+
+	sigemptyset(oset);
+
+	if (0 != sigprocmask(how, set, oset))
+		return unixL_pusherror(L, errno, "sigprocmask", "~$#");
+
+	return 1; /* returns oset */
+} /* unix_sigprocmask() */
+
+
+static int unix_sigtimedwait(lua_State *L) {
+	sigset_t tmp, *set;
+	struct timespec timeout;
+	siginfo_t si;
+	int signo, error;
+
+	if (lua_isnoneornil(L, 1)) {
+		sigfillset(&tmp);
+	} else {
+		if (&tmp != (set = unixL_tosigset(L, 1, &tmp)))
+			tmp = *set;
+	}
+
+	/* these cannot be caught and will trigger EINVAL on AIX */
+	sigdelset(&tmp, SIGKILL);
+	sigdelset(&tmp, SIGSTOP);
+
+	memset(&si, 0, sizeof si);
+
+	if ((error = u_sigtimedwait(&signo, &tmp, &si, u_f2ts(&timeout, luaL_optnumber(L, 2, U_NAN)))))
+		return unixL_pusherror(L, error, "sigtimedwait", "~$#");
+
+	lua_pushinteger(L, signo);
+
+	lua_newtable(L);
+	lua_pushinteger(L, si.si_signo);
+	lua_setfield(L, -2, "signo");
+
+	return 2;
+} /* unix_sigtimedwait() */
+
+
+static int unix_sigwait(lua_State *L) {
+	sigset_t set, *_set;
+	int signo, error;
+
+	if (lua_isnoneornil(L, 1)) {
+		sigfillset(&set);
+	} else {
+		if (&set != (_set = unixL_tosigset(L, 1, &set)))
+			set = *_set;
+	}
+
+	/* these cannot be caught and will trigger EINVAL on AIX */
+	sigdelset(&set, SIGKILL);
+	sigdelset(&set, SIGSTOP);
+
+	if ((error = u_sigwait(&set, &signo)))
+		return unixL_pusherror(L, error, "sigwait", "~$#");
+
+	lua_pushinteger(L, signo);
+
+	return 1;
+} /* unix_sigwait() */
+
+
+#if HAVE_FSTATAT && HAVE_FDOPENDIR
+/*
+ * Tree snapshot. Entries live in one flat array sorted by path, with the
+ * paths in a single string pool, so a tracked file costs a fixed 48 bytes
+ * plus its relative path rather than a Lua table.
+ */
+#define SNAP_OFLAGS (O_RDONLY|O_DIRECTORY|O_NOFOLLOW|U_CLOEXEC)
+#define SNAP_MAGIC "lunix-snapshot\n"
+#define SNAP_VERSION 1
+
+struct snap_ent {
+	unsigned long long dev, ino, size;
+	long long mtime; /* nanoseconds */
+	unsigned mode;
+	unsigned pathlen;
+	union {
+		size_t off; /* while building, as the pool may move */
+		const char *ptr; /* after snap_finish */
+	} path;
+}; /* struct snap_ent */
+
+struct snapshot {
+	struct snap_ent *ent;
+	size_t nent, entsiz;
+
+	char *pool;
+	size_t poolsiz, poolend;
+
+	_Bool xdev;
+	dev_t dev;
+
+	unixL_Unsigned nerror;
+}; /* struct snapshot */
+
+U_REALLOCARRAY_GENERATE(struct snap_ent *, u_reallocarray_snap_ent)
+
+static long long snap_mtime(const struct stat *st) {
+#if HAVE_STRUCT_STAT_ST_MTIMESPEC
+	return (long long)st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+#elif HAVE_STRUCT_STAT_ST_MTIM
+	return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#else
+	return (long long)st->st_mtime * 1000000000LL;
+#endif
+} /* snap_mtime() */
+
+static u_error_t snap_add(struct snapshot *snap, const char *path, size_t pathlen, const struct stat *st) {
+	struct snap_ent *ent;
+	int error;
+
+	if (pathlen > UINT_MAX)
+		return ENAMETOOLONG;
+
+	if ((error = u_reallocarray_snap_ent(&snap->ent, &snap->entsiz, snap->nent + 1)))
+		return error;
+
+	ent = &snap->ent[snap->nent];
+	ent->path.off = snap->poolend;
+	ent->pathlen = pathlen;
+
+	if ((error = u_appends(&snap->pool, &snap->poolsiz, &snap->poolend, path, pathlen)))
+		return error;
+	if ((error = u_appendc(&snap->pool, &snap->poolsiz, &snap->poolend, '\0')))
+		return error;
+
+	ent->dev = st->st_dev;
+	ent->ino = st->st_ino;
+	ent->size = st->st_size;
+	ent->mtime = snap_mtime(st);
+	ent->mode = st->st_mode;
+	snap->nent++;
+
+	return 0;
+} /* snap_add() */
+
+/* record the directory open at fd, whose relative path is in *buf */
+static u_error_t snap_walk(struct snapshot *snap, int fd, char **buf, size_t *bufsiz, size_t len) {
+	struct dirent *ent = NULL, *res;
+	DIR *dp = NULL;
+	struct stat st;
+	long namemax;
+	int error;
+
+	if (-1 == (namemax = fpathconf(fd, _PC_NAME_MAX)))
+		goto syerr;
+
+	if (!(ent = malloc(sizeof *ent + namemax + 1)))
+		goto syerr;
+
+	if (!(dp = fdopendir(fd)))
+		goto syerr;
+
+	fd = -1;
+
+	while (!(error = u_readdir_r(dp, ent, &res)) && res) {
+		const char *name = res->d_name;
+		size_t namelen = strlen(name), n = len;
+
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
+
+		if (0 != fstatat(dirfd(dp), name, &st, AT_SYMLINK_NOFOLLOW)) {
+			if (errno != ENOENT)
+				snap->nerror++;
+			continue;
+		}
+
+		if (*bufsiz < len + namelen + 2 && (error = u_realloc(buf, bufsiz, len + namelen + 2)))
+			goto error;
+
+		if (n > 0)
+			(*buf)[n++] = '/';
+
+		memcpy(&(*buf)[n], name, namelen);
+		n += namelen;
+
+		if ((error = snap_add(snap, *buf, n, &st)))
+			goto error;
+
+		if (S_ISDIR(st.st_mode) && !(snap->xdev && st.st_dev != snap->dev)) {
+			int nfd;
+
+			if ((error = u_openat(&nfd, dirfd(dp), name, SNAP_OFLAGS, 0))) {
+				if (error == ENOMEM)
+					goto error;
+				if (error != ENOENT)
+					snap->nerror++;
+				continue;
+			}
+
+			if ((error = snap_walk(snap, nfd, buf, bufsiz, n)))
+				goto error;
+		}
+	}
+
+	if (error)
+		snap->nerror++;
+
+	closedir(dp);
+	free(ent);
+
+	return 0;
+syerr:
+	error = errno;
+error:
+	if (dp)
+		closedir(dp);
+	u_close(&fd);
+	free(ent);
+
+	return error;
+} /* snap_walk() */
+
+static int snap_cmp(const void *a, const void *b) {
+	return strcmp(((const struct snap_ent *)a)->path.ptr, ((const struct snap_ent *)b)->path.ptr);
+} /* snap_cmp() */
+
+/* resolve pool offsets now the pool won't move, then sort by path */
+static void snap_finish(struct snapshot *snap) {
+	size_t i;
+
+	for (i = 0; i < snap->nent; i++)
+		snap->ent[i].path.ptr = &snap->pool[snap->ent[i].path.off];
+
+	qsort(snap->ent, snap->nent, sizeof *snap->ent, &snap_cmp);
+} /* snap_finish() */
+
+static struct snapshot *snap_prep(lua_State *L) {
+	struct snapshot *snap = lua_newuserdata(L, sizeof *snap);
+
+	memset(snap, 0, sizeof *snap);
+	luaL_setmetatable(L, "struct snapshot");
+
+	return snap;
+} /* snap_prep() */
+
+static struct snapshot *snap_checkself(lua_State *L, int index) {
+	return luaL_checkudata(L, index, "struct snapshot");
+} /* snap_checkself() */
+
+static _Bool snap_ischanged(const struct snap_ent *a, const struct snap_ent *b) {
+	return a->dev != b->dev || a->ino != b->ino || a->size != b->size || a->mtime != b->mtime || a->mode != b->mode;
+} /* snap_ischanged() */
+
+/* diff(new): arrays of added, removed, and changed paths */
+static int snap_diff(lua_State *L) {
+	struct snapshot *old = snap_checkself(L, 1);
+	struct snapshot *new = snap_checkself(L, 2);
+	size_t i = 0, j = 0;
+	int nadd = 0, nrem = 0, nchg = 0, cmp;
+
+	lua_settop(L, 2);
+	lua_newtable(L); /* 3: added */
+	lua_newtable(L); /* 4: removed */
+	lua_newtable(L); /* 5: changed */
+
+	while (i < old->nent || j < new->nent) {
+		if (i == old->nent)
+			cmp = 1;
+		else if (j == new->nent)
+			cmp = -1;
+		else
+			cmp = strcmp(old->ent[i].path.ptr, new->ent[j].path.ptr);
+
+		if (cmp < 0) {
+			lua_pushlstring(L, old->ent[i].path.ptr, old->ent[i].pathlen);
+			lua_rawseti(L, 4, ++nrem);
+			i++;
+		} else if (cmp > 0) {
+			lua_pushlstring(L, new->ent[j].path.ptr, new->ent[j].pathlen);
+			lua_rawseti(L, 3, ++nadd);
+			j++;
+		} else {
+			if (snap_ischanged(&old->ent[i], &new->ent[j])) {
+				lua_pushlstring(L, new->ent[j].path.ptr, new->ent[j].pathlen);
+				lua_rawseti(L, 5, ++nchg);
+			}
+			i++;
+			j++;
+		}
+	}
+
+	return 3;
+} /* snap_diff() */
+
+/* find(path): dev, ino, size, mtime sec, mtime nsec, mode or nil if not present */
+static int snap_find(lua_State *L) {
+	struct snapshot *snap = snap_checkself(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	size_t lo = 0, hi = snap->nent, mid;
+	const struct snap_ent *ent;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		ent = &snap->ent[mid];
+
+		if (!(cmp = strcmp(path, ent->path.ptr))) {
+			long long sec = ent->mtime / 1000000000LL;
+			long long nsec = ent->mtime % 1000000000LL;
+
+			if (nsec < 0) {
+				sec--;
+				nsec += 1000000000LL;
+			}
+
+			unixL_pushunsigned(L, ent->dev);
+			unixL_pushunsigned(L, ent->ino);
+			unixL_pushunsigned(L, ent->size);
+			lua_pushinteger(L, sec);
+			lua_pushinteger(L, nsec);
+			lua_pushinteger(L, ent->mode);
+
+			return 6;
+		} else if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return 0;
+} /* snap_find() */
+
+static void snap_put(luaL_Buffer *B, unsigned long long v, int n) {
+	char buf[8];
+	int i;
+
+	for (i = 0; i < n; i++, v >>= 8)
+		buf[i] = (char)(v & 0xff);
+
+	luaL_addlstring(B, buf, n);
+} /* snap_put() */
+
+static unsigned long long snap_get(const unsigned char *p, int n) {
+	unsigned long long v = 0;
+
+	while (n-- > 0)
+		v = (v << 8) | p[n];
+
+	return v;
+} /* snap_get() */
+
+/* dump(): serialize to a portable little-endian string */
+static int snap_dump(lua_State *L) {
+	struct snapshot *snap = snap_checkself(L, 1);
+	const struct snap_ent *ent;
+	luaL_Buffer B;
+	size_t i;
+
+	luaL_buffinit(L, &B);
+	luaL_addstring(&B, SNAP_MAGIC);
+	snap_put(&B, SNAP_VERSION, 4);
+	snap_put(&B, snap->nent, 8);
+
+	for (i = 0; i < snap->nent; i++) {
+		ent = &snap->ent[i];
+		snap_put(&B, ent->dev, 8);
+		snap_put(&B, ent->ino, 8);
+		snap_put(&B, ent->size, 8);
+		snap_put(&B, (unsigned long long)ent->mtime, 8);
+		snap_put(&B, ent->mode, 4);
+		snap_put(&B, ent->pathlen, 4);
+		luaL_addlstring(&B, ent->path.ptr, ent->pathlen);
+	}
+
+	luaL_pushresult(&B);
+
+	return 1;
+} /* snap_dump() */
+
+static int snap__len(lua_State *L) {
+	unixL_pushsize(L, snap_checkself(L, 1)->nent);
+
+	return 1;
+} /* snap__len() */
+
+static int snap__gc(lua_State *L) {
+	struct snapshot *snap = snap_checkself(L, 1);
+
+	free(snap->ent);
+	snap->ent = NULL;
+	snap->nent = 0;
+	snap->entsiz = 0;
+
+	free(snap->pool);
+	snap->pool = NULL;
+	snap->poolsiz = 0;
+	snap->poolend = 0;
+
+	return 0;
+} /* snap__gc() */
+
+static const luaL_Reg snap_methods[] = {
+	{ "diff", &snap_diff },
+	{ "find", &snap_find },
+	{ "dump", &snap_dump },
+	{ NULL,   NULL }
+}; /* snap_methods[] */
+
+static const luaL_Reg snap_metamethods[] = {
+	{ "__len", &snap__len },
+	{ "__gc",  &snap__gc },
+	{ NULL,    NULL }
+}; /* snap_metamethods[] */
+
+
+/*
+ * snapshot(path[, opts])
+ *
+ * Capture path, dev, ino, size, mtime, and mode of everything below path,
+ * without following symbolic links. Paths are relative to path. Entries
+ * which can't be read are skipped and counted, like du.
+ */
+static int unix_snapshot(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	struct snapshot *snap;
+	char *buf = NULL;
+	size_t bufsiz = 0;
+	struct stat st;
+	int fd = -1, error;
+
+	lua_settop(L, 2);
+	snap = snap_prep(L);
+
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "xdev");
+		snap->xdev = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+
+	if ((error = u_open(&fd, path, SNAP_OFLAGS, 0)))
+		goto error;
+
+	if (0 != fstat(fd, &st))
+		goto syerr;
+
+	snap->dev = st.st_dev;
 
-	lua_settop(L, 3);
+	error = snap_walk(snap, fd, &buf, &bufsiz, 0);
+	fd = -1;
+	free(buf);
 
-	set = (!lua_isnil(L, 2))? unixL_tosigset(L, 2, &tmp) : NULL;
-	oset = unixL_tosigset(L, 3, NULL);
+	if (error)
+		goto error;
 
-	sigemptyset(oset);
+	snap_finish(snap);
+	unixL_pushunsigned(L, snap->nerror);
 
-	if (0 != sigprocmask(how, set, oset))
-		return unixL_pusherror(L, errno, "sigprocmask", "~$#");
+	return 2;
+syerr:
+	error = errno;
+error:
+	u_close(&fd);
 
-	return 1; /* returns oset */
-} /* unix_sigprocmask() */
+	return unixL_pusherror(L, error, "snapshot", "~$#");
+} /* unix_snapshot() */
 
 
-static int unix_sigtimedwait(lua_State *L) {
-	sigset_t tmp, *set;
-	struct timespec timeout;
-	siginfo_t si;
-	int signo, error;
+/* loadsnapshot(string): inverse of snapshot:dump */
+static int unix_loadsnapshot(lua_State *L) {
+	size_t len;
+	const unsigned char *p = (const unsigned char *)luaL_checklstring(L, 1, &len);
+	const unsigned char *pe = p + len;
+	struct snapshot *snap;
+	struct stat st;
+	unsigned long long n, i;
+	size_t pathlen;
+	int error;
 
-	if (lua_isnoneornil(L, 1)) {
-		sigfillset(&tmp);
-	} else {
-		if (&tmp != (set = unixL_tosigset(L, 1, &tmp)))
-			tmp = *set;
-	}
+	if (len < sizeof SNAP_MAGIC - 1 + 12 || memcmp(p, SNAP_MAGIC, sizeof SNAP_MAGIC - 1))
+		goto invalid;
 
-	/* these cannot be caught and will trigger EINVAL on AIX */
-	sigdelset(&tmp, SIGKILL);
-	sigdelset(&tmp, SIGSTOP);
+	p += sizeof SNAP_MAGIC - 1;
 
-	memset(&si, 0, sizeof si);
+	if (snap_get(p, 4) != SNAP_VERSION)
+		goto invalid;
 
-	if ((error = u_sigtimedwait(&signo, &tmp, &si, u_f2ts(&timeout, luaL_optnumber(L, 2, U_NAN)))))
-		return unixL_pusherror(L, error, "sigtimedwait", "~$#");
+	n = snap_get(p + 4, 8);
+	p += 12;
 
-	lua_pushinteger(L, signo);
+	snap = snap_prep(L);
+	memset(&st, 0, sizeof st);
 
-	lua_newtable(L);
-	lua_pushinteger(L, si.si_signo);
-	lua_setfield(L, -2, "signo");
+	for (i = 0; i < n; i++) {
+		struct snap_ent *ent;
 
-	return 2;
-} /* unix_sigtimedwait() */
+		if (pe - p < 40)
+			goto invalid;
 
+		pathlen = snap_get(p + 36, 4);
 
-static int unix_sigwait(lua_State *L) {
-	sigset_t set, *_set;
-	int signo, error;
+		if ((size_t)(pe - p - 40) < pathlen)
+			goto invalid;
 
-	if (lua_isnoneornil(L, 1)) {
-		sigfillset(&set);
-	} else {
-		if (&set != (_set = unixL_tosigset(L, 1, &set)))
-			set = *_set;
-	}
+		if ((error = snap_add(snap, (const char *)p + 40, pathlen, &st)))
+			return unixL_pusherror(L, error, "loadsnapshot", "~$#");
 
-	/* these cannot be caught and will trigger EINVAL on AIX */
-	sigdelset(&set, SIGKILL);
-	sigdelset(&set, SIGSTOP);
+		ent = &snap->ent[snap->nent - 1];
+		ent->dev = snap_get(p, 8);
+		ent->ino = snap_get(p + 8, 8);
+		ent->size = snap_get(p + 16, 8);
+		ent->mtime = (long long)snap_get(p + 24, 8);
+		ent->mode = snap_get(p + 32, 4);
 
-	if ((error = u_sigwait(&set, &signo)))
-		return unixL_pusherror(L, error, "sigwait", "~$#");
+		p += 40 + pathlen;
+	}
 
-	lua_pushinteger(L, signo);
+	/* dump preserves order, but don't trust input for binary search */
+	snap_finish(snap);
 
 	return 1;
-} /* unix_sigwait() */
+invalid:
+	return unixL_pusherror(L, EINVAL, "loadsnapshot", "~$#");
+} /* unix_loadsnapshot() */
+#endif
 
 
 static int unix_sleep(lua_State *L) {
@@ -10096,8 +15647,15 @@ static void st_pushfield(lua_State *L, const struct stat *st, enum st_field type
 	}
 } /* st_pushfield() */
 
-static void st_pushtable(lua_State *L, const struct stat *st) {
-	lua_createtable(L, 0, countof(st_field) - 1);
+/*
+ * Fill the table at index t, or a new table if t is 0. Callers stat'ing
+ * in a loop can pass the same table each time to avoid an allocation.
+ */
+static void st_pushtable(lua_State *L, const struct stat *st, int t) {
+	if (t)
+		lua_pushvalue(L, t);
+	else
+		lua_createtable(L, 0, countof(st_field) - 1);
 
 	st_pushfield(L, st, STF_DEV);
 	lua_setfield(L, -2, "dev");
@@ -10111,66 +15669,407 @@ static void st_pushtable(lua_State *L, const struct stat *st) {
 	st_pushfield(L, st, STF_NLINK);
 	lua_setfield(L, -2, "nlink");
 
-	st_pushfield(L, st, STF_UID);
-	lua_setfield(L, -2, "uid");
+	st_pushfield(L, st, STF_UID);
+	lua_setfield(L, -2, "uid");
+
+	st_pushfield(L, st, STF_GID);
+	lua_setfield(L, -2, "gid");
+
+	st_pushfield(L, st, STF_RDEV);
+	lua_setfield(L, -2, "rdev");
+
+	st_pushfield(L, st, STF_SIZE);
+	lua_setfield(L, -2, "size");
+
+	st_pushfield(L, st, STF_ATIME);
+	lua_setfield(L, -2, "atime");
+
+	st_pushfield(L, st, STF_MTIME);
+	lua_setfield(L, -2, "mtime");
+
+	st_pushfield(L, st, STF_CTIME);
+	lua_setfield(L, -2, "ctime");
+
+	st_pushfield(L, st, STF_BLKSIZE);
+	lua_setfield(L, -2, "blksize");
+
+	st_pushfield(L, st, STF_BLOCKS);
+	lua_setfield(L, -2, "blocks");
+} /* st_pushtable() */
+
+/*
+ * Precompiled field list, so hot loops don't pay for luaL_checkoption on
+ * every call. See unix_statfields.
+ */
+struct st_fields {
+	unsigned char count;
+	unsigned char field[countof(st_field) * 2];
+};
+
+static int st_pushstat(lua_State *L, const struct stat *st, int fields) {
+	struct st_fields *set;
+
+	if (lua_isnoneornil(L, fields)) {
+		st_pushtable(L, st, 0);
+
+		return 1;
+	} else if (lua_type(L, fields) == LUA_TTABLE) {
+		st_pushtable(L, st, lua_absindex(L, fields));
+
+		return 1;
+	} else if ((set = luaL_testudata(L, fields, "struct st_fields"))) {
+		int i;
+
+		luaL_checkstack(L, set->count, "too many results");
+
+		for (i = 0; i < set->count; i++) {
+			st_pushfield(L, st, set->field[i]);
+		}
+
+		return i;
+	} else {
+		int top = lua_gettop(L), i;
+
+		for (i = fields; i <= top; i++) {
+			st_pushfield(L, st, luaL_checkoption(L, i, NULL, st_field));
+		}
+
+		return i - fields;
+	}
+} /* st_pushstat() */
+
+static int unix_stat(lua_State *L) {
+	struct stat st;
+	int fd;
+
+	if (-1 != (fd = unixL_optfileno(L, 1, -1))) {
+		if (0 != fstat(fd, &st))
+			return unixL_pusherror(L, errno, "stat", "0$#");
+	} else {
+		const char *path = luaL_checkstring(L, 1);
+
+		if (0 != stat(path, &st))
+			return unixL_pusherror(L, errno, "stat", "0$#");
+	}
+
+	return st_pushstat(L, &st, 2);
+} /* unix_stat() */
+
+
+static int unix_statfields(lua_State *L) {
+	int top = lua_gettop(L), i;
+	struct st_fields *set;
+
+	luaL_argcheck(L, top <= (int)countof(set->field), countof(set->field) + 1, "too many fields");
+
+	set = lua_newuserdata(L, sizeof *set);
+	memset(set, 0, sizeof *set);
+
+	for (i = 1; i <= top; i++) {
+		set->field[set->count++] = luaL_checkoption(L, i, NULL, st_field);
+	}
+
+	luaL_setmetatable(L, "struct st_fields");
+
+	return 1;
+} /* unix_statfields() */
+
+
+static struct st_fields *st_checkfields(lua_State *L, int index, struct st_fields *buf) {
+	struct st_fields *set;
+	int i, n;
+
+	if ((set = luaL_testudata(L, index, "struct st_fields")))
+		return set;
+
+	memset(buf, 0, sizeof *buf);
+
+	if (lua_isnoneornil(L, index)) {
+		for (i = 0; st_field[i]; i++)
+			buf->field[buf->count++] = i;
+
+		return buf;
+	}
+
+	luaL_checktype(L, index, LUA_TTABLE);
+	n = lua_rawlen(L, index);
+	luaL_argcheck(L, n <= (int)countof(buf->field), index, "too many fields");
+
+	for (i = 1; i <= n; i++) {
+		const char *name;
+		int j;
+
+		lua_rawgeti(L, index, i);
+		name = luaL_checkstring(L, -1);
+
+		for (j = 0; st_field[j] && strcmp(st_field[j], name); j++)
+			;;
+
+		if (!st_field[j])
+			luaL_argerror(L, index, lua_pushfstring(L, "invalid field '%s'", name));
+
+		buf->field[buf->count++] = j;
+		lua_pop(L, 1);
+	}
+
+	return buf;
+} /* st_checkfields() */
+
+
+#if HAVE_FSTATAT
+/*
+ * statmany(paths[, fields][, opts])
+ *
+ * Stats each path in the array and returns a table of column arrays, one
+ * per field, plus an array of errno values (0 on success). Failed entries
+ * are false in every column so the arrays stay sequences.
+ */
+static int unix_statmany(lua_State *L) {
+	struct st_fields buf, *set;
+	struct stat st;
+	int at = AT_FDCWD, flags = 0, col, nerr, i, j, n;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	set = st_checkfields(L, 2, &buf);
+
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+
+		lua_getfield(L, 3, "at");
+		at = unixL_optatfileno(L, -1, AT_FDCWD);
+		lua_pop(L, 1);
+
+		flags = unixL_optfint(L, 3, "flags", 0);
+	}
+
+	lua_settop(L, 3);
+	n = lua_rawlen(L, 1);
+
+	/* keep the column arrays on the stack to avoid per-value lookups */
+	luaL_checkstack(L, set->count + 2, "too many fields");
+	col = lua_gettop(L) + 1;
+
+	for (j = 0; j < set->count; j++)
+		lua_createtable(L, n, 0);
+
+	lua_createtable(L, n, 0);
+	nerr = lua_gettop(L);
+
+	for (i = 1; i <= n; i++) {
+		const char *path;
+		int error = 0;
+
+		lua_rawgeti(L, 1, i);
+
+		if (!(path = lua_tostring(L, -1)))
+			return luaL_error(L, "statmany: path #%d is not a string", i);
+
+		if (0 != fstatat(at, path, &st, flags))
+			error = errno;
+
+		lua_pop(L, 1);
+
+		for (j = 0; j < set->count; j++) {
+			if (error)
+				lua_pushboolean(L, 0);
+			else
+				st_pushfield(L, &st, set->field[j]);
+			lua_rawseti(L, col + j, i);
+		}
+
+		lua_pushinteger(L, error);
+		lua_rawseti(L, nerr, i);
+	}
+
+	lua_createtable(L, 0, set->count);
+
+	for (j = 0; j < set->count; j++) {
+		lua_pushvalue(L, col + j);
+		lua_setfield(L, -2, st_field[set->field[j]]);
+	}
+
+	lua_pushvalue(L, nerr);
+
+	return 2;
+} /* unix_statmany() */
+#endif
+
+static void vfs_pushtable(lua_State *L, const struct statvfs *vfs) {
+	lua_createtable(L, 0, 11);
+
+	unixL_pushunsigned(L, vfs->f_bsize);
+	lua_setfield(L, -2, "bsize");
+	unixL_pushunsigned(L, vfs->f_frsize);
+	lua_setfield(L, -2, "frsize");
+	unixL_pushunsigned(L, vfs->f_blocks);
+	lua_setfield(L, -2, "blocks");
+	unixL_pushunsigned(L, vfs->f_bfree);
+	lua_setfield(L, -2, "bfree");
+	unixL_pushunsigned(L, vfs->f_bavail);
+	lua_setfield(L, -2, "bavail");
+	unixL_pushunsigned(L, vfs->f_files);
+	lua_setfield(L, -2, "files");
+	unixL_pushunsigned(L, vfs->f_ffree);
+	lua_setfield(L, -2, "ffree");
+	unixL_pushunsigned(L, vfs->f_favail);
+	lua_setfield(L, -2, "favail");
+	/* an opaque identifier, so wrapping is preferable to rounding */
+	lua_pushinteger(L, (lua_Integer)vfs->f_fsid);
+	lua_setfield(L, -2, "fsid");
+	unixL_pushunsigned(L, vfs->f_flag);
+	lua_setfield(L, -2, "flag");
+	unixL_pushunsigned(L, vfs->f_namemax);
+	lua_setfield(L, -2, "namemax");
+} /* vfs_pushtable() */
+
+static int unix_statvfs(lua_State *L) {
+	struct statvfs vfs;
+	int fd;
+
+	if (-1 != (fd = unixL_optfileno(L, 1, -1))) {
+		if (0 != fstatvfs(fd, &vfs))
+			return unixL_pusherror(L, errno, "statvfs", "~$#");
+	} else {
+		const char *path = luaL_checkstring(L, 1);
+
+		if (0 != statvfs(path, &vfs))
+			return unixL_pusherror(L, errno, "statvfs", "~$#");
+	}
+
+	vfs_pushtable(L, &vfs);
+
+	return 1;
+} /* unix_statvfs() */
+
+
+#if __linux
+/* undo the octal escaping of whitespace and backslash in mountinfo */
+static char *vfs_unescape(char *s) {
+	char *src = s, *dst = s;
+
+	while (*src) {
+		if (src[0] == '\\' && src[1] >= '0' && src[1] <= '3' && src[2] >= '0' && src[2] <= '7' && src[3] >= '0' && src[3] <= '7') {
+			*dst++ = ((src[1] - '0') << 6) | ((src[2] - '0') << 3) | (src[3] - '0');
+			src += 4;
+		} else {
+			*dst++ = *src++;
+		}
+	}
+
+	*dst = '\0';
+
+	return s;
+} /* vfs_unescape() */
+
+/*
+ * Parse a /proc/self/mountinfo line, which has the form
+ *
+ *   ID PARENT MAJOR:MINOR ROOT MOUNTPOINT OPTIONS [OPTIONAL...] - FSTYPE SOURCE SUPEROPTIONS
+ */
+static _Bool vfs_parsemount(char *line, char **mountpoint, char **fstype, char **source) {
+	char *field[6], *save, *tok;
+	int n = 0;
+
+	for (tok = strtok_r(line, " \n", &save); tok && n < 6; tok = strtok_r(NULL, " \n", &save))
+		field[n++] = tok;
+
+	if (n < 6)
+		return 0;
+
+	while (tok && strcmp(tok, "-"))
+		tok = strtok_r(NULL, " \n", &save);
+
+	if (!tok || !(*fstype = strtok_r(NULL, " \n", &save)) || !(*source = strtok_r(NULL, " \n", &save)))
+		return 0;
+
+	*mountpoint = vfs_unescape(field[4]);
+	vfs_unescape(*source);
+
+	return 1;
+} /* vfs_parsemount() */
+
+static int unix_statvfsmounts(lua_State *L) {
+	char *line = NULL, *mountpoint, *fstype, *source;
+	size_t linesiz = 0;
+	struct statvfs vfs;
+	lua_Integer n = 0;
+	FILE *fp;
+	int error;
+
+	if (!(fp = fopen("/proc/self/mountinfo", "re")))
+		return unixL_pusherror(L, errno, "statvfsmounts", "~$#");
+
+	lua_newtable(L);
+
+	while (-1 != getline(&line, &linesiz, fp)) {
+		if (!vfs_parsemount(line, &mountpoint, &fstype, &source))
+			continue;
+
+		/* an unreachable mount is reported rather than failing the batch */
+		if (0 == statvfs(mountpoint, &vfs)) {
+			vfs_pushtable(L, &vfs);
+		} else {
+			error = errno;
+			lua_createtable(L, 0, 4);
+			lua_pushinteger(L, error);
+			lua_setfield(L, -2, "error");
+		}
+
+		lua_pushstring(L, mountpoint);
+		lua_setfield(L, -2, "mountpoint");
+		lua_pushstring(L, fstype);
+		lua_setfield(L, -2, "fstype");
+		lua_pushstring(L, source);
+		lua_setfield(L, -2, "source");
 
-	st_pushfield(L, st, STF_GID);
-	lua_setfield(L, -2, "gid");
+		lua_rawseti(L, -2, ++n);
+	}
 
-	st_pushfield(L, st, STF_RDEV);
-	lua_setfield(L, -2, "rdev");
+	error = (ferror(fp))? errno : 0;
+	free(line);
+	fclose(fp);
 
-	st_pushfield(L, st, STF_SIZE);
-	lua_setfield(L, -2, "size");
+	if (error)
+		return unixL_pusherror(L, error, "statvfsmounts", "~$#");
 
-	st_pushfield(L, st, STF_ATIME);
-	lua_setfield(L, -2, "atime");
+	return 1;
+} /* unix_statvfsmounts() */
+#endif
 
-	st_pushfield(L, st, STF_MTIME);
-	lua_setfield(L, -2, "mtime");
 
-	st_pushfield(L, st, STF_CTIME);
-	lua_setfield(L, -2, "ctime");
+static int stf__len(lua_State *L) {
+	struct st_fields *set = luaL_checkudata(L, 1, "struct st_fields");
 
-	st_pushfield(L, st, STF_BLKSIZE);
-	lua_setfield(L, -2, "blksize");
+	lua_pushinteger(L, set->count);
 
-	st_pushfield(L, st, STF_BLOCKS);
-	lua_setfield(L, -2, "blocks");
-} /* st_pushtable() */
+	return 1;
+} /* stf__len() */
 
-static int st_pushstat(lua_State *L, const struct stat *st, int fields) {
-	if (lua_isnoneornil(L, fields)) {
-		st_pushtable(L, st);
 
-		return 1;
-	} else {
-		int top = lua_gettop(L), i;
+static int stf__tostring(lua_State *L) {
+	struct st_fields *set = luaL_checkudata(L, 1, "struct st_fields");
+	luaL_Buffer B;
+	int i;
 
-		for (i = fields; i <= top; i++) {
-			st_pushfield(L, st, luaL_checkoption(L, i, NULL, st_field));
-		}
+	luaL_buffinit(L, &B);
 
-		return i - fields;
+	for (i = 0; i < set->count; i++) {
+		if (i > 0)
+			luaL_addchar(&B, ' ');
+		luaL_addstring(&B, st_field[set->field[i]]);
 	}
-} /* st_pushstat() */
 
-static int unix_stat(lua_State *L) {
-	struct stat st;
-	int fd;
+	luaL_pushresult(&B);
 
-	if (-1 != (fd = unixL_optfileno(L, 1, -1))) {
-		if (0 != fstat(fd, &st))
-			return unixL_pusherror(L, errno, "stat", "0$#");
-	} else {
-		const char *path = luaL_checkstring(L, 1);
+	return 1;
+} /* stf__tostring() */
 
-		if (0 != stat(path, &st))
-			return unixL_pusherror(L, errno, "stat", "0$#");
-	}
 
-	return st_pushstat(L, &st, 2);
-} /* unix_stat() */
+static const luaL_Reg stf_metamethods[] = {
+	{ "__len",      &stf__len },
+	{ "__tostring", &stf__tostring },
+	{ NULL,         NULL }
+}; /* stf_metamethods[] */
 
 
 static int unix_strerror(lua_State *L) {
@@ -10228,6 +16127,291 @@ static int unix_symlinkat(lua_State *L) {
 #endif
 
 
+/*
+ * Group commit. Descriptors are queued by :add and flushed together by
+ * :commit, first starting writeback on all of them with sync_file_range
+ * so the device sees one batch, then waiting on each with fdatasync or
+ * fsync, or once per file system with syncfs.
+ *
+ * The queue holds its own duplicate of each descriptor, so closing the
+ * caller's handle before the commit can't redirect the sync to whatever
+ * file later reuses the descriptor number.
+ */
+struct sg_ent {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	_Bool done;
+}; /* struct sg_ent */
+
+struct syncgroup {
+	struct sg_ent *fd;
+	size_t nfd, fdsiz;
+	_Bool data;    /* fdatasync rather than fsync */
+	size_t syncfs; /* queued descriptors on one file system to prefer syncfs */
+	double window; /* seconds from first add until due */
+	unixL_Unsigned maxbytes, bytes;
+	struct timeval first;
+	struct {
+		unixL_Unsigned batches, fds, syncfs;
+		double last, max, total;
+	} stats;
+}; /* struct syncgroup */
+
+static struct syncgroup *sg_checkself(lua_State *L, int index) {
+	return luaL_checkudata(L, index, "struct syncgroup");
+} /* sg_checkself() */
+
+static _Bool sg_isdue(const struct syncgroup *sg) {
+	struct timeval now;
+
+	if (sg->nfd == 0)
+		return 0;
+
+	if (sg->maxbytes && sg->bytes >= sg->maxbytes)
+		return 1;
+
+	gettimeofday(&now, NULL);
+
+	return u_tv2f(&now) - u_tv2f(&sg->first) >= sg->window;
+} /* sg_isdue() */
+
+static void sg_clear(struct syncgroup *sg) {
+	size_t i;
+
+	for (i = 0; i < sg->nfd; i++)
+		u_close(&sg->fd[i].fd);
+
+	sg->nfd = 0;
+	sg->bytes = 0;
+} /* sg_clear() */
+
+static int sg_add(lua_State *L) {
+	struct syncgroup *sg = sg_checkself(L, 1);
+	int fd = unixL_checkfileno(L, 2);
+	unixL_Unsigned bytes = (lua_isnoneornil(L, 3))? 0 : unixL_checkunsigned(L, 3);
+	struct sg_ent *ent;
+	struct stat st;
+	size_t i;
+	int error;
+
+	if (0 != fstat(fd, &st))
+		return luaL_error(L, "syncgroup: %s", unixL_strerror(L, errno));
+
+	for (i = 0; i < sg->nfd; i++) {
+		if (sg->fd[i].dev == st.st_dev && sg->fd[i].ino == st.st_ino)
+			goto queued;
+	}
+
+	if (sg->nfd >= sg->fdsiz) {
+		size_t size = MAX(8, sg->fdsiz * 2);
+		struct sg_ent *tmp;
+
+		if (!(tmp = realloc(sg->fd, size * sizeof *tmp))) {
+			error = errno;
+			return luaL_error(L, "syncgroup: %s", unixL_strerror(L, error));
+		}
+
+		sg->fd = tmp;
+		sg->fdsiz = size;
+	}
+
+	ent = &sg->fd[sg->nfd];
+
+	if ((error = u_dup(&ent->fd, fd, U_CLOEXEC)))
+		return luaL_error(L, "syncgroup: %s", unixL_strerror(L, error));
+
+	ent->dev = st.st_dev;
+	ent->ino = st.st_ino;
+	ent->done = 0;
+
+	if (sg->nfd++ == 0)
+		gettimeofday(&sg->first, NULL);
+queued:
+	sg->bytes += bytes;
+
+	lua_pushboolean(L, sg_isdue(sg));
+
+	return 1;
+} /* sg_add() */
+
+static int sg_due(lua_State *L) {
+	lua_pushboolean(L, sg_isdue(sg_checkself(L, 1)));
+
+	return 1;
+} /* sg_due() */
+
+static u_error_t sg_sync(struct syncgroup *sg, int fd) {
+#if HAVE_FDATASYNC
+	if (sg->data)
+		return (0 == fdatasync(fd))? 0 : errno;
+#endif
+	(void)sg;
+	return (0 == fsync(fd))? 0 : errno;
+} /* sg_sync() */
+
+static int sg_commit(lua_State *L) {
+	struct syncgroup *sg = sg_checkself(L, 1);
+	struct timeval t0, t1;
+	size_t i, n = sg->nfd;
+	double latency;
+	int error = 0, _error;
+#if HAVE_SYNCFS
+	size_t j, count;
+#endif
+
+	if (n == 0) {
+		lua_pushinteger(L, 0);
+
+		return 1;
+	}
+
+	gettimeofday(&t0, NULL);
+
+#if HAVE_SYNC_FILE_RANGE
+	/* start writeback everywhere before blocking on any one descriptor */
+	for (i = 0; i < n; i++)
+		(void)sync_file_range(sg->fd[i].fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+
+#if HAVE_SYNCFS
+	/* syncfs once for each file system with enough queued; mark those done */
+	for (i = 0; sg->syncfs > 0 && i < n; i++) {
+		if (sg->fd[i].done)
+			continue;
+
+		for (count = 0, j = i; j < n; j++)
+			count += (!sg->fd[j].done && sg->fd[j].dev == sg->fd[i].dev);
+
+		if (count < sg->syncfs)
+			continue;
+
+		if (0 != syncfs(sg->fd[i].fd)) {
+			error = errno;
+			break;
+		}
+
+		sg->stats.syncfs++;
+		sg->stats.fds += count;
+
+		for (j = n; j-- > i; ) {
+			if (!sg->fd[j].done && sg->fd[j].dev == sg->fd[i].dev)
+				sg->fd[j].done = 1;
+		}
+	}
+#endif
+
+	for (i = 0; i < n; i++) {
+		if (sg->fd[i].done)
+			continue;
+
+		if ((_error = sg_sync(sg, sg->fd[i].fd)) && !error)
+			error = _error;
+
+		sg->stats.fds++;
+	}
+
+	gettimeofday(&t1, NULL);
+
+	latency = u_tv2f(&t1) - u_tv2f(&t0);
+	sg->stats.batches++;
+	sg->stats.last = latency;
+	sg->stats.max = MAX(sg->stats.max, latency);
+	sg->stats.total += latency;
+
+	/* a failed fsync can't be usefully retried, so the batch is dropped */
+	sg_clear(sg);
+
+	if (error)
+		return unixL_pusherror(L, error, "commit", "0$#");
+
+	lua_pushinteger(L, n);
+
+	return 1;
+} /* sg_commit() */
+
+static int sg_stats(lua_State *L) {
+	struct syncgroup *sg = sg_checkself(L, 1);
+
+	lua_createtable(L, 0, 7);
+	unixL_pushunsigned(L, sg->stats.batches);
+	lua_setfield(L, -2, "batches");
+	unixL_pushunsigned(L, sg->stats.fds);
+	lua_setfield(L, -2, "fds");
+	unixL_pushunsigned(L, sg->stats.syncfs);
+	lua_setfield(L, -2, "syncfs");
+	lua_pushnumber(L, sg->stats.last);
+	lua_setfield(L, -2, "last");
+	lua_pushnumber(L, sg->stats.max);
+	lua_setfield(L, -2, "max");
+	lua_pushnumber(L, (sg->stats.batches)? sg->stats.total / sg->stats.batches : 0.0);
+	lua_setfield(L, -2, "avg");
+	unixL_pushsize(L, sg->nfd);
+	lua_setfield(L, -2, "pending");
+
+	return 1;
+} /* sg_stats() */
+
+static int sg__gc(lua_State *L) {
+	struct syncgroup *sg = sg_checkself(L, 1);
+
+	sg_clear(sg);
+	free(sg->fd);
+	sg->fd = NULL;
+	sg->fdsiz = 0;
+
+	return 0;
+} /* sg__gc() */
+
+static const luaL_Reg sg_methods[] = {
+	{ "add",    &sg_add },
+	{ "due",    &sg_due },
+	{ "commit", &sg_commit },
+	{ "stats",  &sg_stats },
+	{ NULL,     NULL },
+}; /* sg_methods[] */
+
+static const luaL_Reg sg_metamethods[] = {
+	{ "__gc", &sg__gc },
+	{ NULL,   NULL },
+}; /* sg_metamethods[] */
+
+static int unix_syncgroup(lua_State *L) {
+	struct syncgroup *sg;
+
+	lua_settop(L, 1);
+
+	sg = lua_newuserdata(L, sizeof *sg);
+	memset(sg, 0, sizeof *sg);
+	sg->data = 1;
+	sg->window = 0.002;
+	luaL_setmetatable(L, "struct syncgroup");
+
+	if (!lua_isnil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+
+		lua_getfield(L, 1, "window");
+		sg->window = luaL_optnumber(L, -1, sg->window);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 1, "bytes");
+		sg->maxbytes = (lua_isnil(L, -1))? 0 : unixL_checkunsigned(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 1, "data");
+		if (!lua_isnil(L, -1))
+			sg->data = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 1, "syncfs");
+		sg->syncfs = unixL_optsize(L, -1, 0);
+		lua_pop(L, 1);
+	}
+
+	return 1;
+} /* unix_syncgroup() */
+
+
 static int unix_sysconf(lua_State *L) {
 	int name = unixL_checkint(L, 1);
 	long v;
@@ -10389,12 +16573,18 @@ static int unix_tzset(lua_State *L) {
 
 
 static int unix_umask(lua_State *L) {
+	unixL_State *U = unixL_getstate(L);
 	mode_t cmask = unixL_getumask(L);
 
 	if (lua_isnoneornil(L, 1)) {
 		lua_pushinteger(L, cmask);
 	} else {
-		lua_pushinteger(L, umask(unixL_optmode(L, 1, cmask, cmask)));
+		mode_t mask = unixL_optmode(L, 1, cmask, cmask) & 0777;
+
+		lua_pushinteger(L, umask(mask));
+
+		U->umask.mask = mask;
+		U->umask.cached = 1;
 	}
 
 	return 1;
@@ -10629,9 +16819,13 @@ static const luaL_Reg unix_routines[] = {
 	{ "arc4random_buf",     &unix_arc4random_buf },
 	{ "arc4random_stir",    &unix_arc4random_stir },
 	{ "arc4random_uniform", &unix_arc4random_uniform },
+#if HAVE_OPENAT && HAVE_RENAMEAT
+	{ "atomic_write",       &unix_atomic_write },
+#endif
 	{ "bind",               &unix_bind },
 	{ "bitand",             &unix_bitand },
 	{ "bitor",              &unix_bitor },
+	{ "channel",            &unix_channel },
 	{ "chdir",              &unix_chdir },
 	{ "chmod",              &unix_chmod },
 	{ "chown",              &unix_chown },
@@ -10639,10 +16833,17 @@ static const luaL_Reg unix_routines[] = {
 	{ "clearerr",           &unix_clearerr },
 	{ "clock_gettime",      &unix_clock_gettime },
 	{ "close",              &unix_close },
+	{ "close_range",        &unix_close_range },
 	{ "closedir",           &unix_closedir },
+	{ "closefrom",          &unix_closefrom },
 	{ "closelog",           &unix_closelog },
 	{ "compl",              &unix_compl },
 	{ "connect",            &unix_connect },
+	{ "dirat",              &unix_dirat },
+	{ "dircache",           &unix_dircache },
+#if HAVE_FSTATAT && HAVE_FDOPENDIR
+	{ "du",                 &unix_du },
+#endif
 	{ "dup",                &unix_dup },
 	{ "dup2",               &unix_dup2 },
 #if HAVE_DUP3
@@ -10654,10 +16855,17 @@ static const luaL_Reg unix_routines[] = {
 	{ "execvp",             &unix_execvp },
 	{ "_exit",              &unix__exit },
 	{ "exit",               &unix_exit },
+#if defined SEEK_DATA && defined SEEK_HOLE
+	{ "extents",            &unix_extents },
+#endif
 	{ "faccessat",          &unix_faccessat },
+#if HAVE_FALLOCATE
+	{ "fallocate",          &unix_fallocate },
+#endif
 	{ "fchmod",             &unix_chmod },
 	{ "fchown",             &unix_chown },
 	{ "fcntl",              &unix_fcntl },
+	{ "fd",                 &unix_fd },
 #if HAVE_FDATASYNC
 	{ "fdatasync",          &unix_fdatasync },
 #endif
@@ -10671,11 +16879,16 @@ static const luaL_Reg unix_routines[] = {
 	{ "fgetc",              &unix_fgetc },
 	{ "fileno",             &unix_fileno },
 	{ "flockfile",          &unix_flockfile },
+#if HAVE_FMEMOPEN
+	{ "fmemopen",           &unix_fmemopen },
+#endif
 	{ "fnmatch",            &unix_fnmatch },
+	{ "fnmatchcomp",        &unix_fnmatchcomp },
 	{ "fstat",              &unix_stat },
 #if HAVE_FSTATAT
 	{ "fstatat",            &unix_fstatat },
 #endif
+	{ "fstatvfs",           &unix_statvfs },
 	{ "fsync",              &unix_fsync },
 	{ "ftrylockfile",       &unix_ftrylockfile },
 	{ "funlockfile",        &unix_funlockfile },
@@ -10700,6 +16913,9 @@ static const luaL_Reg unix_routines[] = {
 	{ "getgroups",          &unix_getgroups },
 	{ "gethostname",        &unix_gethostname },
 	{ "getifaddrs",         &unix_getifaddrs },
+#if HAVE_FOPENCOOKIE || HAVE_FUNOPEN
+	{ "getmemstream",       &unix_getmemstream },
+#endif
 	{ "getnameinfo",        &unix_getnameinfo },
 	{ "getopt",             &unix_getopt },
 	{ "getpeername",        &unix_getpeername },
@@ -10715,6 +16931,7 @@ static const luaL_Reg unix_routines[] = {
 	{ "getsockname",        &unix_getsockname },
 	{ "gettimeofday",       &unix_gettimeofday },
 	{ "getuid",             &unix_getuid },
+	{ "glob",               &unix_glob },
 	{ "grantpt",            &unix_grantpt },
 	{ "ioctl",              &unix_ioctl },
 	{ "isatty",             &unix_isatty },
@@ -10723,7 +16940,11 @@ static const luaL_Reg unix_routines[] = {
 	{ "lchown",             &unix_lchown },
 	{ "link",               &unix_link },
 	{ "listen",             &unix_listen },
+#if HAVE_FSTATAT && HAVE_FDOPENDIR
+	{ "loadsnapshot",       &unix_loadsnapshot },
+#endif
 	{ "lockf",              &unix_lockf },
+	{ "lockmgr",            &unix_lockmgr },
 	{ "LOG_MASK",           &unix_LOG_MASK },
 	{ "LOG_UPTO",           &unix_LOG_UPTO },
 	{ "lseek",              &unix_lseek },
@@ -10737,7 +16958,11 @@ static const luaL_Reg unix_routines[] = {
 	{ "mkfifoat",           &unix_mkfifoat },
 #endif
 	{ "mkpath",             &unix_mkpath },
+	{ "mkpaths",            &unix_mkpaths },
 	{ "open",               &unix_open },
+#if HAVE_FOPENCOOKIE || HAVE_FUNOPEN
+	{ "open_memstream",     &unix_open_memstream },
+#endif
 #if HAVE_OPENAT
 	{ "openat",             &unix_openat },
 #endif
@@ -10759,15 +16984,18 @@ static const luaL_Reg unix_routines[] = {
 	{ "pwrite",             &unix_pwrite },
 	{ "raise",              &unix_raise },
 	{ "read",               &unix_read },
+	{ "reader",             &unix_reader },
 	{ "readdir",            &unix_readdir },
 	{ "readlink",           &unix_readlink },
 #if HAVE_READLINKAT
 	{ "readlinkat",         &unix_readlinkat },
 #endif
 	{ "realpath",           &unix_realpath },
+	{ "realpathcache",      &unix_realpathcache },
 	{ "recv",               &unix_recv },
 	{ "recvfrom",           &unix_recvfrom },
 	{ "recvfromto",         &unix_recvfromto },
+	{ "recvmsg",            &unix_recvmsg },
 	{ "regcomp",            &unix_regcomp },
 	{ "regerror",           &unix_regerror },
 	{ "regexec",            &unix_regexec },
@@ -10778,6 +17006,9 @@ static const luaL_Reg unix_routines[] = {
 #endif
 	{ "rewinddir",          &unix_rewinddir },
 	{ "rmdir",              &unix_rmdir },
+#if HAVE_UNLINKAT && HAVE_FDOPENDIR
+	{ "rmtree",             &unix_rmtree },
+#endif
 	{ "S_ISBLK",            &unix_S_ISBLK },
 	{ "S_ISCHR",            &unix_S_ISCHR },
 	{ "S_ISDIR",            &unix_S_ISDIR },
@@ -10787,6 +17018,7 @@ static const luaL_Reg unix_routines[] = {
 	{ "S_ISSOCK",           &unix_S_ISSOCK },
 	{ "shutdown",           &unix_shutdown },
 	{ "send",               &unix_send },
+	{ "sendmsg",            &unix_sendmsg },
 	{ "sendto",             &unix_sendto },
 	{ "sendtofrom",         &unix_sendtofrom },
 	{ "setegid",            &unix_setegid },
@@ -10801,6 +17033,7 @@ static const luaL_Reg unix_routines[] = {
 	{ "setsockopt",         &unix_setsockopt },
 	{ "setsid",             &unix_setsid },
 	{ "setuid",             &unix_setuid },
+	{ "setvbuf",            &unix_setvbuf },
 	{ "sigaction",          &unix_sigaction },
 	{ "sigfillset",         &unix_sigfillset },
 	{ "sigemptyset",        &unix_sigemptyset },
@@ -10811,15 +17044,27 @@ static const luaL_Reg unix_routines[] = {
 	{ "sigtimedwait",       &unix_sigtimedwait },
 	{ "sigwait",            &unix_sigwait },
 	{ "sleep",              &unix_sleep },
+#if HAVE_FSTATAT && HAVE_FDOPENDIR
+	{ "snapshot",           &unix_snapshot },
+#endif
 	{ "socket",             &unix_socket },
 	{ "socketpair",         &unix_socketpair },
 	{ "stat",               &unix_stat },
+	{ "statfields",         &unix_statfields },
+#if HAVE_FSTATAT
+	{ "statmany",           &unix_statmany },
+#endif
+	{ "statvfs",            &unix_statvfs },
+#if __linux
+	{ "statvfsmounts",      &unix_statvfsmounts },
+#endif
 	{ "strerror",           &unix_strerror },
 	{ "strsignal",          &unix_strsignal },
 	{ "symlink",            &unix_symlink },
 #if HAVE_SYMLINKAT
 	{ "symlinkat",          &unix_symlinkat },
 #endif
+	{ "syncgroup",          &unix_syncgroup },
 	{ "sysconf",            &unix_sysconf },
 	{ "syslog",             &unix_syslog },
 	{ "tcgetpgrp",          &unix_tcgetpgrp },
@@ -10866,13 +17111,16 @@ static const luaL_Reg unsafe_routines[] = {
 	{ "setsockopt",   &unsafe_setsockopt },
 	{ "strlen",       &unsafe_strlen },
 	{ "strnlen",      &unsafe_strnlen },
+#if HAVE_VMSPLICE
+	{ "vmsplice",     &unsafe_vmsplice },
+#endif
 	{ NULL,         NULL }
 }; /* unsafe_routines[] */
 
 #define UNIX_CONST(x) { #x, x }
 
 struct unix_const {
-	char name[24];
+	char name[32];
 	long long value;
 }; /* struct unix_const */
 
@@ -11016,6 +17264,12 @@ static const struct unix_const const_mman[] = {
 }; /* const_mman[] */
 
 static const struct unix_const const_msg[] = {
+#if defined MSG_CMSG_CLOEXEC
+	UNIX_CONST(MSG_CMSG_CLOEXEC),
+#endif
+#if defined MSG_CTRUNC
+	UNIX_CONST(MSG_CTRUNC),
+#endif
 #if defined MSG_EOR
 	UNIX_CONST(MSG_EOR),
 #endif
@@ -11031,6 +17285,9 @@ static const struct unix_const const_msg[] = {
 #if defined MSG_PEEK
 	UNIX_CONST(MSG_PEEK),
 #endif
+#if defined MSG_TRUNC
+	UNIX_CONST(MSG_TRUNC),
+#endif
 #if defined MSG_WAITALL
 	UNIX_CONST(MSG_WAITALL),
 #endif
@@ -11321,6 +17578,17 @@ static const struct unix_const const_fnmatch[] = {
 	UNIX_CONST(FNM_NOESCAPE),
 }; /* const_fnmatch[] */
 
+static const struct unix_const const_glob[] = {
+	{ "GLOB_ERR",      U_GLOB_ERR },
+	{ "GLOB_MARK",     U_GLOB_MARK },
+	{ "GLOB_NOCHECK",  U_GLOB_NOCHECK },
+	{ "GLOB_NOESCAPE", U_GLOB_NOESCAPE },
+	{ "GLOB_NOSORT",   U_GLOB_NOSORT },
+	{ "GLOB_BRACE",    U_GLOB_BRACE },
+	{ "GLOB_ONLYDIR",  U_GLOB_ONLYDIR },
+	{ "GLOB_PERIOD",   U_GLOB_PERIOD },
+}; /* const_glob[] */
+
 static const struct unix_const const_iff[] = {
 #if defined IFF_UP
 	UNIX_CONST(IFF_UP),
@@ -11524,6 +17792,11 @@ static const struct unix_const const_fcntl[] = {
 	UNIX_CONST(AT_SYMLINK_NOFOLLOW_ANY),
 #endif
 
+	UNIX_CONST(CLOSE_RANGE_CLOEXEC),
+#if defined CLOSE_RANGE_UNSHARE
+	UNIX_CONST(CLOSE_RANGE_UNSHARE),
+#endif
+
 	UNIX_CONST(F_DUPFD),
 #if defined F_DUPFD_CLOEXEC
 	UNIX_CONST(F_DUPFD_CLOEXEC),
@@ -11537,10 +17810,25 @@ static const struct unix_const const_fcntl[] = {
 	UNIX_CONST(F_GETFD), UNIX_CONST(F_SETFD),
 	UNIX_CONST(F_GETFL), UNIX_CONST(F_SETFL),
 	UNIX_CONST(F_GETLK), UNIX_CONST(F_SETLK), UNIX_CONST(F_SETLKW),
+#if defined F_OFD_GETLK
+	UNIX_CONST(F_OFD_GETLK),
+#endif
+#if defined F_OFD_SETLK
+	UNIX_CONST(F_OFD_SETLK),
+#endif
+#if defined F_OFD_SETLKW
+	UNIX_CONST(F_OFD_SETLKW),
+#endif
 	UNIX_CONST(F_GETOWN), UNIX_CONST(F_SETOWN),
 #if defined F_GETPATH
 	UNIX_CONST(F_GETPATH),
 #endif
+#if defined F_GETPIPE_SZ
+	UNIX_CONST(F_GETPIPE_SZ),
+#endif
+#if defined F_SETPIPE_SZ
+	UNIX_CONST(F_SETPIPE_SZ),
+#endif
 #if defined F_GETPATH_NOFIRMLINK
 	UNIX_CONST(F_GETPATH_NOFIRMLINK),
 #endif
@@ -11561,6 +17849,28 @@ static const struct unix_const const_fcntl[] = {
 	UNIX_CONST(F_RDLCK), UNIX_CONST(F_WRLCK), UNIX_CONST(F_UNLCK),
 
 	UNIX_CONST(SEEK_SET), UNIX_CONST(SEEK_CUR), UNIX_CONST(SEEK_END),
+#if defined SEEK_DATA
+	UNIX_CONST(SEEK_DATA),
+#endif
+#if defined SEEK_HOLE
+	UNIX_CONST(SEEK_HOLE),
+#endif
+
+#if defined FALLOC_FL_KEEP_SIZE
+	UNIX_CONST(FALLOC_FL_KEEP_SIZE),
+#endif
+#if defined FALLOC_FL_PUNCH_HOLE
+	UNIX_CONST(FALLOC_FL_PUNCH_HOLE),
+#endif
+#if defined FALLOC_FL_COLLAPSE_RANGE
+	UNIX_CONST(FALLOC_FL_COLLAPSE_RANGE),
+#endif
+#if defined FALLOC_FL_ZERO_RANGE
+	UNIX_CONST(FALLOC_FL_ZERO_RANGE),
+#endif
+#if defined FALLOC_FL_INSERT_RANGE
+	UNIX_CONST(FALLOC_FL_INSERT_RANGE),
+#endif
 
 	UNIX_CONST(O_ACCMODE),
 	{ "O_CLOEXEC", U_CLOEXEC }, /* not natively supported on NetBSD 5.1 */
@@ -11620,8 +17930,26 @@ static const struct unix_const const_fcntl[] = {
 #if defined POSIX_FADV_WILLNEED
 	UNIX_CONST(POSIX_FADV_WILLNEED),
 #endif
+
+#if defined SPLICE_F_GIFT
+	UNIX_CONST(SPLICE_F_GIFT),
+#endif
+#if defined SPLICE_F_MORE
+	UNIX_CONST(SPLICE_F_MORE),
+#endif
+#if defined SPLICE_F_MOVE
+	UNIX_CONST(SPLICE_F_MOVE),
+#endif
+#if defined SPLICE_F_NONBLOCK
+	UNIX_CONST(SPLICE_F_NONBLOCK),
+#endif
 }; /* const_fcntl[] */
 
+static const struct unix_const const_statvfs[] = {
+	UNIX_CONST(ST_RDONLY),
+	UNIX_CONST(ST_NOSUID),
+}; /* const_statvfs[] */
+
 static const struct unix_const const_ioctl[] = {
 #if defined SIOCATMARK
 	UNIX_CONST(SIOCATMARK),
@@ -11695,6 +18023,7 @@ static const struct {
 	{ const_clock,    countof(const_clock) },
 	{ const_errno,    countof(const_errno) },
 	{ const_fnmatch,  countof(const_fnmatch) },
+	{ const_glob,     countof(const_glob) },
 	{ const_iff,      countof(const_iff) },
 	{ const_wait,     countof(const_wait) },
 	{ const_signal,   countof(const_signal) },
@@ -11702,6 +18031,7 @@ static const struct {
 	{ const_regex,    countof(const_regex) },
 	{ const_resource, countof(const_resource) },
 	{ const_fcntl,    countof(const_fcntl) },
+	{ const_statvfs,  countof(const_statvfs) },
 	{ const_ioctl,    countof(const_ioctl) },
 	{ const_locale,   countof(const_locale) },
 	{ const_unistd,   countof(const_unistd) },
@@ -11745,6 +18075,66 @@ int luaopen_unix(lua_State *L) {
 	unixL_newmetatable(L, "regex_t", NULL, regex_metamethods, 1);
 	lua_pop(L, 1);
 
+	/*
+	 * add fnmatch_t class
+	 */
+	lua_pushvalue(L, -1);
+	unixL_newmetatable(L, "fnmatch_t", fnm_methods, fnm_metamethods, 1);
+	lua_pop(L, 1);
+
+	/*
+	 * add struct reader class
+	 */
+	lua_pushvalue(L, -1);
+	unixL_newmetatable(L, "struct reader", rd_methods, rd_metamethods, 1);
+	lua_pop(L, 1);
+
+	/*
+	 * add struct syncgroup class
+	 */
+	lua_pushvalue(L, -1);
+	unixL_newmetatable(L, "struct syncgroup", sg_methods, sg_metamethods, 1);
+	lua_pop(L, 1);
+
+	/*
+	 * add struct fd class
+	 */
+	lua_pushvalue(L, -1);
+	unixL_newmetatable(L, "struct fd", fdobj_methods, fdobj_metamethods, 1);
+	lua_pop(L, 1);
+
+	/*
+	 * add struct channel class
+	 */
+	lua_pushvalue(L, -1);
+	unixL_newmetatable(L, "struct channel", ch_methods, ch_metamethods, 1);
+	lua_pop(L, 1);
+
+	/*
+	 * add struct lockmgr class
+	 */
+	lua_pushvalue(L, -1);
+	unixL_newmetatable(L, "struct lockmgr", lm_methods, lm_metamethods, 1);
+	lua_pop(L, 1);
+
+#if HAVE_FOPENCOOKIE || HAVE_FUNOPEN
+	/*
+	 * add struct memstream class
+	 */
+	lua_pushvalue(L, -1);
+	unixL_newmetatable(L, "struct memstream", ms_methods, ms_metamethods, 1);
+	lua_pop(L, 1);
+#endif
+
+#if HAVE_FSTATAT && HAVE_FDOPENDIR
+	/*
+	 * add struct snapshot class
+	 */
+	lua_pushvalue(L, -1);
+	unixL_newmetatable(L, "struct snapshot", snap_methods, snap_metamethods, 1);
+	lua_pop(L, 1);
+#endif
+
 	/*
 	 * add sigset_t class
 	 */
@@ -11768,6 +18158,13 @@ int luaopen_unix(lua_State *L) {
 	unixL_newmetatable(L, "struct sockaddr", NULL, sa_metamethods, 1);
 	lua_pop(L, 1);
 
+	/*
+	 * add struct st_fields class
+	 */
+	lua_pushvalue(L, -1);
+	unixL_newmetatable(L, "struct st_fields", NULL, stf_metamethods, 1);
+	lua_pop(L, 1);
+
 	/*
 	 * insert unix routines into module table with unixL_State as upvalue
 	 */